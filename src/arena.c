@@ -0,0 +1,251 @@
+#include "fireant.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Size-class arena for JS heaps. Small allocations are carved out of large
+ * blocks and recycled through a free list per size class, so a runtime
+ * rarely calls the global malloc after warming up. Allocations above the
+ * largest class are malloc'ed but tracked, freeing the arena releases
+ * everything at once no matter what is still allocated from it.
+ *
+ * Every allocation is preceded by a 16 byte header holding its size class,
+ * which keeps the payload 16 byte aligned like malloc's.
+ */
+
+#define FA_ARENA_DEFAULT_BLOCK_SIZE (256 * 1024)
+#define FA_ARENA_LARGE 0xff
+
+static const uint32_t fa_arena_classes[] = {
+    16, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512, 768,
+    1024, 1536, 2048, 3072, 4096,
+};
+
+#define FA_ARENA_CLASS_COUNT (sizeof(fa_arena_classes) / sizeof(fa_arena_classes[0]))
+#define FA_ARENA_MAX_SMALL 4096
+
+typedef struct fa_arena_hdr_s {
+    size_t size;
+    uint32_t cls;
+    uint32_t pad;
+} fa_arena_hdr_t;
+
+typedef struct fa_arena_large_s {
+    struct fa_arena_large_s *prev;
+    struct fa_arena_large_s *next;
+    fa_arena_hdr_t hdr;
+} fa_arena_large_t;
+
+typedef struct fa_arena_block_s {
+    struct fa_arena_block_s *next;
+    size_t pad;
+    uint8_t data[];
+} fa_arena_block_t;
+
+/* free slots are linked through their payload */
+typedef struct fa_arena_slot_s {
+    struct fa_arena_slot_s *next;
+} fa_arena_slot_t;
+
+struct fa_arena_s {
+    size_t block_size;
+    fa_arena_block_t *blocks;
+    /* bump pointer into the newest block */
+    uint8_t *cur;
+    uint8_t *end;
+    fa_arena_slot_t *free_lists[FA_ARENA_CLASS_COUNT];
+    fa_arena_large_t *large;
+    /* bytes taken from the global malloc */
+    size_t reserved;
+};
+
+/* index of the size class for 1..FA_ARENA_MAX_SMALL bytes */
+static uint8_t fa_arena_class_index[FA_ARENA_MAX_SMALL / 16 + 1];
+static uv_once_t fa_arena_once = UV_ONCE_INIT;
+
+static void fa_arena_init_classes (void) {
+    size_t i, cls = 0;
+
+    for (i = 0; i <= FA_ARENA_MAX_SMALL / 16; i++) {
+        while (fa_arena_classes[cls] < i * 16)
+            cls++;
+        fa_arena_class_index[i] = cls;
+    }
+}
+
+fa_arena_t *fa_new_arena (size_t block_size) {
+    fa_arena_t *a;
+
+    uv_once(&fa_arena_once, fa_arena_init_classes);
+
+    a = malloc(sizeof(fa_arena_t));
+    if (!a)
+        return NULL;
+    memset(a, 0, sizeof(fa_arena_t));
+
+    if (block_size == 0)
+        block_size = FA_ARENA_DEFAULT_BLOCK_SIZE;
+    /* every block fits at least one slot of the largest class */
+    if (block_size < sizeof(fa_arena_hdr_t) + FA_ARENA_MAX_SMALL)
+        block_size = sizeof(fa_arena_hdr_t) + FA_ARENA_MAX_SMALL;
+    a->block_size = block_size;
+    return a;
+}
+
+void fa_free_arena (fa_arena_t *a) {
+    while (a->blocks) {
+        fa_arena_block_t *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    while (a->large) {
+        fa_arena_large_t *l = a->large;
+        a->large = l->next;
+        free(l);
+    }
+    free(a);
+}
+
+size_t fa_arena_reserved (fa_arena_t *a) {
+    return a->reserved;
+}
+
+static void *fa_arena_alloc (fa_arena_t *a, size_t size) {
+    fa_arena_hdr_t *h;
+    fa_arena_slot_t *slot;
+    size_t slot_size;
+    uint32_t cls;
+
+    if (size > FA_ARENA_MAX_SMALL) {
+        fa_arena_large_t *l = malloc(sizeof(fa_arena_large_t) + size);
+        if (!l)
+            return NULL;
+        l->prev = NULL;
+        l->next = a->large;
+        if (a->large)
+            a->large->prev = l;
+        a->large = l;
+        l->hdr.size = size;
+        l->hdr.cls = FA_ARENA_LARGE;
+        a->reserved += sizeof(fa_arena_large_t) + size;
+        return &l->hdr + 1;
+    }
+
+    cls = fa_arena_class_index[(size + 15) / 16];
+    slot = a->free_lists[cls];
+    if (slot) {
+        a->free_lists[cls] = slot->next;
+        return slot;
+    }
+
+    slot_size = sizeof(fa_arena_hdr_t) + fa_arena_classes[cls];
+    if (a->end - a->cur < (ptrdiff_t) slot_size) {
+        /* the tail of the old block is left unused */
+        fa_arena_block_t *b = malloc(sizeof(fa_arena_block_t) + a->block_size);
+        if (!b)
+            return NULL;
+        b->next = a->blocks;
+        a->blocks = b;
+        a->cur = b->data;
+        a->end = b->data + a->block_size;
+        a->reserved += sizeof(fa_arena_block_t) + a->block_size;
+    }
+
+    h = (fa_arena_hdr_t *) a->cur;
+    a->cur += slot_size;
+    h->size = fa_arena_classes[cls];
+    h->cls = cls;
+    return h + 1;
+}
+
+static void fa_arena_release (fa_arena_t *a, void *ptr) {
+    fa_arena_hdr_t *h = (fa_arena_hdr_t *) ptr - 1;
+    fa_arena_slot_t *slot;
+
+    if (h->cls == FA_ARENA_LARGE) {
+        fa_arena_large_t *l = (fa_arena_large_t *) ((uint8_t *) h - offsetof(fa_arena_large_t, hdr));
+        if (l->prev)
+            l->prev->next = l->next;
+        else
+            a->large = l->next;
+        if (l->next)
+            l->next->prev = l->prev;
+        a->reserved -= sizeof(fa_arena_large_t) + l->hdr.size;
+        free(l);
+        return;
+    }
+
+    slot = ptr;
+    slot->next = a->free_lists[h->cls];
+    a->free_lists[h->cls] = slot;
+}
+
+static size_t fa_arena_usable_size (const void *ptr) {
+    const fa_arena_hdr_t *h = (const fa_arena_hdr_t *) ptr - 1;
+    return h->size;
+}
+
+/* JSMallocFunctions, the limit is enforced here like QuickJS' default does */
+
+static void *fa_arena_js_malloc (JSMallocState *s, size_t size) {
+    void *ptr;
+
+    if (s->malloc_size + size > s->malloc_limit)
+        return NULL;
+
+    ptr = fa_arena_alloc(s->opaque, size);
+    if (!ptr)
+        return NULL;
+
+    s->malloc_count++;
+    s->malloc_size += fa_arena_usable_size(ptr);
+    return ptr;
+}
+
+static void fa_arena_js_free (JSMallocState *s, void *ptr) {
+    if (!ptr)
+        return;
+
+    s->malloc_count--;
+    s->malloc_size -= fa_arena_usable_size(ptr);
+    fa_arena_release(s->opaque, ptr);
+}
+
+static void *fa_arena_js_realloc (JSMallocState *s, void *ptr, size_t size) {
+    size_t old_size;
+    void *new_ptr;
+
+    if (!ptr)
+        return size ? fa_arena_js_malloc(s, size) : NULL;
+
+    old_size = fa_arena_usable_size(ptr);
+    if (size == 0) {
+        fa_arena_js_free(s, ptr);
+        return NULL;
+    }
+
+    /* still fits its size class */
+    if (size <= old_size && (old_size > FA_ARENA_MAX_SMALL ? size > FA_ARENA_MAX_SMALL : 1))
+        return ptr;
+
+    if (s->malloc_size + size - old_size > s->malloc_limit)
+        return NULL;
+
+    new_ptr = fa_arena_alloc(s->opaque, size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+
+    s->malloc_size += fa_arena_usable_size(new_ptr) - old_size;
+    fa_arena_release(s->opaque, ptr);
+    return new_ptr;
+}
+
+const JSMallocFunctions fa_arena_malloc_functions = {
+    fa_arena_js_malloc,
+    fa_arena_js_free,
+    fa_arena_js_realloc,
+    fa_arena_usable_size,
+};
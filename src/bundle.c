@@ -0,0 +1,83 @@
+#include "bundle.h"
+#include <string.h>
+
+static const char fa_sig[] = "FaBC";
+
+void fa_bundle_get_entry (const fa_bundle_t *b, uint32_t idx, fa_bundle_entry_t *e) {
+    /* the caller's buffer is not required to be aligned */
+    memcpy(e, b->buf + b->header.toc_offset + (uint64_t)idx * sizeof(fa_bundle_entry_t), sizeof(fa_bundle_entry_t));
+}
+
+const char *fa_bundle_entry_name (const fa_bundle_t *b, const fa_bundle_entry_t *e) {
+    return (const char *)b->buf + e->name_offset;
+}
+
+const char *fa_bundle_open (fa_bundle_t *b, const uint8_t *buf, size_t buf_len) {
+    fa_bundle_entry_t e;
+    const char *prev_name = NULL;
+    uint64_t toc_end;
+
+    memset(b, 0, sizeof(fa_bundle_t));
+
+    if (buf_len < sizeof(fa_bundle_header_t) || memcmp(buf, fa_sig, 4) != 0)
+        return "not a FaBC bundle";
+
+    memcpy(&b->header, buf, sizeof(fa_bundle_header_t));
+
+    if (b->header.version != FA_BUNDLE_VERSION)
+        return "unsupported bundle version";
+    if ((b->header.flags & FA_BUNDLE_BIG_ENDIAN) != fa_bundle_host_flags())
+        return "bundle was built for a host with a different byte order";
+    if (b->header.size != buf_len)
+        return "bundle is truncated";
+    if (b->header.toc_offset < sizeof(fa_bundle_header_t) || 
+        b->header.toc_offset > buf_len ||
+        b->header.module_count > (buf_len - b->header.toc_offset) / sizeof(fa_bundle_entry_t))
+        return "bundle table of contents is out of bounds";
+    if (b->header.main_index != FA_BUNDLE_NO_MAIN && b->header.main_index >= b->header.module_count)
+        return "bundle main module is out of bounds";
+
+    b->buf = buf;
+    b->size = buf_len;
+
+    toc_end = b->header.toc_offset + (uint64_t)b->header.module_count * sizeof(fa_bundle_entry_t);
+
+    for (uint32_t i = 0; i < b->header.module_count; i++) {
+        fa_bundle_get_entry(b, i, &e);
+
+        if (e.offset < toc_end || e.offset % FA_BUNDLE_ALIGN != 0 || 
+            e.offset > buf_len || e.length > buf_len - e.offset)
+            return "bundle module is out of bounds";
+
+        if (e.name_offset < toc_end || e.name_offset >= buf_len || 
+            e.name_len >= buf_len - e.name_offset || 
+            buf[e.name_offset + e.name_len] != '\0')
+            return "bundle module name is out of bounds";
+
+        /* fa_bundle_find depends on the toc being sorted */
+        const char *name = fa_bundle_entry_name(b, &e);
+        if (prev_name && strcmp(prev_name, name) >= 0)
+            return "bundle table of contents is not sorted";
+        prev_name = name;
+    }
+
+    return NULL;
+}
+
+int64_t fa_bundle_find (const fa_bundle_t *b, const char *name, fa_bundle_entry_t *e) {
+    int64_t lo = 0, hi = (int64_t)b->header.module_count - 1;
+
+    while (lo <= hi) {
+        int64_t mid = lo + ((hi - lo) >> 1);
+        fa_bundle_get_entry(b, mid, e);
+        int cmp = strcmp(fa_bundle_entry_name(b, e), name);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
@@ -0,0 +1,79 @@
+#ifndef FA_BUNDLE_H
+#define FA_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * FaBC v2 bundle layout:
+ * 
+ * [header][toc entries][names][pad][module blob][pad][module blob]...
+ * 
+ * All fields are stored in host byte order, the header flags record which one
+ * was used since the QuickJS bytecode itself is not portable either. The toc
+ * is sorted by module name so a module can be found with a binary search and
+ * every blob starts on a FA_BUNDLE_ALIGN boundary.
+ */
+
+#define FA_BUNDLE_VERSION 2
+#define FA_BUNDLE_ALIGN 16
+/* main_index of bundles which only provide modules */
+#define FA_BUNDLE_NO_MAIN UINT32_MAX
+
+/* bundle flags */
+#define FA_BUNDLE_BIG_ENDIAN (1 << 0)
+
+/* module flags */
+#define FA_BUNDLE_MOD_LOAD_ONLY (1 << 0)
+/* blob is a uint64_t bytecode length followed by a fa_lz_compress block */
+#define FA_BUNDLE_MOD_COMPRESSED (1 << 1)
+
+struct fa_bundle_header_s {
+    char        sig[4];
+    uint16_t    version;
+    uint16_t    flags;
+    uint32_t    module_count;
+    uint32_t    main_index;
+    uint64_t    toc_offset;
+    /* total size of the bundle, catches truncated files */
+    uint64_t    size;
+};
+
+typedef struct fa_bundle_header_s fa_bundle_header_t;
+
+struct fa_bundle_entry_s {
+    uint64_t    offset;
+    uint64_t    length;
+    /* NUL terminated, name_len excludes the terminator */
+    uint64_t    name_offset;
+    uint32_t    name_len;
+    uint32_t    flags;
+};
+
+typedef struct fa_bundle_entry_s fa_bundle_entry_t;
+
+struct fa_bundle_s {
+    const uint8_t       *buf;
+    size_t              size;
+    fa_bundle_header_t  header;
+};
+
+typedef struct fa_bundle_s fa_bundle_t;
+
+static inline int fa_bundle_host_flags (void) {
+    const uint16_t probe = 1;
+    return *(const uint8_t *)&probe ? 0 : FA_BUNDLE_BIG_ENDIAN;
+}
+
+static inline size_t fa_bundle_align (size_t off) {
+    return (off + FA_BUNDLE_ALIGN - 1) & ~(size_t)(FA_BUNDLE_ALIGN - 1);
+}
+
+// validate the header and toc, returns a static error message or NULL on success
+const char *fa_bundle_open (fa_bundle_t *b, const uint8_t *buf, size_t buf_len);
+void fa_bundle_get_entry (const fa_bundle_t *b, uint32_t idx, fa_bundle_entry_t *e);
+const char *fa_bundle_entry_name (const fa_bundle_t *b, const fa_bundle_entry_t *e);
+// binary search the toc, returns the entry index or -1
+int64_t fa_bundle_find (const fa_bundle_t *b, const char *name, fa_bundle_entry_t *e);
+
+#endif
@@ -0,0 +1,136 @@
+#include "cache.h"
+#include "utils.h"
+#include "fireant.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+static const char fa_cache_sig[] = "FaCC";
+
+uint64_t fa_cache_key (const char *name, uint64_t source_hash, int flags) {
+    const char *qjs_ver = fa_get_qjs_ver();
+    /* bytecode is not compatible between QuickJS versions */
+    uint64_t hash = fa_hash_bytes(qjs_ver, strlen(qjs_ver) + 1, FA_HASH_SEED);
+    hash = fa_hash_bytes(&flags, sizeof(flags), hash);
+    /* the module name is part of the bytecode */
+    hash = fa_hash_bytes(name, strlen(name) + 1, hash);
+    return fa_hash_bytes(&source_hash, sizeof(source_hash), hash);
+}
+
+/* FNV-1a over the bytes in reverse, unrelated to the forward hash */
+static uint64_t fa_cache_source_check (const uint8_t *source, size_t source_size) {
+    uint64_t h = FA_HASH_SEED;
+    while (source_size > 0) {
+        h ^= source[--source_size];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void fa_cache_init_header (
+    fa_cache_header_t *hdr,
+    const char *name,
+    const uint8_t *source,
+    size_t source_size,
+    int flags,
+    int64_t source_mtime
+) {
+    uint64_t source_hash = fa_hash_bytes(source, source_size, FA_HASH_SEED);
+
+    memset(hdr, 0, sizeof(fa_cache_header_t));
+    memcpy(hdr->sig, fa_cache_sig, 4);
+    hdr->version = FA_CACHE_VERSION;
+    hdr->key = fa_cache_key(name, source_hash, flags);
+    hdr->source_hash = source_hash;
+    hdr->source_check = fa_cache_source_check(source, source_size);
+    hdr->source_size = source_size;
+    hdr->source_mtime = source_mtime;
+}
+
+static void fa_cache_path (char *buf, size_t buf_size, const char *dir, uint64_t key) {
+    snprintf(buf, buf_size, "%s/%016llx.fac", dir, (unsigned long long)key);
+}
+
+uint8_t *fa_cache_read (const char *dir, const fa_cache_header_t *expect, size_t *psize) {
+    char path[PATH_MAX];
+    fa_cache_header_t hdr;
+    uint8_t *buf;
+    FILE *f;
+
+    fa_cache_path(path, sizeof(path), dir, expect->key);
+
+    f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.sig, fa_cache_sig, 4) != 0 ||
+        hdr.version != FA_CACHE_VERSION ||
+        hdr.key != expect->key ||
+        hdr.source_hash != expect->source_hash ||
+        hdr.source_check != expect->source_check ||
+        hdr.source_size != expect->source_size ||
+        hdr.source_mtime != expect->source_mtime ||
+        hdr.size > SIZE_MAX)
+        goto fail;
+
+    buf = malloc(hdr.size ? hdr.size : 1);
+    if (!buf)
+        goto fail;
+    if (fread(buf, 1, hdr.size, f) != hdr.size) {
+        free(buf);
+        goto fail;
+    }
+
+    fclose(f);
+    *psize = hdr.size;
+    return buf;
+
+fail:
+    fclose(f);
+    return NULL;
+}
+
+int fa_cache_write (const char *dir, const fa_cache_header_t *hdr, const uint8_t *buf, size_t size) {
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    fa_cache_header_t out = *hdr;
+    FILE *f;
+
+    out.size = size;
+    fa_cache_path(path, sizeof(path), dir, hdr->key);
+
+#if defined(_WIN32)
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    f = fopen(tmp_path, "wb");
+#else
+    mkdir(dir, 0755);
+    /* written next to the entry and renamed, so concurrent readers never see 
+       a partial entry */
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.fac-XXXXXX", dir);
+    int fd = mkstemp(tmp_path);
+    f = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (fd >= 0 && !f)
+        close(fd);
+#endif
+    if (!f)
+        return -1;
+
+    if (fwrite(&out, sizeof(out), 1, f) != 1 || 
+        (size && fwrite(buf, size, 1, f) != 1)) {
+        fclose(f);
+        remove(tmp_path);
+        return -1;
+    }
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
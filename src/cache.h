@@ -0,0 +1,47 @@
+#ifndef FA_CACHE_H
+#define FA_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * On-disk bytecode cache shared by fa-c and the runtime. Every entry is one
+ * file named after its key holding a header and the JS_WriteObject output.
+ */
+
+#define FA_CACHE_VERSION 2
+
+struct fa_cache_header_s {
+    char        sig[4];
+    uint32_t    version;
+    /* fa_cache_key of the entry, guards against renamed files */
+    uint64_t    key;
+    uint64_t    source_size;
+    /* 0 if the entry is only validated by the source hash */
+    int64_t     source_mtime;
+    uint64_t    source_hash;
+    /* a second hash of the source, read back to front, so a hit needs two
+       independent 64-bit collisions on a source of the same size */
+    uint64_t    source_check;
+    uint64_t    size;
+};
+
+typedef struct fa_cache_header_s fa_cache_header_t;
+
+// identifies the bytecode of a module: name, source, compile flags and QuickJS version
+uint64_t fa_cache_key (const char *name, uint64_t source_hash, int flags);
+// returns the malloc'd bytecode if the entry exists and matches the expected header fields
+uint8_t *fa_cache_read (const char *dir, const fa_cache_header_t *expect, size_t *psize);
+// atomically replaces the entry, returns -1 on failure
+int fa_cache_write (const char *dir, const fa_cache_header_t *hdr, const uint8_t *buf, size_t size);
+// fills in the key and the source fields for the source of module name compiled with flags
+void fa_cache_init_header (
+    fa_cache_header_t *hdr,
+    const char *name,
+    const uint8_t *source,
+    size_t source_size,
+    int flags,
+    int64_t source_mtime
+);
+
+#endif
@@ -8,18 +8,16 @@ int main () {
 
     fa_runtime_t *rt = fa_new_runtime();
 
-    js_init_module_std(fa_get_context(rt), "std");
-
-    FILE *f = fopen("/home/wykerd/sources/fireant/compile.bin", "rb");
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);  /* same as rewind(f); */
+    fa_set_stdout_buffered(rt, 64 * 1024);
 
-    char *string = malloc(fsize + 1);
-    fread(string, 1, fsize, f);
-    fclose(f);
+    js_init_module_std(fa_get_context(rt), "std");
+    js_init_module_timers(fa_get_context(rt), "timers");
+    js_init_module_fs(fa_get_context(rt), "fs");
 
-    fa_eval_bin_bundle(fa_get_context(rt), string, fsize, 0);
+    if (fa_eval_bin_bundle_file(fa_get_context(rt), "/home/wykerd/sources/fireant/compile.bin", 0) < 0) {
+        fa_free_runtime(rt);
+        return 1;
+    }
 
     // char *script = "import yes from '../test.js'; import { print } from 'std'; print('Hello World', 123, yes());";
 
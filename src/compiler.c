@@ -1,8 +1,13 @@
 #include "compiler.h"
+#include "fireant.h"
+#include "runtime.h"
 #include <quickjs.h>
 #include <cutils.h>
 #include "utils.h"
 #include "modules.h"
+#include "bundle.h"
+#include "compress.h"
+#include "cache.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,6 +15,8 @@
 #include <inttypes.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <limits.h>
 
 static const char fa_sig[] = "FaBC";
 
@@ -60,35 +67,310 @@ static namelist_entry_t *namelist_find(namelist_t *lp, const char *name)
     return NULL;
 }
 
-static void output_object_code (
+fa_compile_cache_t *compile_cache_new (void) {
+    fa_compile_cache_t *cache = malloc(sizeof(fa_compile_cache_t));
+    memset(cache, 0, sizeof(fa_compile_cache_t));
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void compile_cache_free (fa_compile_cache_t *cache) {
+    for (int i = 0; i < FA_COMPILE_CACHE_BUCKETS; i++) {
+        while (cache->buckets[i]) {
+            fa_compile_cache_entry_t *e = cache->buckets[i];
+            cache->buckets[i] = e->next;
+            free(e->name);
+            free(e->source);
+            free(e->buf);
+            free(e);
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static int compile_cache_match (
+    const fa_compile_cache_entry_t *e,
+    uint64_t hash,
+    const char *name,
+    const uint8_t *source,
+    size_t source_size
+) {
+    return e->hash == hash && e->source_size == source_size && !strcmp(e->name, name) &&
+        !memcmp(e->source, source, source_size);
+}
+
+/* entries are immutable once added, so the result stays valid without the lock */
+static fa_compile_cache_entry_t *compile_cache_find (
+    fa_compile_cache_t *cache,
+    uint64_t hash,
+    const char *name,
+    const uint8_t *source,
+    size_t source_size
+) {
+    fa_compile_cache_entry_t *e;
+
+    pthread_mutex_lock(&cache->lock);
+    for (e = cache->buckets[hash % FA_COMPILE_CACHE_BUCKETS]; e != NULL; e = e->next) {
+        if (compile_cache_match(e, hash, name, source, source_size))
+            break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return e;
+}
+
+static void compile_cache_add (
+    fa_compile_cache_t *cache,
+    uint64_t hash,
+    const char *name,
+    const uint8_t *source,
+    size_t source_size,
+    const uint8_t *buf,
+    size_t size
+) {
+    fa_compile_cache_entry_t *e = malloc(sizeof(fa_compile_cache_entry_t));
+    e->hash = hash;
+    e->name = strdup(name);
+    e->source = malloc(source_size);
+    memcpy(e->source, source, source_size);
+    e->source_size = source_size;
+    e->buf = malloc(size);
+    memcpy(e->buf, buf, size);
+    e->size = size;
+
+    /* another thread compiling the same module first is harmless, the bytecode
+       is identical, so the entry is only added if there is none yet */
+    pthread_mutex_lock(&cache->lock);
+    fa_compile_cache_entry_t **head = &cache->buckets[hash % FA_COMPILE_CACHE_BUCKETS];
+    fa_compile_cache_entry_t *it;
+    for (it = *head; it != NULL; it = it->next) {
+        if (compile_cache_match(it, hash, name, source, source_size))
+            break;
+    }
+    if (!it) {
+        e->next = *head;
+        *head = e;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (it) {
+        free(e->name);
+        free(e->source);
+        free(e->buf);
+        free(e);
+    }
+}
+
+/* returns a malloc'd copy of the cached bytecode */
+static uint8_t *compile_cache_lookup (
+    fa_compile_t *cmp,
+    const char *name,
+    const fa_cache_header_t *hdr,
+    const uint8_t *source,
+    size_t *psize
+) {
+    fa_compile_cache_entry_t *e;
+    uint8_t *buf;
+
+    if (cmp->cache) {
+        e = compile_cache_find(cmp->cache, hdr->key, name, source, hdr->source_size);
+        if (e) {
+            buf = malloc(e->size);
+            memcpy(buf, e->buf, e->size);
+            *psize = e->size;
+            return buf;
+        }
+    }
+
+    if (cmp->cache_dir) {
+        buf = fa_cache_read(cmp->cache_dir, hdr, psize);
+        if (buf) {
+            if (cmp->cache)
+                compile_cache_add(cmp->cache, hdr->key, name, source, hdr->source_size, buf, *psize);
+            return buf;
+        }
+    }
+
+    return NULL;
+}
+
+static void compile_cache_store (
+    fa_compile_t *cmp,
+    const char *name,
+    const fa_cache_header_t *hdr,
+    const uint8_t *source,
+    const uint8_t *buf,
+    size_t size
+) {
+    if (cmp->cache)
+        compile_cache_add(cmp->cache, hdr->key, name, source, hdr->source_size, buf, size);
+    if (cmp->cache_dir && fa_cache_write(cmp->cache_dir, hdr, buf, size) < 0)
+        fprintf(stderr, "Warning: could not write the cache entry for '%s'\n", name);
+}
+
+static void compile_cache_header (
+    fa_cache_header_t *hdr,
+    const char *name,
+    const uint8_t *source,
+    size_t source_size,
+    int eval_flags
+) {
+    fa_cache_init_header(hdr, name, source, source_size, eval_flags, 0);
+}
+
+static fa_compile_module_t *output_module (
+    fa_compile_t *cmp, 
+    const char *name,
+    const uint8_t *buf,
+    size_t size,
+    BOOL load_only
+) {
+    fa_compile_module_t *mod;
+
+    printf("Module size: %zu Bytes\n", size);
+
+    if (cmp->module_count == cmp->module_size) {
+        cmp->module_size = cmp->module_size + (cmp->module_size >> 1) + 4;
+        cmp->modules = realloc(cmp->modules, sizeof(fa_compile_module_t) * cmp->module_size);
+    }
+
+    if (!load_only)
+        cmp->main_index = cmp->module_count;
+
+    mod = &cmp->modules[cmp->module_count++];
+    mod->name = strdup(name);
+    mod->buf = malloc(size);
+    memcpy(mod->buf, buf, size);
+    mod->size = size;
+    mod->flags = load_only ? FA_BUNDLE_MOD_LOAD_ONLY : 0;
+
+    return mod;
+}
+
+/* NULL with the exception pending if the bytecode can not be written */
+static fa_compile_module_t *output_object_code (
     JSContext *ctx,
     fa_compile_t *cmp, 
+    const char *name,
     JSValueConst obj,
     BOOL load_only
 ) {
     uint8_t *out_buf;
     size_t out_buf_len;
+    fa_compile_module_t *mod;
+
     out_buf = JS_WriteObject(ctx, &out_buf_len, obj, JS_WRITE_OBJ_BYTECODE);
-    if (!out_buf) {
-        fa_dump_error(ctx);
-        exit(1);
+    if (!out_buf)
+        return NULL;
+
+    mod = output_module(cmp, name, out_buf, out_buf_len, load_only);
+
+    js_free(ctx, out_buf);
+
+    return mod;
+}
+
+static int compile_module_cmp (const void *a, const void *b) {
+    return strcmp(((const fa_compile_module_t *)a)->name, ((const fa_compile_module_t *)b)->name);
+}
+
+static void compress_module (
+    fa_compile_module_t *mod
+) {
+    uint64_t raw_len = mod->size;
+    uint8_t *out = malloc(sizeof(uint64_t) + fa_lz_compress_bound(mod->size));
+    size_t out_len = sizeof(uint64_t) + fa_lz_compress(mod->buf, mod->size, out + sizeof(uint64_t));
+
+    /* incompressible modules are stored as is */
+    if (out_len >= mod->size) {
+        free(out);
+        return;
     }
 
-    size_t cursor = cmp->output.size;
+    printf("Compressed module '%s': %zu -> %zu Bytes\n", mod->name, mod->size, out_len);
 
-    printf("Module size: %d Bytes\n", out_buf_len);
+    memcpy(out, &raw_len, sizeof(uint64_t));
+    free(mod->buf);
+    mod->buf = out;
+    mod->size = out_len;
+    mod->flags |= FA_BUNDLE_MOD_COMPRESSED;
+}
 
-    cmp->output.size = cmp->output.size + sizeof(size_t) + 1 + out_buf_len;
+static void write_bundle (
+    fa_compile_t *cmp
+) {
+    fa_bundle_header_t header;
+    fa_bundle_entry_t entry;
+    fa_compile_module_t *mod;
+    const char *main_name = NULL;
+    size_t cursor;
+    uint32_t i;
 
-    cmp->output.buf = realloc(cmp->output.buf, cmp->output.size);
+    if (cmp->main_index != FA_BUNDLE_NO_MAIN)
+        main_name = cmp->modules[cmp->main_index].name;
 
-    memcpy(cmp->output.buf + cursor, &out_buf_len, sizeof(size_t));
-    cursor += sizeof(size_t);
-    memcpy(cmp->output.buf + cursor, &load_only, 1);
-    cursor += 1;
-    memcpy(cmp->output.buf + cursor, out_buf, out_buf_len);
+    if (cmp->flags & FA_COMPILE_COMPRESS) {
+        for (i = 0; i < cmp->module_count; i++)
+            compress_module(&cmp->modules[i]);
+    }
 
-    js_free(ctx, out_buf);
+    /* the runtime binary searches the toc by name */
+    qsort(cmp->modules, cmp->module_count, sizeof(fa_compile_module_t), compile_module_cmp);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.sig, fa_sig, 4);
+    header.version = FA_BUNDLE_VERSION;
+    header.flags = fa_bundle_host_flags();
+    header.module_count = cmp->module_count;
+    header.main_index = FA_BUNDLE_NO_MAIN;
+    header.toc_offset = sizeof(header);
+
+    /* layout: names directly after the toc, then the aligned blobs */
+    size_t names_offset = header.toc_offset + sizeof(fa_bundle_entry_t) * cmp->module_count;
+    size_t blobs_offset = names_offset;
+    for (i = 0; i < cmp->module_count; i++)
+        blobs_offset += strlen(cmp->modules[i].name) + 1;
+    cursor = blobs_offset;
+    for (i = 0; i < cmp->module_count; i++)
+        cursor = fa_bundle_align(cursor) + cmp->modules[i].size;
+    header.size = cursor;
+
+    cmp->output.size = cursor;
+    /* zeroed so the padding is deterministic */
+    cmp->output.buf = calloc(1, cursor);
+
+    size_t name_cursor = names_offset;
+    size_t blob_cursor = blobs_offset;
+    for (i = 0; i < cmp->module_count; i++) {
+        mod = &cmp->modules[i];
+        if (mod->name == main_name)
+            header.main_index = i;
+
+        memset(&entry, 0, sizeof(entry));
+        entry.name_offset = name_cursor;
+        entry.name_len = strlen(mod->name);
+        entry.flags = mod->flags;
+        memcpy(cmp->output.buf + name_cursor, mod->name, entry.name_len + 1);
+        name_cursor += entry.name_len + 1;
+
+        blob_cursor = fa_bundle_align(blob_cursor);
+        entry.offset = blob_cursor;
+        entry.length = mod->size;
+        memcpy(cmp->output.buf + blob_cursor, mod->buf, mod->size);
+        blob_cursor += mod->size;
+
+        memcpy(cmp->output.buf + header.toc_offset + sizeof(fa_bundle_entry_t) * i, &entry, sizeof(entry));
+
+        free(mod->buf);
+        free(mod->name);
+    }
+
+    memcpy(cmp->output.buf, &header, sizeof(header));
+
+    free(cmp->modules);
+    cmp->modules = NULL;
+    cmp->module_count = cmp->module_size = 0;
 }
 
 static int js_module_dummy_init(JSContext *ctx, JSModuleDef *m)
@@ -121,24 +403,53 @@ static JSModuleDef *jsc_module_loader(
            dynamic library */
         cmp->dynamic_export = TRUE;
     } else {
-        size_t buf_len;
-        uint8_t *buf;
+        size_t buf_len, hit_len;
+        uint8_t *buf, *hit = NULL;
         JSValue func_val;
+        fa_cache_header_t hdr;
+        fa_compile_module_t *mod;
+        const int eval_flags = JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY;
         
         buf = fa_load_file(ctx, &buf_len, module_name);
         if (!buf) {
             JS_ThrowReferenceError(ctx, "could not load module filename '%s'", module_name);
             return NULL;
         }
-        
-        /* compile the module */
-        func_val = JS_Eval(ctx, (char *)buf, buf_len, module_name,
-                           JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
-        js_free(ctx, buf);
-        if (JS_IsException(func_val))
-            return NULL;
-        printf("Writing bytecode for module '%s'\n", module_name);
-        output_object_code(ctx, cmp, func_val, TRUE);
+
+        if (cmp->cache || cmp->cache_dir) {
+            compile_cache_header(&hdr, module_name, buf, buf_len, eval_flags);
+            hit = compile_cache_lookup(cmp, module_name, &hdr, buf, &hit_len);
+        }
+
+        if (hit) {
+            /* the loader still has to return the module, reading the 
+               bytecode back is much cheaper than parsing the source */
+            js_free(ctx, buf);
+            func_val = JS_ReadObject(ctx, hit, hit_len, JS_READ_OBJ_BYTECODE);
+            if (JS_IsException(func_val)) {
+                free(hit);
+                return NULL;
+            }
+            printf("Reusing bytecode for module '%s'\n", module_name);
+            output_module(cmp, module_name, hit, hit_len, TRUE);
+            free(hit);
+        } else {
+            /* compile the module */
+            func_val = JS_Eval(ctx, (char *)buf, buf_len, module_name, eval_flags);
+            if (JS_IsException(func_val)) {
+                js_free(ctx, buf);
+                return NULL;
+            }
+            printf("Writing bytecode for module '%s'\n", module_name);
+            mod = output_object_code(ctx, cmp, module_name, func_val, TRUE);
+            if (mod && (cmp->cache || cmp->cache_dir))
+                compile_cache_store(cmp, module_name, &hdr, buf, mod->buf, mod->size);
+            js_free(ctx, buf);
+            if (!mod) {
+                JS_FreeValue(ctx, func_val);
+                return NULL;
+            }
+        }
         
         /* the module is already referenced, so we must free it */
         m = JS_VALUE_GET_PTR(func_val);
@@ -147,21 +458,25 @@ static JSModuleDef *jsc_module_loader(
     return m;
 }
 
-static void compile_module (
+/* the batch compiles on threads, so errors are printed and returned rather
+   than exiting with the other threads mid-write */
+static int compile_module (
     JSContext *ctx, 
     fa_compile_t *cmp,
     const char *filename,
     int module
 ) {
-    uint8_t *buf;
+    uint8_t *buf, *hit = NULL;
     int eval_flags;
     JSValue obj;
-    size_t buf_len;
+    size_t buf_len, hit_len;
+    fa_cache_header_t hdr;
+    fa_compile_module_t *mod;
     
     buf = fa_load_file(ctx, &buf_len, filename);
     if (!buf) {
         fprintf(stderr, "Could not load '%s'\n", filename);
-        exit(1);
+        return -1;
     }
     eval_flags = JS_EVAL_FLAG_COMPILE_ONLY;
     if (module < 0) {
@@ -172,29 +487,64 @@ static void compile_module (
         eval_flags |= JS_EVAL_TYPE_MODULE;
     else
         eval_flags |= JS_EVAL_TYPE_GLOBAL;
-    obj = JS_Eval(ctx, (const char *)buf, buf_len, filename, eval_flags);
-    if (JS_IsException(obj)) {
-        fa_dump_error(ctx);
-        exit(1);
+
+    if (cmp->cache_dir) {
+        compile_cache_header(&hdr, filename, buf, buf_len, eval_flags);
+        hit = compile_cache_lookup(cmp, filename, &hdr, buf, &hit_len);
+    }
+
+    if (hit) {
+        js_free(ctx, buf);
+        obj = JS_ReadObject(ctx, hit, hit_len, JS_READ_OBJ_BYTECODE);
+        /* resolving pulls the imports through the loader */
+        if (JS_IsException(obj) || 
+            (JS_VALUE_GET_TAG(obj) == JS_TAG_MODULE && JS_ResolveModule(ctx, obj) < 0)) {
+            fa_dump_error(ctx);
+            JS_FreeValue(ctx, obj);
+            free(hit);
+            return -1;
+        }
+        printf("\nReusing input script bytecode\n");
+        output_module(cmp, filename, hit, hit_len, FALSE);
+        free(hit);
+    } else {
+        obj = JS_Eval(ctx, (const char *)buf, buf_len, filename, eval_flags);
+        if (JS_IsException(obj)) {
+            fa_dump_error(ctx);
+            js_free(ctx, buf);
+            return -1;
+        }
+        printf("\nWriting input script bytecode\n");
+        mod = output_object_code(ctx, cmp, filename, obj, FALSE);
+        if (!mod) {
+            fa_dump_error(ctx);
+            JS_FreeValue(ctx, obj);
+            js_free(ctx, buf);
+            return -1;
+        }
+        if (cmp->cache_dir)
+            compile_cache_store(cmp, filename, &hdr, buf, mod->buf, mod->size);
+        js_free(ctx, buf);
     }
-    js_free(ctx, buf);
-    printf("\nWriting input script bytecode\n");
-    output_object_code(ctx, cmp, obj, FALSE);
     JS_FreeValue(ctx, obj);
+    return 0;
 }
 
-fa_compile_t *compile (
-    const char    *modulename
+fa_compile_t *compile_in_runtime (
+    JSRuntime           *rt,
+    const char          *modulename,
+    int                 flags,
+    fa_compile_cache_t  *cache,
+    const char          *cache_dir
 ) {
     fa_compile_t *cmp = malloc(sizeof(fa_compile_t));
     memset(cmp, 0, sizeof(fa_compile_t));
+    cmp->flags = flags;
+    cmp->cache = cache;
+    cmp->cache_dir = cache_dir;
+    cmp->main_index = FA_BUNDLE_NO_MAIN;
 
-    cmp->output.buf = malloc(4);
-    memcpy(cmp->output.buf, fa_sig, 4);
-    cmp->output.size = 4;
-
-    int i;
-    JSRuntime *rt;
+    int i, err;
     JSContext *ctx;
     namelist_t dynamic_module_list;
     int module;
@@ -207,7 +557,7 @@ fa_compile_t *compile (
     /* add system modules */
     namelist_add(&cmp->cmodule_list, "std", "std", 0);
     
-    rt = JS_NewRuntime();
+    /* a fresh context per entry, modules are registered with the context */
     ctx = JS_NewContext(rt);
 
     JS_SetContextOpaque(ctx, cmp);
@@ -221,36 +571,314 @@ fa_compile_t *compile (
     JS_SetModuleLoaderFunc(rt, NULL, jsc_module_loader, NULL);
 
     /* compile the input module */
-    compile_module(ctx, cmp, modulename, module);
+    err = compile_module(ctx, cmp, modulename, module);
 
-    for(i = 0; i < dynamic_module_list.count; i++) {
+    for(i = 0; !err && i < dynamic_module_list.count; i++) {
         if (!jsc_module_loader(ctx, dynamic_module_list.array[i].name, NULL)) {
             fprintf(stderr, "Could not load dynamic module '%s'\n",
                     dynamic_module_list.array[i].name);
-            exit(1);
+            err = -1;
         }
     }
+
+    if (!err)
+        write_bundle(cmp);
     
     JS_FreeContext(ctx);
-    JS_FreeRuntime(rt);
 
     namelist_free(&cmp->cmodule_list);
     namelist_free(&cmp->cmodule_list);
     namelist_free(&cmp->init_module_list);
 
-    cmp->output.size++;
-    cmp->output.buf = realloc(cmp->output.buf, cmp->output.size);
-    cmp->output.buf[cmp->output.size - 1] = '\0';
+    if (err) {
+        for (i = 0; i < cmp->module_count; i++) {
+            free(cmp->modules[i].name);
+            free(cmp->modules[i].buf);
+        }
+        free(cmp->modules);
+        free(cmp);
+        return NULL;
+    }
 
     return cmp;
 }
 
-int main (int argc, char **argv) {
-    assert(argc == 3);
-    fa_compile_t *cmp = compile(argv[1]);
-    FILE *fptr;
-    fptr = fopen(argv[2], "w");
-    fwrite(cmp->output.buf, cmp->output.size, 1, fptr);
-    fclose(fptr);
+fa_compile_t *compile (
+    const char    *modulename,
+    int           flags,
+    const char    *cache_dir
+) {
+    JSRuntime *rt = JS_NewRuntime();
+    fa_compile_t *cmp = compile_in_runtime(rt, modulename, flags, NULL, cache_dir);
+    JS_FreeRuntime(rt);
+    return cmp;
+}
+
+void compile_free (fa_compile_t *cmp) {
+    free(cmp->output.buf);
     free(cmp);
-}
\ No newline at end of file
+}
+
+/* top level code of a snapshotted bundle has this long to settle */
+#define SNAPSHOT_SETTLE_MS 30000
+
+static void snapshot_settle_timeout (uv_timer_t *handle) {
+    fa_stop(handle->data);
+}
+
+/* replaces the bundle in cmp->output with a snapshot taken after evaluating it */
+static int snapshot_output (fa_compile_t *cmp) {
+    fa_runtime_t *rt = fa_new_runtime();
+    JSContext *ctx;
+    uv_timer_t timeout;
+    uint8_t *snapshot = NULL;
+    size_t size;
+
+    if (!rt) {
+        fprintf(stderr, "Could not create a runtime\n");
+        return -1;
+    }
+    ctx = fa_get_context(rt);
+
+    /* the modules fa-cli provides */
+    js_init_module_std(ctx, "std");
+    js_init_module_timers(ctx, "timers");
+    js_init_module_fs(ctx, "fs");
+
+    /* top level code, and the jobs and i/o it starts, build the state */
+    if (fa_try_eval_bin_bundle(ctx, (const uint8_t *)cmp->output.buf, cmp->output.size, 0) < 0) {
+        fa_free_runtime(rt);
+        return -1;
+    }
+
+    /* an interval or an open stream would keep the loop alive for good, the
+       limit catches JS which never returns to the loop */
+    fa_set_time_limit(rt, 0, SNAPSHOT_SETTLE_MS);
+    uv_timer_init(&rt->loop, &timeout);
+    timeout.data = rt;
+    uv_timer_start(&timeout, snapshot_settle_timeout, SNAPSHOT_SETTLE_MS, 0);
+    uv_unref((uv_handle_t *) &timeout);
+
+    fa_run(rt);
+
+    uv_close((uv_handle_t *) &timeout, NULL);
+    fa_set_time_limit(rt, 0, 0);
+
+    if (rt->stopped)
+        fprintf(stderr, "Snapshot did not settle within %d ms\n", SNAPSHOT_SETTLE_MS);
+    else
+        snapshot = fa_write_snapshot(ctx, (const uint8_t *)cmp->output.buf, cmp->output.size, &size);
+    if (!snapshot && !rt->stopped)
+        fa_dump_error(ctx);
+
+    /* the runtime reads modules from the bundle until it is freed */
+    fa_free_runtime(rt);
+
+    if (!snapshot)
+        return -1;
+
+    printf("Snapshot size: %zu Bytes\n", size);
+
+    free(cmp->output.buf);
+    cmp->output.buf = (char *)snapshot;
+    cmp->output.size = size;
+    return 0;
+}
+
+static int write_output (fa_compile_t *cmp, const char *filename) {
+    if ((cmp->flags & FA_COMPILE_SNAPSHOT) && snapshot_output(cmp) < 0) {
+        fprintf(stderr, "Could not snapshot '%s'\n", filename);
+        return -1;
+    }
+
+    FILE *fptr = fopen(filename, "wb");
+    if (!fptr) {
+        fprintf(stderr, "Could not open '%s' for writing\n", filename);
+        return -1;
+    }
+    if (fwrite(cmp->output.buf, cmp->output.size, 1, fptr) != 1) {
+        fprintf(stderr, "Could not write '%s'\n", filename);
+        fclose(fptr);
+        return -1;
+    }
+    fclose(fptr);
+    return 0;
+}
+
+struct batch_entry_s {
+    char *input;
+    char *output;
+};
+
+struct batch_s {
+    struct batch_entry_s *entries;
+    int count;
+    int flags;
+    const char *cache_dir;
+    /* next entry to compile */
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+    fa_compile_cache_t *cache;
+};
+
+static void *batch_worker (void *opaque) {
+    struct batch_s *batch = opaque;
+    /* one runtime per thread, QuickJS runtimes are not thread safe */
+    JSRuntime *rt = JS_NewRuntime();
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        int idx = batch->next < batch->count ? batch->next++ : -1;
+        pthread_mutex_unlock(&batch->lock);
+        if (idx < 0)
+            break;
+
+        struct batch_entry_s *e = &batch->entries[idx];
+        fa_compile_t *cmp = compile_in_runtime(rt, e->input, batch->flags, batch->cache, batch->cache_dir);
+        /* the other entries are still compiled, the exit status reports it */
+        if (!cmp || write_output(cmp, e->output) < 0) {
+            pthread_mutex_lock(&batch->lock);
+            batch->failed = 1;
+            pthread_mutex_unlock(&batch->lock);
+        }
+        if (cmp)
+            compile_free(cmp);
+    }
+
+    JS_FreeRuntime(rt);
+    return NULL;
+}
+
+/* manifest lines are "input output", empty lines and lines starting with # are skipped */
+static int read_manifest (struct batch_s *batch, const char *filename) {
+    char line[PATH_MAX * 2 + 2], input[PATH_MAX], output[PATH_MAX];
+    int size = 0, lineno = 0;
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open manifest '%s'\n", filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+        if (sscanf(p, "%4095s %4095s", input, output) != 2) {
+            fprintf(stderr, "%s:%d: expected \"input output\"\n", filename, lineno);
+            fclose(f);
+            return -1;
+        }
+        if (batch->count == size) {
+            size = size + (size >> 1) + 4;
+            batch->entries = realloc(batch->entries, sizeof(struct batch_entry_s) * size);
+        }
+        batch->entries[batch->count].input = strdup(input);
+        batch->entries[batch->count].output = strdup(output);
+        batch->count++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int compile_batch (const char *manifest, int flags, int jobs, const char *cache_dir) {
+    struct batch_s batch;
+    pthread_t *threads;
+    int i;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.flags = flags;
+    batch.cache_dir = cache_dir;
+
+    if (read_manifest(&batch, manifest) < 0)
+        return 1;
+
+    if (jobs <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = n > 0 ? n : 1;
+    }
+    if (jobs > batch.count)
+        jobs = batch.count;
+
+    pthread_mutex_init(&batch.lock, NULL);
+    batch.cache = compile_cache_new();
+
+    threads = malloc(sizeof(pthread_t) * jobs);
+    for (i = 0; i < jobs; i++)
+        pthread_create(&threads[i], NULL, batch_worker, &batch);
+    for (i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    compile_cache_free(batch.cache);
+    pthread_mutex_destroy(&batch.lock);
+
+    for (i = 0; i < batch.count; i++) {
+        free(batch.entries[i].input);
+        free(batch.entries[i].output);
+    }
+    free(batch.entries);
+
+    return batch.failed;
+}
+
+static void help (void) {
+    printf("usage: fa-c [options] input output\n"
+           "       fa-c [options] -m manifest\n"
+           "\n"
+           "-z          compress the module bytecode\n"
+           "--snapshot  output a snapshot of the state after evaluating the bundle\n"
+           "-m file     compile every \"input output\" pair listed in file\n"
+           "-j n        number of threads used with -m (default: number of cpus)\n"
+           "-c dir      reuse the bytecode of unchanged modules cached in dir\n");
+    exit(1);
+}
+
+int main (int argc, char **argv) {
+    int optind = 1;
+    int flags = 0;
+    int jobs = 0;
+    const char *manifest = NULL;
+    const char *cache_dir = NULL;
+
+    while (optind < argc && *argv[optind] == '-') {
+        const char *arg = argv[optind++] + 1;
+        if (!strcmp(arg, "z")) {
+            flags |= FA_COMPILE_COMPRESS;
+        } else if (!strcmp(arg, "-snapshot")) {
+            flags |= FA_COMPILE_SNAPSHOT;
+        } else if (!strcmp(arg, "m")) {
+            if (optind >= argc)
+                help();
+            manifest = argv[optind++];
+        } else if (!strcmp(arg, "j")) {
+            if (optind >= argc)
+                help();
+            jobs = atoi(argv[optind++]);
+        } else if (!strcmp(arg, "c")) {
+            if (optind >= argc)
+                help();
+            cache_dir = argv[optind++];
+        } else {
+            help();
+        }
+    }
+
+    if (manifest) {
+        if (optind != argc)
+            help();
+        return compile_batch(manifest, flags, jobs, cache_dir);
+    }
+
+    if (argc - optind != 2)
+        help();
+
+    fa_compile_t *cmp = compile(argv[optind], flags, cache_dir);
+    if (!cmp)
+        return 1;
+    int ret = write_output(cmp, argv[optind + 1]) < 0;
+    compile_free(cmp);
+    return ret;
+}
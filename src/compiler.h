@@ -2,6 +2,9 @@
 #define FA_COMPILE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <quickjs.h>
 
 struct fa_bytecode_s {
     char    *buf;
@@ -26,18 +29,81 @@ struct namelist_s {
 
 typedef struct namelist_s namelist_t;
 
+/* compile flags */
+#define FA_COMPILE_COMPRESS (1 << 0)
+/* evaluate the bundle and output a snapshot of the resulting state */
+#define FA_COMPILE_SNAPSHOT (1 << 1)
+
+struct fa_compile_module_s {
+    char    *name;
+    /* malloc'd bytecode, compressed if FA_BUNDLE_MOD_COMPRESSED is set */
+    uint8_t *buf;
+    size_t  size;
+    int     flags;
+};
+
+typedef struct fa_compile_module_s fa_compile_module_t;
+
+struct fa_compile_cache_entry_s {
+    /* fa_cache_key of the module */
+    uint64_t hash;
+    char     *name;
+    /* hits compare the whole source, the key is only a 64-bit hash */
+    uint8_t  *source;
+    size_t   source_size;
+    uint8_t  *buf;
+    size_t   size;
+    struct fa_compile_cache_entry_s *next;
+};
+
+typedef struct fa_compile_cache_entry_s fa_compile_cache_entry_t;
+
+#define FA_COMPILE_CACHE_BUCKETS 1024
+
+/* bytecode of dependency modules shared between batch compile threads */
+struct fa_compile_cache_s {
+    pthread_mutex_t lock;
+    fa_compile_cache_entry_t *buckets[FA_COMPILE_CACHE_BUCKETS];
+};
+
+typedef struct fa_compile_cache_s fa_compile_cache_t;
+
 struct fa_compile_s {
     namelist_t cname_list;
     namelist_t cmodule_list;
     namelist_t init_module_list;
     int dynamic_export;
+    int flags;
+    fa_compile_module_t *modules;
+    uint32_t module_count;
+    uint32_t module_size;
+    uint32_t main_index;
+    /* may be NULL */
+    fa_compile_cache_t *cache;
+    /* on-disk cache, may be NULL */
+    const char *cache_dir;
     fa_bytecode_t output;
 };
 
 typedef struct fa_compile_s fa_compile_t;
 
+/* NULL if the input does not compile, the error was printed */
 fa_compile_t *compile (
-    const char    *modulename
+    const char    *modulename,
+    int           flags,
+    const char    *cache_dir
+);
+/* compile on an existing runtime, which is reusable but not thread safe */
+fa_compile_t *compile_in_runtime (
+    JSRuntime           *rt,
+    const char          *modulename,
+    int                 flags,
+    fa_compile_cache_t  *cache,
+    const char          *cache_dir
 );
+void compile_free (fa_compile_t *cmp);
+
+fa_compile_cache_t *compile_cache_new (void);
+void compile_cache_free (fa_compile_cache_t *cache);
 
 #endif
\ No newline at end of file
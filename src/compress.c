@@ -0,0 +1,161 @@
+#include "compress.h"
+#include <string.h>
+
+#define FA_LZ_MIN_MATCH 4
+#define FA_LZ_HASH_BITS 12
+/* the format requires the last match to start 12 bytes before the end */
+#define FA_LZ_MFLIMIT 12
+/* ... and the last 5 bytes to be literals */
+#define FA_LZ_LAST_LITERALS 5
+#define FA_LZ_MAX_OFFSET 65535
+
+static inline uint32_t fa_lz_read32 (const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t fa_lz_hash (uint32_t v) {
+    return (v * 2654435761u) >> (32 - FA_LZ_HASH_BITS);
+}
+
+static uint8_t *fa_lz_put_len (uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *fa_lz_put_literals (uint8_t *op, const uint8_t *lit, size_t len, uint8_t **ptoken) {
+    uint8_t *token = op++;
+    *token = (len >= 15 ? 15 : len) << 4;
+    if (len >= 15)
+        op = fa_lz_put_len(op, len - 15);
+    memcpy(op, lit, len);
+    *ptoken = token;
+    return op + len;
+}
+
+size_t fa_lz_compress_bound (size_t src_len) {
+    return src_len + src_len / 255 + 16;
+}
+
+size_t fa_lz_compress (const uint8_t *src, size_t src_len, uint8_t *dst) {
+    uint32_t table[1 << FA_LZ_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + src_len;
+    uint8_t *op = dst, *token;
+
+    memset(table, 0, sizeof(table));
+
+    if (src_len > FA_LZ_MFLIMIT) {
+        const uint8_t *match_limit = end - FA_LZ_MFLIMIT;
+        const uint8_t *match_end_limit = end - FA_LZ_LAST_LITERALS;
+
+        while (ip < match_limit) {
+            uint32_t seq = fa_lz_read32(ip);
+            uint32_t h = fa_lz_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+
+            if (ref >= ip || ip - ref > FA_LZ_MAX_OFFSET || fa_lz_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            /* extend the match in both directions */
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + FA_LZ_MIN_MATCH, *mr = ref + FA_LZ_MIN_MATCH;
+            while (mp < match_end_limit && *mp == *mr) {
+                mp++;
+                mr++;
+            }
+
+            size_t match_len = mp - ip - FA_LZ_MIN_MATCH;
+            uint16_t offset = ip - ref;
+
+            op = fa_lz_put_literals(op, anchor, ip - anchor, &token);
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            *token |= match_len >= 15 ? 15 : match_len;
+            if (match_len >= 15)
+                op = fa_lz_put_len(op, match_len - 15);
+
+            ip = anchor = mp;
+        }
+    }
+
+    /* the last sequence only holds literals */
+    op = fa_lz_put_literals(op, anchor, end - anchor, &token);
+
+    return op - dst;
+}
+
+static int fa_lz_get_len (const uint8_t **pip, const uint8_t *iend, size_t *plen) {
+    const uint8_t *ip = *pip;
+    unsigned b;
+    do {
+        if (ip >= iend)
+            return -1;
+        b = *ip++;
+        *plen += b;
+    } while (b == 255);
+    *pip = ip;
+    return 0;
+}
+
+int fa_lz_decompress (const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len) {
+    const uint8_t *ip = src, *iend = src + src_len;
+    uint8_t *op = dst, *oend = dst + dst_len;
+    size_t len, offset;
+    unsigned token;
+
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+
+        /* literals */
+        len = token >> 4;
+        if (len == 15 && fa_lz_get_len(&ip, iend, &len) < 0)
+            return -1;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        if (ip == iend)
+            break;
+
+        /* match */
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+        len = token & 15;
+        if (len == 15 && fa_lz_get_len(&ip, iend, &len) < 0)
+            return -1;
+        len += FA_LZ_MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= len) {
+            memcpy(op, ref, len);
+        } else {
+            /* overlapping matches repeat the last offset bytes */
+            for (size_t i = 0; i < len; i++)
+                op[i] = ref[i];
+        }
+        op += len;
+    }
+
+    return op == oend ? 0 : -1;
+}
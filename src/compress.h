@@ -0,0 +1,20 @@
+#ifndef FA_COMPRESS_H
+#define FA_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Small LZ77 codec producing the LZ4 block format, used for compressed
+ * bundle modules. Compression is greedy and single pass, decompression is
+ * bounds checked since it runs on untrusted bundles.
+ */
+
+// worst case output size of fa_lz_compress
+size_t fa_lz_compress_bound (size_t src_len);
+// returns the compressed size, dst must hold fa_lz_compress_bound(src_len) bytes
+size_t fa_lz_compress (const uint8_t *src, size_t src_len, uint8_t *dst);
+// decompresses exactly dst_len bytes, returns -1 on malformed input
+int fa_lz_decompress (const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len);
+
+#endif
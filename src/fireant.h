@@ -4,6 +4,37 @@
 #include <quickjs.h>
 #include <uv.h>
 
+typedef struct fa_job_stats_s {
+    /* pending jobs (promise reactions) executed */
+    uint64_t jobs;
+    /* time spent executing them */
+    uint64_t time_ns;
+    /* loop iterations which ran jobs */
+    uint64_t ticks;
+    /* iterations which hit the limit and left jobs for the next one */
+    uint64_t deferred;
+} fa_job_stats_t;
+
+typedef struct fa_runtime_stats_s {
+    JSMemoryUsage memory;
+    /* 0 if the collector of this QuickJS could not be observed, the gc
+       counters below stay 0 then */
+    int gc_supported;
+    /* collections, and the pause of the ones which could be timed */
+    uint64_t gc_count;
+    uint64_t gc_timed;
+    uint64_t gc_time_ns;
+    fa_job_stats_t jobs;
+    /* loop iterations, time in the check handle running jobs and time the
+       loop was blocked polling for I/O */
+    uint64_t loop_count;
+    uint64_t check_time_ns;
+    uint64_t poll_time_ns;
+    /* modules compiled or read from a bundle */
+    uint64_t module_loads;
+    uint64_t module_load_time_ns;
+} fa_runtime_stats_t;
+
 struct fa_runtime_s {
     JSRuntime *rt;
     JSContext *ctx;
@@ -15,17 +46,335 @@ struct fa_runtime_s {
         uv_async_t stop;
     } event_handles;
     int is_worker;
+    /* fa_stop was called */
+    int stopped;
+    /* set while the runtime is owned by a scheduler */
+    struct fa_sched_entry_s *sched;
+    /* bundles modules are lazily loaded from, newest first */
+    struct fa_runtime_bundle_s *bundles;
+    /* bytecode cache for source modules, NULL if disabled */
+    char *code_cache_dir;
+    /* run before the context is freed */
+    struct fa_cleanup_s *cleanups;
+    /* callbacks still due for requests and handles torn down, see
+       fa_hold_orphan */
+    int orphans;
+    /* channel to the parent if this runtime is a worker */
+    struct fa_worker_s *worker;
+    /* timer wheel, created by the timers module */
+    struct fa_timers_s *timers;
+    /* fs requests in flight */
+    struct fa_fs_s *fs;
+    /* fa_queue_work jobs in flight */
+    struct fa_works_s *works;
+    /* open streams and pooled chunks, created by the first stream */
+    struct fa_streams_s *streams;
+    /* parsed printf formats, created by the first printf */
+    struct fa_printf_cache_s *printf_cache;
+    /* extra contexts created with fa_new_tenant */
+    struct fa_tenant_s *tenants;
+    /* owned arena the JS heap lives in, freed after the runtime */
+    struct fa_arena_s *arena;
+    /* calls posted from other threads */
+    struct fa_post_s *post;
+    /* stdout ring, NULL while print writes synchronously */
+    struct fa_output_s *output;
+    /* jobs run per loop iteration, 0 means no limit */
+    struct {
+        int max_jobs;
+        uint64_t budget_ns;
+    } job_policy;
+    fa_job_stats_t job_stats;
+    /* see fa_set_time_limit, only touched by the runtime's thread */
+    struct {
+        int active;
+        int expired;
+        uint64_t turn_ms;
+        /* on the watchdog clock, in ms */
+        uint64_t deadline;
+        uint64_t turn_start;
+        uint64_t turn_count;
+    } time_limit;
+    /* counters behind fa_runtime_stats */
+    struct {
+        uint64_t gc_count;
+        uint64_t gc_timed;
+        uint64_t gc_time_ns;
+        uint64_t gc_start;
+        void *gc_decref_func;
+        /* see fa_stats_calibrate_gc */
+        int gc_calibrated;
+        int gc_calibrating;
+        int gc_supported;
+        int gc_mark_calls;
+        JSValue gc_sentinel;
+        int gc_probe_armed;
+        uint64_t loop_count;
+        uint64_t check_time_ns;
+        uint64_t module_loads;
+        uint64_t module_load_time_ns;
+    } stats;
 };
 
 typedef struct fa_runtime_s fa_runtime_t;
 
 fa_runtime_t *fa_new_runtime (void);
+
+/**
+ * Size-class arena for JS heaps, see fa_runtime_options_t.arena_block_size.
+ * Small allocations come out of blocks of block_size bytes (0 picks a
+ * default) and are recycled per size class. Freeing the arena releases all
+ * of its memory at once, it must outlive the runtimes allocating from it.
+ */
+typedef struct fa_arena_s fa_arena_t;
+
+fa_arena_t *fa_new_arena (size_t block_size);
+void fa_free_arena (fa_arena_t *arena);
+/* bytes the arena took from the system allocator */
+size_t fa_arena_reserved (fa_arena_t *arena);
+/* pass the arena as malloc_opaque */
+extern const JSMallocFunctions fa_arena_malloc_functions;
+
+/**
+ * Options for fa_new_runtime2, zeroed fields keep QuickJS' defaults.
+ */
+typedef struct fa_runtime_options_s {
+    /* allocator for the JS heap, NULL uses malloc */
+    const JSMallocFunctions *malloc_functions;
+    void *malloc_opaque;
+    /* non-zero gives the runtime its own arena with blocks of this size,
+       released in one go with the runtime. Overrides malloc_functions. */
+    size_t arena_block_size;
+    /* allocations past the limit fail with an out of memory error */
+    size_t memory_limit;
+    /* bytes allocated between GC runs */
+    size_t gc_threshold;
+    size_t max_stack_size;
+} fa_runtime_options_t;
+
+/* options may be NULL, returns NULL if the runtime could not be created */
+fa_runtime_t *fa_new_runtime2 (const fa_runtime_options_t *options);
 void fa_free_runtime (fa_runtime_t *rt);
 
 void fa_setup_args (int argc, char **argv);
 void fa_run (fa_runtime_t *rt);
 void fa_stop (fa_runtime_t *rt);
 
+/**
+ * Limits the pending jobs executed per loop iteration to max_jobs or to
+ * budget_us microseconds, whichever is hit first. The rest run in the next
+ * iteration, after I/O was polled. At least one job runs per iteration and
+ * 0 disables a limit, by default the queue is drained every iteration.
+ */
+void fa_set_job_policy (fa_runtime_t *rt, int max_jobs, uint64_t budget_us);
+void fa_get_job_stats (fa_runtime_t *rt, fa_job_stats_t *stats);
+
+/**
+ * Aborts JS which runs for more than turn_ms without returning to the event
+ * loop, and all JS once total_ms passed since the call, which also stops
+ * fa_run. 0 disables a limit. Limits are wall-clock time, checked from the
+ * interrupt handler against a clock a watchdog thread updates every
+ * millisecond. The abort is an uncatchable "interrupted" InternalError, so
+ * scripts can not swallow it in a catch block. Resetting the context clears
+ * the limits.
+ */
+void fa_set_time_limit (fa_runtime_t *rt, uint64_t turn_ms, uint64_t total_ms);
+/* set once a limit aborted a script */
+int fa_time_limit_expired (fa_runtime_t *rt);
+
+/* memory, GC, job, loop and module loading counters since the runtime was
+   created, poll_time_ns needs libuv 1.39 */
+void fa_runtime_stats (fa_runtime_t *rt, fa_runtime_stats_t *stats);
+
+/**
+ * Makes print and printf append to a ring of at least size bytes, drained
+ * asynchronously while the loop waits for I/O and flushed when the runtime
+ * is freed. Writers only block once the ring is full. 0 goes back to
+ * writing synchronously. Returns -1 if the ring could not be allocated.
+ */
+int fa_set_stdout_buffered (fa_runtime_t *rt, size_t size);
+
+/**
+ * Calls the global function func with the arguments in args_json, a JSON
+ * array or NULL, on the runtime's loop thread. Safe to call from any thread
+ * while the runtime is alive, posting takes no lock. done, which may be
+ * NULL, runs on the loop thread with status 0 and the return value as JSON
+ * (NULL for undefined), or with -1 and the error as a string. A returned
+ * promise completes the call once it settles. Calls still queued when the
+ * runtime is freed complete with -1. Returns -1 if out of memory.
+ */
+typedef void (*fa_post_done_func)(int status, const char *result, void *opaque);
+
+int fa_post_call (
+    fa_runtime_t *rt, 
+    const char *func, 
+    const char *args_json, 
+    fa_post_done_func done, 
+    void *opaque
+);
+
+/* blocking flavour of fa_post_call, never wait on the runtime's own thread */
+typedef struct fa_future_s fa_future_t;
+
+fa_future_t *fa_post_call_future (fa_runtime_t *rt, const char *func, const char *args_json);
+// waits for the call, the result is malloc'ed and passed to the caller
+int fa_future_wait (fa_future_t *f, char **presult);
+void fa_free_future (fa_future_t *f);
+/* by default posted calls do not keep fa_run from returning, call from the
+   runtime's thread */
+void fa_set_post_keep_alive (fa_runtime_t *rt, int keep_alive);
+
+/* cache the bytecode of source modules in dir, NULL disables the cache */
+void fa_set_code_cache (fa_runtime_t *rt, const char *dir);
+
+/**
+ * Pool of pre-initialised runtimes for running one short script per request.
+ * init is called on every fresh context, before it is handed out, to install
+ * modules and evaluate bundles. Released runtimes get a new context, so the
+ * setup cost is paid on release instead of on acquire. A pool and its
+ * runtimes belong to the thread that created it.
+ */
+typedef int (*fa_runtime_init_func)(fa_runtime_t *rt, JSContext *ctx, void *opaque);
+
+typedef struct fa_runtime_pool_s fa_runtime_pool_t;
+
+fa_runtime_pool_t *fa_new_runtime_pool (int size, fa_runtime_init_func init, void *opaque);
+// runtimes are created with the options, which are copied
+fa_runtime_pool_t *fa_new_runtime_pool2 (
+    int size, 
+    const fa_runtime_options_t *options, 
+    fa_runtime_init_func init, 
+    void *opaque
+);
+void fa_free_runtime_pool (fa_runtime_pool_t *pool);
+// creates a runtime if the pool is empty, returns NULL if initialisation failed
+fa_runtime_t *fa_runtime_pool_acquire (fa_runtime_pool_t *pool);
+void fa_runtime_pool_release (fa_runtime_pool_t *pool, fa_runtime_t *rt);
+
+/**
+ * Runs many runtimes on a fixed set of threads. A runtime is handed over
+ * after it was set up and its scripts evaluated, from then on it runs one
+ * loop iteration at a time on whichever thread picks it up, never on two at
+ * once, whenever it has pending jobs, ready I/O or a due timer. Idle threads
+ * steal runtimes queued on busy ones. Once the loop has nothing left to do
+ * or fa_stop was called, on_exit is called on a scheduler thread and the
+ * runtime belongs to the embedder again, it may be freed there. Linux only,
+ * fa_new_scheduler returns NULL elsewhere.
+ */
+typedef struct fa_scheduler_s fa_scheduler_t;
+
+typedef struct fa_scheduler_options_s {
+    /* 0 uses one thread per online CPU */
+    int threads;
+    /* thread i is pinned to cpus[i % cpu_count], no pinning if 0 */
+    const int *cpus;
+    int cpu_count;
+} fa_scheduler_options_t;
+
+typedef void (*fa_scheduler_exit_func)(fa_runtime_t *rt, void *opaque);
+
+fa_scheduler_t *fa_new_scheduler (const fa_scheduler_options_t *options);
+int fa_scheduler_add (
+    fa_scheduler_t *s, 
+    fa_runtime_t *rt, 
+    fa_scheduler_exit_func on_exit, 
+    void *opaque
+);
+// runtimes which have not exited yet
+int fa_scheduler_count (fa_scheduler_t *s);
+// stops the threads, runtimes still scheduled are passed to on_exit
+void fa_free_scheduler (fa_scheduler_t *s);
+
+/**
+ * Snapshots hold a bundle and the serialisable global state left behind by 
+ * evaluating it, restoring one skips re-running the bundle's main module. 
+ * Globals which are or reference functions can not be captured. Like with
+ * fa_eval_bin_bundle, the snapshot buffer must outlive the runtime.
+ */
+uint8_t *fa_write_snapshot (
+    JSContext *ctx,
+    const uint8_t *bundle, 
+    size_t bundle_len,
+    size_t *psize
+);
+// init is called before the state is restored, pass NULL if nothing has to be installed
+fa_runtime_t *fa_new_runtime_from_snapshot (
+    const uint8_t *buf, 
+    size_t buf_len,
+    fa_runtime_init_func init,
+    void *opaque
+);
+
+/**
+ * Tenants are extra contexts in a runtime, each with its own globals and
+ * module instances. They share the runtime's heap, atoms, shapes, classes,
+ * loop and registered bundles: evaluating a bundle already evaluated in the
+ * runtime by filename or buffer does not map or parse it again, and a
+ * tenant only deserializes the modules it imports. Install modules on the
+ * tenant's context like on the runtime's. Function bytecode is bound to
+ * the realm which read it, so each tenant holds its own copy of the
+ * modules it uses. Freeing a tenant clears its timers, closes its streams
+ * and workers, and cancels its fs requests and fa_queue_work jobs. It does
+ * not run the loop, so it may be called from loop callbacks: requests
+ * already running keep the context until they completed, without settling
+ * anything. Promise jobs the tenant already queued still run. Tenants left
+ * over are freed with the runtime or when its context is reset.
+ */
+typedef struct fa_tenant_s fa_tenant_t;
+
+fa_tenant_t *fa_new_tenant (fa_runtime_t *rt);
+void fa_free_tenant (fa_tenant_t *tenant);
+JSContext *fa_tenant_get_context (fa_tenant_t *tenant);
+
+/**
+ * Runs work(opaque) on the uv threadpool and returns a promise settled on
+ * the loop thread with what done returns, JS_EXCEPTION rejects it with the
+ * pending exception. status is 0, or UV_ECANCELED once the context is
+ * freed or reset before the job completed; then the promise is left alone
+ * and what done returns is dropped. done is called either way and releases
+ * opaque. Without done the promise resolves to undefined. work must not
+ * call into QuickJS. If fa_queue_work throws, neither callback is called.
+ */
+typedef void (*fa_work_func)(void *opaque);
+typedef JSValue (*fa_work_done_func)(JSContext *ctx, int status, void *opaque);
+
+JSValue fa_queue_work (JSContext *ctx, fa_work_func work, fa_work_done_func done, void *opaque);
+
+/**
+ * Handles to a global function or module export, resolved once and called
+ * many times without property lookups. Arguments are set into slots owned
+ * by the handle which keep their value until set again, call passes the
+ * first argc of them. A module is imported if needed, resolving fails if
+ * its evaluation waits for the loop. Handles belong to the context they
+ * were resolved in and stop working once it is freed or reset; free them
+ * before freeing a tenant. Setters and calls return -1, or JS_EXCEPTION,
+ * with the exception pending on failure. On a handle whose context is gone
+ * they fail the same way but no exception is pending, as there is no context
+ * to hold it; fa_function_get_context returns NULL for such handles.
+ */
+#define FA_FUNCTION_MAX_ARGS 16
+
+typedef struct fa_function_s fa_function_t;
+
+fa_function_t *fa_get_function (JSContext *ctx, const char *name);
+fa_function_t *fa_get_module_function (JSContext *ctx, const char *module_name, const char *export_name);
+void fa_free_function (fa_function_t *f);
+// NULL once the context is gone
+JSContext *fa_function_get_context (fa_function_t *f);
+
+// takes ownership of val
+int fa_function_set_value (fa_function_t *f, int i, JSValue val);
+int fa_function_set_int (fa_function_t *f, int i, int32_t val);
+int fa_function_set_int64 (fa_function_t *f, int i, int64_t val);
+int fa_function_set_double (fa_function_t *f, int i, double val);
+int fa_function_set_string (fa_function_t *f, int i, const char *str, size_t len);
+// the data is copied
+int fa_function_set_array_buffer (fa_function_t *f, int i, const uint8_t *buf, size_t len);
+
+JSValue fa_function_call (fa_function_t *f, int argc);
+int fa_function_call_int (fa_function_t *f, int argc, int32_t *pres);
+int fa_function_call_double (fa_function_t *f, int argc, double *pres);
+
 JSContext *fa_get_context (fa_runtime_t *rt);
 fa_runtime_t *fa_get_runtime (JSContext *ctx);
 
@@ -36,12 +385,25 @@ void fa_eval_binary (
     size_t buf_len, 
     int load_only
 );
+/**
+ * Registers the bundle with the runtime and evaluates its main module. The
+ * other modules are only read once they are imported, so buf must stay valid
+ * until the runtime is freed.
+ */
 void fa_eval_bin_bundle (
     JSContext *ctx, 
     const uint8_t *buf, 
     size_t buf_len, 
     int load_only
 );
+/* Maps the bundle read-only and evaluates it without copying it to the heap,
+   the mapping is released with the runtime. Returns -1 if the file can't be
+   mapped or the main module throws. */
+int fa_eval_bin_bundle_file (
+    JSContext *ctx, 
+    const char *filename, 
+    int load_only
+);
 JSValue fa_eval_buf (
     JSContext *ctx, 
     const void *buf, 
@@ -57,6 +419,9 @@ const int fa_get_patch_ver (void);
 const char *fa_get_qjs_ver (void);
 
 JSModuleDef *js_init_module_std (JSContext *ctx, const char *module_name);
+JSModuleDef *js_init_module_worker (JSContext *ctx, const char *module_name);
+JSModuleDef *js_init_module_timers (JSContext *ctx, const char *module_name);
+JSModuleDef *js_init_module_fs (JSContext *ctx, const char *module_name);
 
 int fa_eval_check_exception (JSContext *ctx, JSValue val);
 int fa_eval_std_free (JSContext *ctx, JSValue val);
@@ -0,0 +1,1049 @@
+#include "runtime.h"
+#include "utils.h"
+#include "stream.h"
+#include <cutils.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/**
+ * Promise based file system access on the uv threadpool.
+ *
+ * import * as fs from 'fs';
+ *
+ * const fd = await fs.open('data.bin', 'r');
+ * const chunk = await fs.read(fd, 65536);       // ArrayBuffer
+ * await fs.close(fd);
+ * const all = await fs.readFile('data.bin');    // ArrayBuffer
+ *
+ * for await (const chunk of fs.createReadStream('big.log')) ...
+ * const out = fs.createWriteStream('out.log', { flags: 'a' });
+ * await out.write(line);                        // waits past highWaterMark
+ * await out.close();
+ *
+ * Read buffers are malloc'd, filled by the threadpool and handed to
+ * JS_NewArrayBuffer as they are. Data passed to write is pinned, not
+ * copied, so it must not be detached (or transferred) until the write
+ * settled.
+ */
+
+typedef struct fa_fs_s {
+    fa_runtime_t *qrt;
+    /* requests in flight */
+    struct fa_fs_req_s *pending;
+} fa_fs_t;
+
+typedef struct fa_fs_req_s {
+    uv_fs_t req;
+    /* readFile runs open, read and close as one threadpool job */
+    uv_work_t work;
+    /* NULL once orphaned by a cleanup */
+    fa_fs_t *fs;
+    JSContext *ctx;
+    fa_promise_t promise;
+    /* read target, owned until it is adopted by an ArrayBuffer */
+    uint8_t *buf;
+    size_t len;
+    /* write source, keeps the data alive while the threadpool uses it */
+    JSValue data;
+    const char *str;
+    /* readFile */
+    char *path;
+    ssize_t result;
+    struct fa_fs_req_s *prev;
+    struct fa_fs_req_s *next;
+} fa_fs_req_t;
+
+/* cancels the requests of ctx, or all if NULL. Running ones can't be
+   stopped and may write into JS owned memory, so every request is orphaned:
+   it keeps its values and context until its callback freed them. */
+static void fa_fs_orphan (fa_runtime_t *qrt, fa_fs_t *fs, JSContext *ctx) {
+    fa_fs_req_t *r, *next;
+
+    for (r = fs->pending; r != NULL; r = next) {
+        next = r->next;
+        if (ctx && r->ctx != ctx)
+            continue;
+
+        if (r->prev)
+            r->prev->next = r->next;
+        else
+            fs->pending = r->next;
+        if (r->next)
+            r->next->prev = r->prev;
+        r->prev = r->next = NULL;
+        r->fs = NULL;
+
+        fa_hold_orphan(qrt, r->ctx);
+        if (r->path)
+            uv_cancel((uv_req_t *) &r->work);
+        else
+            uv_cancel((uv_req_t *) &r->req);
+    }
+}
+
+static void fa_fs_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_fs_t *fs = opaque;
+
+    fa_fs_orphan(qrt, fs, NULL);
+
+    qrt->fs = NULL;
+    free(fs);
+}
+
+void fa_fs_free_context (fa_runtime_t *qrt, JSContext *ctx) {
+    if (qrt->fs)
+        fa_fs_orphan(qrt, qrt->fs, ctx);
+}
+
+static fa_fs_t *fa_get_fs (JSContext *ctx) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    fa_fs_t *fs = qrt->fs;
+
+    if (fs)
+        return fs;
+
+    fs = malloc(sizeof(fa_fs_t));
+    if (!fs)
+        return NULL;
+    fs->qrt = qrt;
+    fs->pending = NULL;
+
+    qrt->fs = fs;
+    fa_add_cleanup(qrt, fa_fs_cleanup, fs);
+
+    return fs;
+}
+
+static fa_fs_req_t *fa_fs_req_new (JSContext *ctx, JSValue *ppromise) {
+    fa_fs_t *fs = fa_get_fs(ctx);
+    fa_fs_req_t *r;
+
+    if (!fs) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+
+    r = malloc(sizeof(fa_fs_req_t));
+    if (!r) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    memset(r, 0, sizeof(fa_fs_req_t));
+    r->fs = fs;
+    r->ctx = ctx;
+    r->data = JS_UNDEFINED;
+    r->req.data = r;
+    r->work.data = r;
+
+    *ppromise = fa_init_promise(ctx, &r->promise);
+    if (JS_IsException(*ppromise)) {
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+/* links a request which was submitted successfully */
+static void fa_fs_req_submitted (fa_fs_req_t *r) {
+    r->next = r->fs->pending;
+    if (r->next)
+        r->next->prev = r;
+    r->fs->pending = r;
+}
+
+static void fa_fs_req_free (fa_fs_req_t *r) {
+    JSContext *ctx = r->ctx;
+    int orphaned = !r->fs;
+
+    if (r->prev)
+        r->prev->next = r->next;
+    else if (!orphaned && r->fs->pending == r)
+        r->fs->pending = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+
+    uv_fs_req_cleanup(&r->req);
+    if (r->str)
+        JS_FreeCString(ctx, r->str);
+    JS_FreeValue(ctx, r->data);
+    fa_free_promise(ctx, &r->promise);
+    free(r->buf);
+    free(r->path);
+    free(r);
+
+    if (orphaned)
+        fa_release_orphan(fa_get_runtime(ctx), ctx);
+}
+
+/* frees a request which could not be submitted and returns its error */
+static JSValue fa_fs_req_fail (fa_fs_req_t *r, int err) {
+    JSContext *ctx = r->ctx;
+    JSValue promise = JS_DupValue(ctx, r->promise.p);
+    JSValue error = fa_new_uv_error(ctx, err);
+
+    fa_reject_promise(ctx, &r->promise, 1, (JSValueConst *) &error);
+    fa_fs_req_free(r);
+
+    return promise;
+}
+
+static void fa_fs_settle (fa_fs_req_t *r, JSValue result) {
+    JSContext *ctx = r->ctx;
+
+    if (JS_IsException(result)) {
+        JSValue error = JS_GetException(ctx);
+        fa_reject_promise(ctx, &r->promise, 1, (JSValueConst *) &error);
+    } else {
+        fa_resolve_promise(ctx, &r->promise, 1, (JSValueConst *) &result);
+    }
+    fa_fs_req_free(r);
+}
+
+static void fa_fs_free_buffer (JSRuntime *rt, void *opaque, void *ptr) {
+    free(ptr);
+}
+
+/* hands the read buffer to a new ArrayBuffer without copying it */
+static JSValue fa_fs_adopt_buffer (fa_fs_req_t *r, size_t len) {
+    JSContext *ctx = r->ctx;
+    JSValue ab;
+
+    ab = JS_NewArrayBuffer(ctx, r->buf, len, fa_fs_free_buffer, NULL, 0);
+    if (!JS_IsException(ab))
+        r->buf = NULL;
+
+    return ab;
+}
+
+static JSValue fa_fs_new_stat (JSContext *ctx, const uv_stat_t *st) {
+    JSValue obj = JS_NewObject(ctx);
+
+    if (JS_IsException(obj))
+        return obj;
+
+#define FA_STAT_TIME(ts) ((double) (ts).tv_sec * 1e3 + (double) (ts).tv_nsec / 1e6)
+    JS_DefinePropertyValueStr(ctx, obj, "dev", JS_NewInt64(ctx, st->st_dev), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "ino", JS_NewInt64(ctx, st->st_ino), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "mode", JS_NewInt64(ctx, st->st_mode), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "nlink", JS_NewInt64(ctx, st->st_nlink), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "uid", JS_NewInt64(ctx, st->st_uid), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "gid", JS_NewInt64(ctx, st->st_gid), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "size", JS_NewInt64(ctx, st->st_size), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "atime", JS_NewFloat64(ctx, FA_STAT_TIME(st->st_atim)), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "mtime", JS_NewFloat64(ctx, FA_STAT_TIME(st->st_mtim)), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "ctime", JS_NewFloat64(ctx, FA_STAT_TIME(st->st_ctim)), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "isFile", JS_NewBool(ctx, (st->st_mode & S_IFMT) == S_IFREG), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "isDirectory", JS_NewBool(ctx, (st->st_mode & S_IFMT) == S_IFDIR), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "isSymbolicLink", JS_NewBool(ctx, (st->st_mode & S_IFMT) == S_IFLNK), JS_PROP_C_W_E);
+#undef FA_STAT_TIME
+
+    return obj;
+}
+
+static void fa_fs_cb (uv_fs_t *req) {
+    fa_fs_req_t *r = req->data;
+    JSContext *ctx = r->ctx;
+    uv_dirent_t ent;
+    JSValue result;
+    uint32_t i;
+
+    if (!r->fs) {
+        fa_fs_req_free(r);
+        return;
+    }
+
+    if (req->result < 0) {
+        JSValue error = fa_new_uv_error(ctx, req->result);
+        fa_reject_promise(ctx, &r->promise, 1, (JSValueConst *) &error);
+        fa_fs_req_free(r);
+        return;
+    }
+
+    switch (req->fs_type) {
+        case UV_FS_OPEN:
+        case UV_FS_WRITE:
+            result = JS_NewInt64(ctx, req->result);
+            break;
+        case UV_FS_READ:
+            result = fa_fs_adopt_buffer(r, req->result);
+            break;
+        case UV_FS_STAT:
+        case UV_FS_FSTAT:
+            result = fa_fs_new_stat(ctx, &req->statbuf);
+            break;
+        case UV_FS_SCANDIR:
+            result = JS_NewArray(ctx);
+            for (i = 0; !JS_IsException(result) && uv_fs_scandir_next(req, &ent) != UV_EOF; i++)
+                JS_SetPropertyUint32(ctx, result, i, JS_NewString(ctx, ent.name));
+            break;
+        default:
+            result = JS_UNDEFINED;
+            break;
+    }
+
+    fa_fs_settle(r, result);
+}
+
+/* Path and flag helpers */
+
+static int fa_fs_parse_flags (JSContext *ctx, JSValueConst val, int *pflags) {
+    const char *str;
+    int32_t flags;
+
+    if (JS_IsUndefined(val)) {
+        *pflags = O_RDONLY;
+        return 0;
+    }
+
+    if (!JS_IsString(val)) {
+        if (JS_ToInt32(ctx, &flags, val))
+            return -1;
+        *pflags = flags;
+        return 0;
+    }
+
+    str = JS_ToCString(ctx, val);
+    if (!str)
+        return -1;
+
+    if (!strcmp(str, "r"))
+        flags = O_RDONLY;
+    else if (!strcmp(str, "r+"))
+        flags = O_RDWR;
+    else if (!strcmp(str, "w"))
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (!strcmp(str, "w+"))
+        flags = O_RDWR | O_CREAT | O_TRUNC;
+    else if (!strcmp(str, "a"))
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    else if (!strcmp(str, "a+"))
+        flags = O_RDWR | O_CREAT | O_APPEND;
+    else
+        flags = -1;
+
+    if (flags < 0)
+        JS_ThrowTypeError(ctx, "invalid flags '%s'", str);
+    JS_FreeCString(ctx, str);
+    if (flags < 0)
+        return -1;
+
+    *pflags = flags;
+    return 0;
+}
+
+static int fa_fs_get_position (JSContext *ctx, JSValueConst val, int64_t *ppos) {
+    /* -1 reads or writes at the current file position */
+    if (JS_IsUndefined(val) || JS_IsNull(val)) {
+        *ppos = -1;
+        return 0;
+    }
+    return JS_ToInt64(ctx, ppos, val);
+}
+
+/* Functions */
+
+static JSValue fa_fs_open (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_fs_req_t *r;
+    JSValue promise;
+    const char *path;
+    int flags, err;
+    int32_t mode = 0666;
+
+    if (fa_fs_parse_flags(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, &flags))
+        return JS_EXCEPTION;
+    if (argc > 2 && !JS_IsUndefined(argv[2]) && JS_ToInt32(ctx, &mode, argv[2]))
+        return JS_EXCEPTION;
+
+    path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+
+    r = fa_fs_req_new(ctx, &promise);
+    if (!r) {
+        JS_FreeCString(ctx, path);
+        return JS_EXCEPTION;
+    }
+
+    err = uv_fs_open(&fa_get_runtime(ctx)->loop, &r->req, path, flags, mode, fa_fs_cb);
+    JS_FreeCString(ctx, path);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, err);
+    }
+
+    fa_fs_req_submitted(r);
+    return promise;
+}
+
+static JSValue fa_fs_close (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_fs_req_t *r;
+    JSValue promise;
+    int32_t fd;
+    int err;
+
+    if (JS_ToInt32(ctx, &fd, argv[0]))
+        return JS_EXCEPTION;
+
+    r = fa_fs_req_new(ctx, &promise);
+    if (!r)
+        return JS_EXCEPTION;
+
+    err = uv_fs_close(&fa_get_runtime(ctx)->loop, &r->req, fd, fa_fs_cb);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, err);
+    }
+
+    fa_fs_req_submitted(r);
+    return promise;
+}
+
+/* read(fd, length, position?) resolves with an ArrayBuffer of the bytes read */
+static JSValue fa_fs_read (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_fs_req_t *r;
+    JSValue promise;
+    uv_buf_t b;
+    int32_t fd;
+    uint64_t len;
+    int64_t pos;
+    int err;
+
+    if (JS_ToInt32(ctx, &fd, argv[0]))
+        return JS_EXCEPTION;
+    if (JS_ToIndex(ctx, &len, argv[1]))
+        return JS_EXCEPTION;
+    if (fa_fs_get_position(ctx, argc > 2 ? argv[2] : JS_UNDEFINED, &pos))
+        return JS_EXCEPTION;
+
+    r = fa_fs_req_new(ctx, &promise);
+    if (!r)
+        return JS_EXCEPTION;
+
+    /* the threadpool reads straight into the future ArrayBuffer's memory */
+    r->len = len;
+    r->buf = malloc(len > 0 ? len : 1);
+    if (!r->buf) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, UV_ENOMEM);
+    }
+
+    b = uv_buf_init((char *) r->buf, len);
+    err = uv_fs_read(&fa_get_runtime(ctx)->loop, &r->req, fd, &b, 1, pos, fa_fs_cb);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, err);
+    }
+
+    fa_fs_req_submitted(r);
+    return promise;
+}
+
+/* write(fd, data, position?) takes a string, an ArrayBuffer or a typed array */
+static JSValue fa_fs_write (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_fs_req_t *r;
+    JSValue promise, ab;
+    uv_buf_t b;
+    uint8_t *data;
+    size_t size, offset, len, bpe;
+    int32_t fd;
+    int64_t pos;
+    int err;
+
+    if (JS_ToInt32(ctx, &fd, argv[0]))
+        return JS_EXCEPTION;
+    if (fa_fs_get_position(ctx, argc > 2 ? argv[2] : JS_UNDEFINED, &pos))
+        return JS_EXCEPTION;
+
+    r = fa_fs_req_new(ctx, &promise);
+    if (!r)
+        return JS_EXCEPTION;
+
+    if (JS_IsString(argv[1])) {
+        r->str = JS_ToCStringLen(ctx, &len, argv[1]);
+        if (!r->str)
+            goto fail;
+        data = (uint8_t *) r->str;
+    } else {
+        data = JS_GetArrayBuffer(ctx, &size, argv[1]);
+        if (data) {
+            len = size;
+        } else {
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            ab = JS_GetTypedArrayBuffer(ctx, argv[1], &offset, &len, &bpe);
+            if (JS_IsException(ab))
+                goto fail;
+            data = JS_GetArrayBuffer(ctx, &size, ab);
+            JS_FreeValue(ctx, ab);
+            if (!data)
+                goto fail;
+            data += offset;
+        }
+        /* pinned instead of copied */
+        r->data = JS_DupValue(ctx, argv[1]);
+    }
+
+    b = uv_buf_init((char *) data, len);
+    err = uv_fs_write(&fa_get_runtime(ctx)->loop, &r->req, fd, &b, 1, pos, fa_fs_cb);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, err);
+    }
+
+    fa_fs_req_submitted(r);
+    return promise;
+
+fail:
+    JS_FreeValue(ctx, promise);
+    fa_fs_req_free(r);
+    return JS_EXCEPTION;
+}
+
+static JSValue fa_fs_path_op (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic) {
+    uv_loop_t *loop = &fa_get_runtime(ctx)->loop;
+    fa_fs_req_t *r;
+    JSValue promise;
+    const char *path;
+    int err;
+
+    path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+
+    r = fa_fs_req_new(ctx, &promise);
+    if (!r) {
+        JS_FreeCString(ctx, path);
+        return JS_EXCEPTION;
+    }
+
+    if (magic == UV_FS_SCANDIR)
+        err = uv_fs_scandir(loop, &r->req, path, 0, fa_fs_cb);
+    else
+        err = uv_fs_stat(loop, &r->req, path, fa_fs_cb);
+    JS_FreeCString(ctx, path);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, err);
+    }
+
+    fa_fs_req_submitted(r);
+    return promise;
+}
+
+static JSValue fa_fs_fstat (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_fs_req_t *r;
+    JSValue promise;
+    int32_t fd;
+    int err;
+
+    if (JS_ToInt32(ctx, &fd, argv[0]))
+        return JS_EXCEPTION;
+
+    r = fa_fs_req_new(ctx, &promise);
+    if (!r)
+        return JS_EXCEPTION;
+
+    err = uv_fs_fstat(&fa_get_runtime(ctx)->loop, &r->req, fd, fa_fs_cb);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, err);
+    }
+
+    fa_fs_req_submitted(r);
+    return promise;
+}
+
+/* readFile */
+
+/* runs on the threadpool, the uv_fs_* calls are synchronous without a cb */
+static void fa_fs_read_file_work (uv_work_t *work) {
+    fa_fs_req_t *r = work->data;
+    uv_fs_t req;
+    uv_buf_t b;
+    uv_file fd;
+    size_t cap;
+    uint8_t *buf;
+    ssize_t n;
+
+    fd = uv_fs_open(NULL, &req, r->path, O_RDONLY, 0, NULL);
+    uv_fs_req_cleanup(&req);
+    if (fd < 0) {
+        r->result = fd;
+        return;
+    }
+
+    /* one spare byte, so a file read in full hits EOF without a realloc */
+    n = uv_fs_fstat(NULL, &req, fd, NULL);
+    cap = (n == 0 ? req.statbuf.st_size : 0) + 1;
+    uv_fs_req_cleanup(&req);
+
+    r->buf = malloc(cap);
+    r->len = 0;
+    r->result = 0;
+    if (!r->buf) {
+        r->result = UV_ENOMEM;
+        goto done;
+    }
+
+    for (;;) {
+        if (r->len == cap) {
+            /* the file grew or is not a regular file */
+            buf = realloc(r->buf, cap * 2);
+            if (!buf) {
+                r->result = UV_ENOMEM;
+                break;
+            }
+            r->buf = buf;
+            cap *= 2;
+        }
+        b = uv_buf_init((char *) r->buf + r->len, cap - r->len);
+        n = uv_fs_read(NULL, &req, fd, &b, 1, -1, NULL);
+        uv_fs_req_cleanup(&req);
+        if (n <= 0) {
+            if (n < 0)
+                r->result = n;
+            break;
+        }
+        r->len += n;
+    }
+
+done:
+    uv_fs_close(NULL, &req, fd, NULL);
+    uv_fs_req_cleanup(&req);
+}
+
+static void fa_fs_read_file_done (uv_work_t *work, int status) {
+    fa_fs_req_t *r = work->data;
+    JSContext *ctx = r->ctx;
+    int err = status < 0 ? status : r->result;
+
+    if (!r->fs) {
+        fa_fs_req_free(r);
+        return;
+    }
+
+    if (err < 0) {
+        JSValue error = fa_new_uv_error(ctx, err);
+        fa_reject_promise(ctx, &r->promise, 1, (JSValueConst *) &error);
+        fa_fs_req_free(r);
+        return;
+    }
+
+    fa_fs_settle(r, fa_fs_adopt_buffer(r, r->len));
+}
+
+/* readFile(path) resolves with the whole file in an ArrayBuffer */
+static JSValue fa_fs_read_file (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_fs_req_t *r;
+    JSValue promise;
+    const char *path;
+    int err;
+
+    path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+
+    r = fa_fs_req_new(ctx, &promise);
+    if (!r) {
+        JS_FreeCString(ctx, path);
+        return JS_EXCEPTION;
+    }
+
+    r->path = strdup(path);
+    JS_FreeCString(ctx, path);
+    if (!r->path) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, UV_ENOMEM);
+    }
+
+    err = uv_queue_work(&fa_get_runtime(ctx)->loop, &r->work, fa_fs_read_file_work, fa_fs_read_file_done);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        return fa_fs_req_fail(r, err);
+    }
+
+    fa_fs_req_submitted(r);
+    return promise;
+}
+
+/* Streams */
+
+typedef struct fa_fs_stream_s {
+    uv_fs_t req;
+    fa_runtime_t *qrt;
+    /* NULL once the stream closed the source or sink */
+    fa_stream_t *s;
+    uv_file fd;
+    /* a request is in flight */
+    int busy;
+    /* the context goes away, an orphaned request only frees the stream */
+    int tearing;
+    /* readable: read target */
+    uint8_t *chunk;
+    /* writable: bytes still to write */
+    const uint8_t *wbuf;
+    size_t wlen;
+} fa_fs_stream_t;
+
+static void fa_fs_stream_cleanup (fa_runtime_t *qrt, void *opaque);
+
+static void fa_fs_stream_free (fa_fs_stream_t *fss) {
+    uv_fs_t req;
+
+    if (fss->fd >= 0) {
+        /* closing is cheap enough to do synchronously */
+        uv_fs_close(NULL, &req, fss->fd, NULL);
+        uv_fs_req_cleanup(&req);
+    }
+    if (fss->chunk)
+        fa_chunk_free(fss->chunk);
+    fa_remove_cleanup(fss->qrt, fa_fs_stream_cleanup, fss);
+    free(fss);
+}
+
+/* a request in flight is orphaned, the stream is freed once it is done */
+static void fa_fs_stream_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_fs_stream_t *fss = opaque;
+
+    fss->tearing = 1;
+    if (fss->busy) {
+        /* the threadpool may still read the chunk being written */
+        if (fss->s && fss->req.fs_type == UV_FS_WRITE)
+            fss->chunk = fa_writable_take_chunk(fss->s);
+        fa_hold_orphan(qrt, NULL);
+        uv_cancel((uv_req_t *) &fss->req);
+        return;
+    }
+
+    /* otherwise the stream closes it */
+    if (!fss->s)
+        fa_fs_stream_free(fss);
+}
+
+/* returns 1 if the callback should not touch the stream */
+static int fa_fs_stream_req_done (fa_fs_stream_t *fss) {
+    fss->busy = 0;
+    uv_fs_req_cleanup(&fss->req);
+
+    if (fss->tearing) {
+        fa_release_orphan(fss->qrt, NULL);
+        /* the stream was detached by the same teardown */
+        if (!fss->s)
+            fa_fs_stream_free(fss);
+        return 1;
+    }
+    if (!fss->s) {
+        fa_fs_stream_free(fss);
+        return 1;
+    }
+    return 0;
+}
+
+static void fa_fs_stream_close (fa_stream_t *s) {
+    fa_fs_stream_t *fss = fa_stream_get_opaque(s);
+
+    fss->s = NULL;
+    /* otherwise freed once the request is done */
+    if (!fss->busy)
+        fa_fs_stream_free(fss);
+}
+
+static int fa_fs_stream_open (
+    JSContext *ctx, 
+    fa_fs_stream_t *fss, 
+    JSValueConst path_val, 
+    int flags, 
+    uv_fs_cb cb
+) {
+    const char *path;
+    int err;
+
+    path = JS_ToCString(ctx, path_val);
+    if (!path)
+        return -1;
+
+    fss->busy = 1;
+    err = uv_fs_open(&fss->qrt->loop, &fss->req, path, flags, 0666, cb);
+    JS_FreeCString(ctx, path);
+    if (err < 0) {
+        fss->busy = 0;
+        uv_fs_req_cleanup(&fss->req);
+        JS_Throw(ctx, fa_new_uv_error(ctx, err));
+        return -1;
+    }
+
+    fa_add_context_cleanup(ctx, fa_fs_stream_cleanup, fss);
+    return 0;
+}
+
+static fa_fs_stream_t *fa_fs_stream_new (JSContext *ctx) {
+    fa_fs_stream_t *fss = malloc(sizeof(fa_fs_stream_t));
+    if (!fss) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    memset(fss, 0, sizeof(fa_fs_stream_t));
+    fss->qrt = fa_get_runtime(ctx);
+    fss->fd = -1;
+    fss->req.data = fss;
+    return fss;
+}
+
+static int fa_fs_get_hwm (JSContext *ctx, JSValueConst options, size_t *phwm) {
+    JSValue val;
+    uint64_t hwm = 0;
+
+    *phwm = 0;
+    if (!JS_IsObject(options))
+        return 0;
+
+    val = JS_GetPropertyStr(ctx, options, "highWaterMark");
+    if (!JS_IsUndefined(val) && JS_ToIndex(ctx, &hwm, val)) {
+        JS_FreeValue(ctx, val);
+        return -1;
+    }
+    JS_FreeValue(ctx, val);
+
+    *phwm = hwm;
+    return 0;
+}
+
+/* Readable */
+
+static void fa_fs_stream_read (fa_fs_stream_t *fss);
+
+static void fa_fs_stream_read_cb (uv_fs_t *req) {
+    fa_fs_stream_t *fss = req->data;
+    uint8_t *chunk = fss->chunk;
+    ssize_t n = req->result;
+
+    if (fa_fs_stream_req_done(fss))
+        return;
+
+    fss->chunk = NULL;
+    if (n <= 0) {
+        fa_chunk_free(chunk);
+        fa_readable_end(fss->s, n);
+        return;
+    }
+
+    /* read ahead until the stream buffered up to its high water mark */
+    if (fa_readable_push(fss->s, chunk, n))
+        fa_fs_stream_read(fss);
+}
+
+static void fa_fs_stream_read (fa_fs_stream_t *fss) {
+    uv_buf_t b;
+    int err;
+
+    fss->chunk = fa_chunk_alloc(fss->qrt);
+    if (!fss->chunk) {
+        fa_readable_end(fss->s, UV_ENOMEM);
+        return;
+    }
+
+    b = uv_buf_init((char *) fss->chunk, FA_STREAM_CHUNK_SIZE);
+    fss->busy = 1;
+    err = uv_fs_read(&fss->qrt->loop, &fss->req, fss->fd, &b, 1, -1, fa_fs_stream_read_cb);
+    if (err < 0) {
+        fss->busy = 0;
+        uv_fs_req_cleanup(&fss->req);
+        fa_chunk_free(fss->chunk);
+        fss->chunk = NULL;
+        fa_readable_end(fss->s, err);
+    }
+}
+
+static void fa_fs_stream_pull (fa_stream_t *s) {
+    fa_fs_stream_t *fss = fa_stream_get_opaque(s);
+
+    /* a request started after the cleanup would not be orphaned */
+    if (fss->fd >= 0 && !fss->busy && !fss->tearing)
+        fa_fs_stream_read(fss);
+}
+
+static void fa_fs_stream_open_read_cb (uv_fs_t *req) {
+    fa_fs_stream_t *fss = req->data;
+    ssize_t fd = req->result;
+
+    if (fd >= 0)
+        fss->fd = fd;
+    if (fa_fs_stream_req_done(fss))
+        return;
+
+    if (fd < 0)
+        fa_readable_end(fss->s, fd);
+    else
+        fa_fs_stream_read(fss);
+}
+
+static const fa_stream_ops_t fa_fs_read_stream_ops = {
+    .pull = fa_fs_stream_pull,
+    .close = fa_fs_stream_close,
+};
+
+/* createReadStream(path, { highWaterMark }) */
+static JSValue fa_fs_create_read_stream (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_fs_stream_t *fss;
+    JSValue obj;
+    size_t hwm;
+
+    if (fa_fs_get_hwm(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, &hwm))
+        return JS_EXCEPTION;
+
+    fss = fa_fs_stream_new(ctx);
+    if (!fss)
+        return JS_EXCEPTION;
+
+    obj = fa_new_readable(ctx, &fa_fs_read_stream_ops, fss, hwm, &fss->s);
+    if (JS_IsException(obj)) {
+        free(fss);
+        return obj;
+    }
+
+    if (fa_fs_stream_open(ctx, fss, argv[0], O_RDONLY, fa_fs_stream_open_read_cb) < 0) {
+        fa_readable_end(fss->s, 0);
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+
+    return obj;
+}
+
+/* Writable */
+
+static void fa_fs_stream_write (fa_fs_stream_t *fss);
+
+static void fa_fs_stream_write_cb (uv_fs_t *req) {
+    fa_fs_stream_t *fss = req->data;
+    ssize_t n = req->result;
+
+    if (fa_fs_stream_req_done(fss))
+        return;
+
+    if (n < 0) {
+        fa_writable_done(fss->s, n);
+        return;
+    }
+
+    /* short writes are continued, the stream only hears about the whole */
+    fss->wbuf += n;
+    fss->wlen -= n;
+    if (fss->wlen > 0)
+        fa_fs_stream_write(fss);
+    else
+        fa_writable_done(fss->s, 0);
+}
+
+static void fa_fs_stream_write (fa_fs_stream_t *fss) {
+    uv_buf_t b;
+    int err;
+
+    b = uv_buf_init((char *) fss->wbuf, fss->wlen);
+    fss->busy = 1;
+    err = uv_fs_write(&fss->qrt->loop, &fss->req, fss->fd, &b, 1, -1, fa_fs_stream_write_cb);
+    if (err < 0) {
+        fss->busy = 0;
+        uv_fs_req_cleanup(&fss->req);
+        fa_writable_done(fss->s, err);
+    }
+}
+
+static int fa_fs_stream_sink_write (fa_stream_t *s, const uint8_t *buf, size_t len) {
+    fa_fs_stream_t *fss = fa_stream_get_opaque(s);
+
+    if (fss->tearing)
+        return UV_ECANCELED;
+    fss->wbuf = buf;
+    fss->wlen = len;
+    /* written once the file is open */
+    if (fss->fd >= 0)
+        fa_fs_stream_write(fss);
+    return 0;
+}
+
+static void fa_fs_stream_open_write_cb (uv_fs_t *req) {
+    fa_fs_stream_t *fss = req->data;
+    ssize_t fd = req->result;
+
+    if (fd >= 0)
+        fss->fd = fd;
+    if (fa_fs_stream_req_done(fss))
+        return;
+
+    if (fd < 0)
+        fa_writable_done(fss->s, fd);
+    else if (fss->wlen > 0)
+        fa_fs_stream_write(fss);
+}
+
+static const fa_stream_ops_t fa_fs_write_stream_ops = {
+    .write = fa_fs_stream_sink_write,
+    .close = fa_fs_stream_close,
+};
+
+/* createWriteStream(path, { flags = 'w', highWaterMark }) */
+static JSValue fa_fs_create_write_stream (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    JSValueConst options = argc > 1 ? argv[1] : JS_UNDEFINED;
+    fa_fs_stream_t *fss;
+    JSValue obj, flags_val;
+    size_t hwm;
+    int flags;
+
+    if (fa_fs_get_hwm(ctx, options, &hwm))
+        return JS_EXCEPTION;
+
+    flags_val = JS_IsObject(options) ? JS_GetPropertyStr(ctx, options, "flags") : JS_UNDEFINED;
+    if (JS_IsUndefined(flags_val)) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (fa_fs_parse_flags(ctx, flags_val, &flags)) {
+        JS_FreeValue(ctx, flags_val);
+        return JS_EXCEPTION;
+    }
+    JS_FreeValue(ctx, flags_val);
+
+    fss = fa_fs_stream_new(ctx);
+    if (!fss)
+        return JS_EXCEPTION;
+
+    obj = fa_new_writable(ctx, &fa_fs_write_stream_ops, fss, hwm, &fss->s);
+    if (JS_IsException(obj)) {
+        free(fss);
+        return obj;
+    }
+
+    if (fa_fs_stream_open(ctx, fss, argv[0], flags, fa_fs_stream_open_write_cb) < 0) {
+        fa_writable_done(fss->s, UV_ECANCELED);
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+
+    return obj;
+}
+
+static const JSCFunctionListEntry js_fs_funcs[] = {
+    JS_CFUNC_DEF("open", 3, fa_fs_open),
+    JS_CFUNC_DEF("close", 1, fa_fs_close),
+    JS_CFUNC_DEF("read", 3, fa_fs_read),
+    JS_CFUNC_DEF("write", 3, fa_fs_write),
+    JS_CFUNC_MAGIC_DEF("stat", 1, fa_fs_path_op, UV_FS_STAT),
+    JS_CFUNC_MAGIC_DEF("readdir", 1, fa_fs_path_op, UV_FS_SCANDIR),
+    JS_CFUNC_DEF("fstat", 1, fa_fs_fstat),
+    JS_CFUNC_DEF("readFile", 1, fa_fs_read_file),
+    JS_CFUNC_DEF("createReadStream", 2, fa_fs_create_read_stream),
+    JS_CFUNC_DEF("createWriteStream", 2, fa_fs_create_write_stream),
+};
+
+static int js_fs_init (JSContext *ctx, JSModuleDef *m) {
+    return JS_SetModuleExportList(ctx, m, js_fs_funcs, countof(js_fs_funcs));
+}
+
+JSModuleDef *js_init_module_fs (JSContext *ctx, const char *module_name) {
+    JSModuleDef *m;
+    m = JS_NewCModule(ctx, module_name, js_fs_init);
+    if (!m) return NULL;
+    JS_AddModuleExportList(ctx, m, js_fs_funcs, countof(js_fs_funcs));
+    return m;
+}
@@ -0,0 +1,228 @@
+#include "runtime.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Function handles for embedders calling the same JS function many times.
+ * Resolution interns the names and looks the function up once, the handle
+ * keeps the function value so a call does no property lookup at all. The
+ * arguments live in an array owned by the handle: each slot is kept until
+ * it is set again, so arguments which do not change are set once and ints
+ * and doubles never allocate.
+ *
+ * Handles still alive when the context goes away are emptied by a cleanup,
+ * calling them afterwards fails with no exception pending.
+ */
+
+struct fa_function_s {
+    fa_runtime_t *qrt;
+    /* NULL once the context is gone */
+    JSContext *ctx;
+    JSValue func;
+    JSValue argv[FA_FUNCTION_MAX_ARGS];
+};
+
+static void fa_function_release (fa_function_t *f) {
+    int i;
+
+    if (!f->ctx)
+        return;
+
+    JS_FreeValue(f->ctx, f->func);
+    for (i = 0; i < FA_FUNCTION_MAX_ARGS; i++)
+        JS_FreeValue(f->ctx, f->argv[i]);
+    f->ctx = NULL;
+}
+
+static void fa_function_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_function_release(opaque);
+}
+
+/* consumes func */
+static fa_function_t *fa_function_new (JSContext *ctx, JSValue func) {
+    fa_function_t *f;
+    int i;
+
+    if (!JS_IsFunction(ctx, func)) {
+        JS_FreeValue(ctx, func);
+        JS_ThrowTypeError(ctx, "not a function");
+        return NULL;
+    }
+
+    f = malloc(sizeof(fa_function_t));
+    if (!f) {
+        JS_FreeValue(ctx, func);
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    f->qrt = fa_get_runtime(ctx);
+    f->ctx = ctx;
+    f->func = func;
+    for (i = 0; i < FA_FUNCTION_MAX_ARGS; i++)
+        f->argv[i] = JS_UNDEFINED;
+
+    fa_add_context_cleanup(ctx, fa_function_cleanup, f);
+    return f;
+}
+
+fa_function_t *fa_get_function (JSContext *ctx, const char *name) {
+    JSValue global, func;
+    JSAtom atom;
+
+    atom = JS_NewAtom(ctx, name);
+    if (atom == JS_ATOM_NULL)
+        return NULL;
+
+    global = JS_GetGlobalObject(ctx);
+    func = JS_GetProperty(ctx, global, atom);
+    JS_FreeValue(ctx, global);
+    JS_FreeAtom(ctx, atom);
+    if (JS_IsException(func))
+        return NULL;
+
+    return fa_function_new(ctx, func);
+}
+
+/* imports the module and runs the jobs its evaluation queued */
+static JSValue fa_function_import (JSContext *ctx, const char *module_name) {
+    static const char importer_src[] = "(name) => import(name)";
+    JSValue importer, name, promise, ns;
+    int state;
+
+    importer = JS_Eval(ctx, importer_src, sizeof(importer_src) - 1, "<import>", JS_EVAL_TYPE_GLOBAL);
+    if (JS_IsException(importer))
+        return JS_EXCEPTION;
+
+    name = JS_NewString(ctx, module_name);
+    promise = JS_Call(ctx, importer, JS_UNDEFINED, 1, (JSValueConst *) &name);
+    JS_FreeValue(ctx, name);
+    JS_FreeValue(ctx, importer);
+    if (JS_IsException(promise))
+        return JS_EXCEPTION;
+
+    fa_execute_jobs(ctx);
+
+    state = JS_PromiseState(ctx, promise);
+    if (state == JS_PROMISE_FULFILLED) {
+        ns = JS_PromiseResult(ctx, promise);
+    } else if (state == JS_PROMISE_REJECTED) {
+        ns = JS_Throw(ctx, JS_PromiseResult(ctx, promise));
+    } else {
+        /* a top-level await waits for the loop */
+        ns = JS_ThrowInternalError(ctx, "module %s is still evaluating", module_name);
+    }
+    JS_FreeValue(ctx, promise);
+
+    return ns;
+}
+
+fa_function_t *fa_get_module_function (JSContext *ctx, const char *module_name, const char *export_name) {
+    JSValue ns, func;
+    JSAtom atom;
+
+    atom = JS_NewAtom(ctx, export_name);
+    if (atom == JS_ATOM_NULL)
+        return NULL;
+
+    ns = fa_function_import(ctx, module_name);
+    if (JS_IsException(ns)) {
+        JS_FreeAtom(ctx, atom);
+        return NULL;
+    }
+
+    func = JS_GetProperty(ctx, ns, atom);
+    JS_FreeValue(ctx, ns);
+    JS_FreeAtom(ctx, atom);
+    if (JS_IsException(func))
+        return NULL;
+
+    return fa_function_new(ctx, func);
+}
+
+void fa_free_function (fa_function_t *f) {
+    if (f->ctx)
+        fa_remove_cleanup(f->qrt, fa_function_cleanup, f);
+    fa_function_release(f);
+    free(f);
+}
+
+JSContext *fa_function_get_context (fa_function_t *f) {
+    return f->ctx;
+}
+
+/* Arguments */
+
+int fa_function_set_value (fa_function_t *f, int i, JSValue val) {
+    /* the context is gone, there is nothing to throw in */
+    if (!f->ctx)
+        return -1;
+    if (JS_IsException(val))
+        return -1;
+    if (i < 0 || i >= FA_FUNCTION_MAX_ARGS) {
+        JS_FreeValue(f->ctx, val);
+        JS_ThrowRangeError(f->ctx, "invalid argument index %d", i);
+        return -1;
+    }
+
+    JS_FreeValue(f->ctx, f->argv[i]);
+    f->argv[i] = val;
+    return 0;
+}
+
+int fa_function_set_int (fa_function_t *f, int i, int32_t val) {
+    return fa_function_set_value(f, i, JS_NewInt32(f->ctx, val));
+}
+
+int fa_function_set_int64 (fa_function_t *f, int i, int64_t val) {
+    return fa_function_set_value(f, i, JS_NewInt64(f->ctx, val));
+}
+
+int fa_function_set_double (fa_function_t *f, int i, double val) {
+    return fa_function_set_value(f, i, JS_NewFloat64(f->ctx, val));
+}
+
+int fa_function_set_string (fa_function_t *f, int i, const char *str, size_t len) {
+    if (!f->ctx)
+        return -1;
+    return fa_function_set_value(f, i, JS_NewStringLen(f->ctx, str, len));
+}
+
+int fa_function_set_array_buffer (fa_function_t *f, int i, const uint8_t *buf, size_t len) {
+    if (!f->ctx)
+        return -1;
+    return fa_function_set_value(f, i, JS_NewArrayBufferCopy(f->ctx, buf, len));
+}
+
+/* Calls */
+
+JSValue fa_function_call (fa_function_t *f, int argc) {
+    if (!f->ctx)
+        return JS_EXCEPTION;
+    if (argc < 0 || argc > FA_FUNCTION_MAX_ARGS)
+        return JS_ThrowRangeError(f->ctx, "too many arguments");
+
+    return JS_Call(f->ctx, f->func, JS_UNDEFINED, argc, (JSValueConst *) f->argv);
+}
+
+int fa_function_call_int (fa_function_t *f, int argc, int32_t *pres) {
+    JSValue ret = fa_function_call(f, argc);
+    int err;
+
+    if (JS_IsException(ret))
+        return -1;
+    err = JS_ToInt32(f->ctx, pres, ret);
+    JS_FreeValue(f->ctx, ret);
+    return err;
+}
+
+int fa_function_call_double (fa_function_t *f, int argc, double *pres) {
+    JSValue ret = fa_function_call(f, argc);
+    int err;
+
+    if (JS_IsException(ret))
+        return -1;
+    err = JS_ToFloat64(f->ctx, pres, ret);
+    JS_FreeValue(f->ctx, ret);
+    return err;
+}
@@ -1,10 +1,16 @@
 #include "modules.h"
+#include "runtime.h"
+#include "compress.h"
+#include "cache.h"
+#include "utils.h"
 #include <cutils.h>
 #include <errno.h>
 #include <limits.h>
 #include <dlfcn.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 uint8_t *fa_load_file(JSContext *ctx, size_t *pbuf_len, const char *filename)
 {
@@ -167,30 +173,88 @@ int js_module_set_import_meta(
     return 0;
 }
 
+static JSValue fa_compile_source_module (
+    JSContext *ctx,
+    const char *module_name,
+    const char *cache_dir
+) {
+    const int eval_flags = JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY;
+    size_t buf_len, cached_len, out_len;
+    uint8_t *buf, *cached, *out;
+    fa_cache_header_t hdr;
+    struct stat st;
+    JSValue func_val;
+
+    buf = fa_load_file(ctx, &buf_len, module_name);
+    if (!buf) {
+        JS_ThrowReferenceError(ctx, "could not load module filename '%s'",
+                               module_name);
+        return JS_EXCEPTION;
+    }
+
+    if (!cache_dir) {
+        func_val = JS_Eval(ctx, (char *)buf, buf_len, module_name, eval_flags);
+        js_free(ctx, buf);
+        return func_val;
+    }
+
+    /* entries are only valid for the exact source they were compiled from */
+    int64_t mtime = stat(module_name, &st) == 0 ? (int64_t)st.st_mtime : 0;
+    fa_cache_init_header(&hdr, module_name, buf, buf_len, eval_flags, mtime);
+
+    cached = fa_cache_read(cache_dir, &hdr, &cached_len);
+    if (cached) {
+        js_free(ctx, buf);
+        func_val = JS_ReadObject(ctx, cached, cached_len, JS_READ_OBJ_BYTECODE);
+        free(cached);
+        if (!JS_IsException(func_val) && JS_VALUE_GET_TAG(func_val) == JS_TAG_MODULE)
+            return func_val;
+        /* a stale or corrupt entry is recompiled and overwritten */
+        if (JS_IsException(func_val))
+            JS_FreeValue(ctx, JS_GetException(ctx));
+        else
+            JS_FreeValue(ctx, func_val);
+        buf = fa_load_file(ctx, &buf_len, module_name);
+        if (!buf) {
+            JS_ThrowReferenceError(ctx, "could not load module filename '%s'",
+                                   module_name);
+            return JS_EXCEPTION;
+        }
+    }
+
+    func_val = JS_Eval(ctx, (char *)buf, buf_len, module_name, eval_flags);
+    js_free(ctx, buf);
+    if (JS_IsException(func_val))
+        return func_val;
+
+    out = JS_WriteObject(ctx, &out_len, func_val, JS_WRITE_OBJ_BYTECODE);
+    if (out) {
+        /* a read-only cache directory just means every load compiles */
+        fa_cache_write(cache_dir, &hdr, out, out_len);
+        js_free(ctx, out);
+    } else {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+    }
+
+    return func_val;
+}
+
 JSModuleDef *fa_module_loader (
     JSContext *ctx,
     const char *module_name, void *opaque
 ) {
     JSModuleDef *m;
+    fa_runtime_t *qrt = opaque;
+    uint64_t start = uv_hrtime();
 
     if (has_suffix(module_name, ".so")) {
         m = fa_module_loader_so(ctx, module_name);
     } else {
-        size_t buf_len;
-        uint8_t *buf;
         JSValue func_val;
     
-        buf = fa_load_file(ctx, &buf_len, module_name);
-        if (!buf) {
-            JS_ThrowReferenceError(ctx, "could not load module filename '%s'",
-                                   module_name);
-            return NULL;
-        }
-        
         /* compile the module */
-        func_val = JS_Eval(ctx, (char *)buf, buf_len, module_name,
-                           JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
-        js_free(ctx, buf);
+        func_val = fa_compile_source_module(ctx, module_name, 
+                                            qrt ? qrt->code_cache_dir : NULL);
         if (JS_IsException(func_val))
             return NULL;
         /* XXX: could propagate the exception */
@@ -199,5 +263,97 @@ JSModuleDef *fa_module_loader (
         m = JS_VALUE_GET_PTR(func_val);
         JS_FreeValue(ctx, func_val);
     }
+
+    if (qrt && m) {
+        qrt->stats.module_loads++;
+        qrt->stats.module_load_time_ns += uv_hrtime() - start;
+    }
+    return m;
+}
+
+JSValue fa_bundle_read_object (
+    JSContext *ctx,
+    const fa_bundle_t *bundle,
+    const fa_bundle_entry_t *e
+) {
+    const uint8_t *blob = bundle->buf + e->offset;
+    uint64_t raw_len;
+    uint8_t *raw;
+    JSValue obj;
+
+    if (!(e->flags & FA_BUNDLE_MOD_COMPRESSED))
+        return JS_ReadObject(ctx, blob, e->length, JS_READ_OBJ_BYTECODE);
+
+    if (e->length < sizeof(uint64_t))
+        goto corrupt;
+    memcpy(&raw_len, blob, sizeof(uint64_t));
+    if (raw_len > SIZE_MAX)
+        goto corrupt;
+
+    /* inflate straight from the bundle into the buffer JS_ReadObject reads */
+    raw = js_malloc(ctx, raw_len);
+    if (!raw)
+        return JS_EXCEPTION;
+    if (fa_lz_decompress(blob + sizeof(uint64_t), e->length - sizeof(uint64_t), raw, raw_len) < 0) {
+        js_free(ctx, raw);
+        goto corrupt;
+    }
+    obj = JS_ReadObject(ctx, raw, raw_len, JS_READ_OBJ_BYTECODE);
+    js_free(ctx, raw);
+    return obj;
+
+corrupt:
+    return JS_ThrowSyntaxError(ctx, "bundled module '%s' is corrupt", 
+                               fa_bundle_entry_name(bundle, e));
+}
+
+static JSModuleDef *fa_bundle_read_module (
+    JSContext *ctx,
+    const fa_bundle_t *bundle,
+    const fa_bundle_entry_t *e
+) {
+    JSModuleDef *m;
+    JSValue obj;
+
+    obj = fa_bundle_read_object(ctx, bundle, e);
+    if (JS_IsException(obj))
+        return NULL;
+    if (JS_VALUE_GET_TAG(obj) != JS_TAG_MODULE) {
+        JS_FreeValue(ctx, obj);
+        JS_ThrowReferenceError(ctx, "bundled module '%s' is not a module", 
+                               fa_bundle_entry_name(bundle, e));
+        return NULL;
+    }
+    /* the source is not available to realpath() */
+    js_module_set_import_meta(ctx, obj, 0, 0);
+    /* the module is already referenced, so we must free it */
+    m = JS_VALUE_GET_PTR(obj);
+    JS_FreeValue(ctx, obj);
     return m;
+}
+
+JSModuleDef *fa_bundle_module_loader (
+    JSContext *ctx,
+    const char *module_name, void *opaque
+) {
+    fa_runtime_t *qrt = opaque;
+    struct fa_runtime_bundle_s *b;
+    fa_bundle_entry_t e;
+    JSModuleDef *m;
+    uint64_t start;
+
+    /* bytecode is only deserialized the first time a module is resolved */
+    for (b = qrt->bundles; b != NULL; b = b->next) {
+        if (fa_bundle_find(&b->bundle, module_name, &e) >= 0) {
+            start = uv_hrtime();
+            m = fa_bundle_read_module(ctx, &b->bundle, &e);
+            if (m) {
+                qrt->stats.module_loads++;
+                qrt->stats.module_load_time_ns += uv_hrtime() - start;
+            }
+            return m;
+        }
+    }
+
+    return fa_module_loader(ctx, module_name, opaque);
 }
\ No newline at end of file
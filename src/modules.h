@@ -8,6 +8,20 @@ JSModuleDef *fa_module_loader (
     const char *module_name, void *opaque
 );
 
+struct fa_bundle_s;
+struct fa_bundle_entry_s;
+
+JSValue fa_bundle_read_object (
+    JSContext *ctx,
+    const struct fa_bundle_s *bundle,
+    const struct fa_bundle_entry_s *e
+);
+
+JSModuleDef *fa_bundle_module_loader (
+    JSContext *ctx,
+    const char *module_name, void *opaque
+);
+
 int js_module_set_import_meta (
     JSContext *ctx, 
     JSValueConst func_val,
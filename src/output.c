@@ -0,0 +1,254 @@
+#include "runtime.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Buffered stdout. print and printf append to a ring which is drained right
+ * before the loop polls, so a burst of small writes costs one syscall. If
+ * stdout can be polled (a pipe, tty or socket) the ring is written in slices
+ * while it is writable and a slow reader never blocks the loop, otherwise
+ * (a file) it is written out at once. Only a full ring makes the writer
+ * catch up synchronously, that is the backpressure print and printf see.
+ */
+
+/* writes of up to PIPE_BUF never block once a pipe polled writable */
+#define FA_OUTPUT_SLICE 4096
+
+struct fa_output_s {
+    uv_prepare_t prepare;
+    uv_poll_t poll;
+    /* stdout can be polled */
+    int polling;
+    int closing;
+    uint8_t *ring;
+    /* a power of two, head and tail only grow */
+    size_t size;
+    size_t head;
+    size_t tail;
+};
+
+#if defined(_WIN32)
+static int fa_output_sys_write (const uint8_t *buf, size_t len) {
+    return _write(1, buf, (unsigned) len);
+}
+#else
+static int fa_output_sys_write (const uint8_t *buf, size_t len) {
+    return write(STDOUT_FILENO, buf, len);
+}
+#endif
+
+static void fa_output_poll_cb (uv_poll_t *handle, int status, int events);
+
+static int fa_output_writable (struct fa_output_s *o) {
+#if !defined(_WIN32)
+    struct pollfd pfd;
+
+    if (o->polling) {
+        pfd.fd = STDOUT_FILENO;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        return poll(&pfd, 1, 0) > 0;
+    }
+#endif
+    return 1;
+}
+
+/* waits until stdout takes more output, a writer sharing the fd may have
+   made it non-blocking */
+static void fa_output_wait (struct fa_output_s *o) {
+#if !defined(_WIN32)
+    struct pollfd pfd;
+
+    pfd.fd = STDOUT_FILENO;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    poll(&pfd, 1, -1);
+#endif
+}
+
+/* writes until the ring is empty, or until stdout would block unless block is set */
+static void fa_output_drain (struct fa_output_s *o, int block) {
+    size_t off, n;
+    int ret, failed = 0;
+
+    while (o->head != o->tail) {
+        if (!block && !fa_output_writable(o))
+            break;
+
+        off = o->head & (o->size - 1);
+        n = o->tail - o->head;
+        if (n > o->size - off)
+            n = o->size - off;
+        if (o->polling && !block && n > FA_OUTPUT_SLICE)
+            n = FA_OUTPUT_SLICE;
+
+        ret = fa_output_sys_write(o->ring + off, n);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* the poll handle picks it up once stdout is writable */
+                if (!block)
+                    break;
+                fa_output_wait(o);
+                continue;
+            }
+            /* other errors may pass, the ring is kept for the next print
+               or flush. Only a blocking drain has to make progress. */
+            if (errno != EPIPE && errno != EBADF && !block) {
+                failed = 1;
+                break;
+            }
+            /* stdout is gone, the output is dropped like fwrite would */
+            o->head = o->tail;
+            break;
+        }
+        o->head += ret;
+    }
+
+    if (o->closing)
+        return;
+
+    uv_prepare_stop(&o->prepare);
+    if (!o->polling)
+        return;
+    if (o->head != o->tail && !failed)
+        uv_poll_start(&o->poll, UV_WRITABLE, fa_output_poll_cb);
+    else
+        uv_poll_stop(&o->poll);
+}
+
+static void fa_output_prepare_cb (uv_prepare_t *handle) {
+    fa_output_drain(handle->data, 0);
+}
+
+static void fa_output_poll_cb (uv_poll_t *handle, int status, int events) {
+    struct fa_output_s *o = handle->data;
+
+    /* stdout is gone */
+    if (status < 0)
+        o->head = o->tail;
+
+    fa_output_drain(o, 0);
+}
+
+void fa_output_write (fa_runtime_t *qrt, const void *buf, size_t len) {
+    struct fa_output_s *o = qrt->output;
+    const uint8_t *p = buf;
+    size_t off, n;
+
+    if (!o) {
+        fwrite(buf, 1, len, stdout);
+        return;
+    }
+
+    /* whatever went through stdio before comes first */
+    if (o->head == o->tail)
+        fflush(stdout);
+
+    while (len > 0) {
+        if (o->tail - o->head == o->size)
+            fa_output_drain(o, 1);
+
+        off = o->tail & (o->size - 1);
+        n = o->size - (o->tail - o->head);
+        if (n > o->size - off)
+            n = o->size - off;
+        if (n > len)
+            n = len;
+
+        memcpy(o->ring + off, p, n);
+        o->tail += n;
+        p += n;
+        len -= n;
+    }
+
+    if (!uv_is_active((uv_handle_t *) &o->prepare))
+        uv_prepare_start(&o->prepare, fa_output_prepare_cb);
+}
+
+void fa_output_flush (fa_runtime_t *qrt) {
+    if (qrt->output)
+        fa_output_drain(qrt->output, 1);
+    fflush(stdout);
+}
+
+static void fa_output_close_cb (uv_handle_t *handle) {
+    struct fa_output_s *o = handle->data;
+
+    if (--o->closing > 0)
+        return;
+    free(o->ring);
+    free(o);
+}
+
+void fa_output_free (fa_runtime_t *qrt) {
+    struct fa_output_s *o = qrt->output;
+
+    if (!o)
+        return;
+
+    fa_output_drain(o, 1);
+    qrt->output = NULL;
+
+    o->closing = o->polling ? 2 : 1;
+    uv_close((uv_handle_t *) &o->prepare, fa_output_close_cb);
+    if (o->polling)
+        uv_close((uv_handle_t *) &o->poll, fa_output_close_cb);
+}
+
+int fa_set_stdout_buffered (fa_runtime_t *rt, size_t size) {
+    struct fa_output_s *o;
+    size_t ring_size = FA_OUTPUT_SLICE;
+
+    fa_output_free(rt);
+    if (size == 0)
+        return 0;
+
+    while (ring_size < size)
+        ring_size <<= 1;
+
+    o = malloc(sizeof(struct fa_output_s));
+    if (!o)
+        return -1;
+    memset(o, 0, sizeof(struct fa_output_s));
+
+    o->ring = malloc(ring_size);
+    if (!o->ring) {
+        free(o);
+        return -1;
+    }
+    o->size = ring_size;
+
+    uv_prepare_init(&rt->loop, &o->prepare);
+    o->prepare.data = o;
+
+#if !defined(_WIN32)
+    {
+        /* uv_poll_init makes the fd non-blocking, which stderr sharing the
+           tty and stdio writers do not expect. Writes are sliced instead. */
+        int flags = fcntl(STDOUT_FILENO, F_GETFL);
+
+        /* regular files can not be polled and are written at once */
+        if (flags >= 0 && uv_poll_init(&rt->loop, &o->poll, STDOUT_FILENO) == 0) {
+            o->poll.data = o;
+            o->polling = 1;
+        }
+        if (flags >= 0)
+            fcntl(STDOUT_FILENO, F_SETFL, flags);
+    }
+#endif
+
+    fflush(stdout);
+    rt->output = o;
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "runtime.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct fa_runtime_pool_s {
+    fa_runtime_t **free_list;
+    int count;
+    int size;
+    fa_runtime_init_func init;
+    void *opaque;
+    int has_options;
+    fa_runtime_options_t options;
+};
+
+static fa_runtime_t *fa_runtime_pool_new_runtime (fa_runtime_pool_t *pool) {
+    fa_runtime_t *rt = fa_new_runtime2(pool->has_options ? &pool->options : NULL);
+    if (!rt)
+        return NULL;
+    if (pool->init && pool->init(rt, rt->ctx, pool->opaque) < 0) {
+        fa_free_runtime(rt);
+        return NULL;
+    }
+    return rt;
+}
+
+fa_runtime_pool_t *fa_new_runtime_pool (int size, fa_runtime_init_func init, void *opaque) {
+    return fa_new_runtime_pool2(size, NULL, init, opaque);
+}
+
+fa_runtime_pool_t *fa_new_runtime_pool2 (
+    int size, 
+    const fa_runtime_options_t *options, 
+    fa_runtime_init_func init, 
+    void *opaque
+) {
+    fa_runtime_pool_t *pool = malloc(sizeof(fa_runtime_pool_t));
+    memset(pool, 0, sizeof(fa_runtime_pool_t));
+
+    if (options) {
+        pool->has_options = 1;
+        pool->options = *options;
+    }
+    pool->size = size;
+    pool->init = init;
+    pool->opaque = opaque;
+    pool->free_list = malloc(sizeof(fa_runtime_t *) * (size > 0 ? size : 1));
+
+    /* warm up the pool so the first requests don't pay for it */
+    while (pool->count < size) {
+        fa_runtime_t *rt = fa_runtime_pool_new_runtime(pool);
+        if (!rt)
+            break;
+        pool->free_list[pool->count++] = rt;
+    }
+
+    return pool;
+}
+
+void fa_free_runtime_pool (fa_runtime_pool_t *pool) {
+    while (pool->count > 0)
+        fa_free_runtime(pool->free_list[--pool->count]);
+    free(pool->free_list);
+    free(pool);
+}
+
+fa_runtime_t *fa_runtime_pool_acquire (fa_runtime_pool_t *pool) {
+    if (pool->count > 0)
+        return pool->free_list[--pool->count];
+    return fa_runtime_pool_new_runtime(pool);
+}
+
+void fa_runtime_pool_release (fa_runtime_pool_t *pool, fa_runtime_t *rt) {
+    /* live handles, requests or jobs would call into the old context, 
+       such runtimes are not recycled */
+    if (pool->count >= pool->size || uv_loop_alive(&rt->loop) || JS_IsJobPending(rt->rt)) {
+        fa_free_runtime(rt);
+        return;
+    }
+
+    if (fa_reset_context(rt) < 0 || 
+        (pool->init && pool->init(rt, rt->ctx, pool->opaque) < 0)) {
+        fa_free_runtime(rt);
+        return;
+    }
+
+    pool->free_list[pool->count++] = rt;
+}
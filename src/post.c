@@ -0,0 +1,437 @@
+#include "runtime.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/**
+ * Calls posted from other threads. Producers push onto an intrusive
+ * multi-producer single-consumer queue (Vyukov's, one atomic exchange per
+ * push and no locks) and send the runtime's async handle, the loop thread
+ * drains the queue in batches when the handle fires. libuv coalesces the
+ * sends, so a burst of posts costs one wakeup.
+ *
+ * A call names a global function and carries its arguments as a JSON
+ * array. The return value, or what a returned promise settles with, is
+ * handed to the completion callback as JSON text.
+ */
+
+/* calls run per wakeup before yielding to the rest of the loop */
+#define FA_POST_BATCH 1024
+
+typedef struct fa_post_call_s {
+    _Atomic(struct fa_post_call_s *) next;
+    fa_post_done_func done;
+    void *opaque;
+    char *func;
+    /* NULL for no arguments */
+    char *args;
+    size_t args_len;
+} fa_post_call_t;
+
+struct fa_post_s {
+    uv_async_t async;
+    /* producers swap themselves in here */
+    _Atomic(fa_post_call_t *) head;
+    /* keeps the consumer's end off the producers' cache line */
+    char pad[64];
+    fa_post_call_t *tail;
+    fa_post_call_t stub;
+};
+
+struct fa_future_s {
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    int done;
+    int status;
+    char *result;
+    /* the waiter and the call */
+    atomic_int refcount;
+};
+
+/* Queue */
+
+static void fa_post_push (struct fa_post_s *q, fa_post_call_t *c) {
+    fa_post_call_t *prev;
+
+    atomic_store_explicit(&c->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, c, memory_order_acq_rel);
+    /* until this store the consumer can not see c nor anything after it */
+    atomic_store_explicit(&prev->next, c, memory_order_release);
+}
+
+/* NULL if the queue is empty or a producer is between its two steps, that
+   producer sends the async handle afterwards */
+static fa_post_call_t *fa_post_pop (struct fa_post_s *q) {
+    fa_post_call_t *tail = q->tail;
+    fa_post_call_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (!next)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    /* tail is the last call, the stub goes behind it so it can be taken */
+    fa_post_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* Completion */
+
+static void fa_post_complete (fa_post_call_t *c, int status, const char *result) {
+    if (c->done)
+        c->done(status, result, c->opaque);
+    free(c);
+}
+
+/* consumes val, errors are passed as their string conversion */
+static void fa_post_complete_value (JSContext *ctx, fa_post_call_t *c, int is_error, JSValue val) {
+    JSValue json = JS_UNDEFINED;
+    const char *str = NULL;
+
+    if (!is_error) {
+        json = JS_JSONStringify(ctx, val, JS_UNDEFINED, JS_UNDEFINED);
+        if (JS_IsException(json)) {
+            JS_FreeValue(ctx, val);
+            val = JS_GetException(ctx);
+            is_error = 1;
+        } else if (!JS_IsUndefined(json)) {
+            str = JS_ToCString(ctx, json);
+        }
+    }
+    if (is_error)
+        str = JS_ToCString(ctx, val);
+
+    fa_post_complete(c, is_error ? -1 : 0, str);
+
+    if (str)
+        JS_FreeCString(ctx, str);
+    JS_FreeValue(ctx, json);
+    JS_FreeValue(ctx, val);
+}
+
+/* holds a call while the promise it returned is pending */
+
+static void fa_post_finalizer (JSRuntime *rt, JSValue val) {
+    fa_post_call_t *c = JS_GetOpaque(val, fa_post_class_id);
+
+    if (c)
+        fa_post_complete(c, -1, "promise was never settled");
+}
+
+static JSClassDef fa_post_class = {
+    "PostedCall",
+    .finalizer = fa_post_finalizer,
+};
+
+static JSValue fa_post_settled (
+    JSContext *ctx,
+    JSValueConst this_val,
+    int argc,
+    JSValueConst *argv,
+    int magic,
+    JSValue *func_data
+) {
+    fa_post_call_t *c = JS_GetOpaque(func_data[0], fa_post_class_id);
+
+    if (!c)
+        return JS_UNDEFINED;
+    JS_SetOpaque(func_data[0], NULL);
+
+    fa_post_complete_value(ctx, c, magic, JS_DupValue(ctx, argc > 0 ? argv[0] : JS_UNDEFINED));
+    return JS_UNDEFINED;
+}
+
+/* completes the call once the promise settles */
+static int fa_post_await (JSContext *ctx, fa_post_call_t *c, JSValueConst promise) {
+    JSValue holder, funcs[2], then, ret;
+
+    holder = JS_NewObjectClass(ctx, fa_post_class_id);
+    if (JS_IsException(holder))
+        return -1;
+    JS_SetOpaque(holder, c);
+
+    funcs[0] = JS_NewCFunctionData(ctx, fa_post_settled, 1, 0, 1, (JSValueConst *) &holder);
+    funcs[1] = JS_NewCFunctionData(ctx, fa_post_settled, 1, 1, 1, (JSValueConst *) &holder);
+    then = JS_GetPropertyStr(ctx, promise, "then");
+    ret = JS_Call(ctx, then, promise, 2, (JSValueConst *) funcs);
+
+    JS_FreeValue(ctx, then);
+    JS_FreeValue(ctx, funcs[0]);
+    JS_FreeValue(ctx, funcs[1]);
+    if (JS_IsException(ret)) {
+        /* the caller completes the call with the exception */
+        JS_SetOpaque(holder, NULL);
+        JS_FreeValue(ctx, holder);
+        return -1;
+    }
+    JS_FreeValue(ctx, ret);
+    JS_FreeValue(ctx, holder);
+    return 0;
+}
+
+/* Dispatch */
+
+static JSValue fa_post_invoke (JSContext *ctx, fa_post_call_t *c) {
+    JSValue global, func, args, len_val, ret;
+    JSValue *argv = NULL;
+    uint32_t argc = 0, i;
+    int64_t len = 0;
+
+    global = JS_GetGlobalObject(ctx);
+    func = JS_GetPropertyStr(ctx, global, c->func);
+    if (!JS_IsFunction(ctx, func)) {
+        JS_FreeValue(ctx, func);
+        JS_FreeValue(ctx, global);
+        return JS_ThrowTypeError(ctx, "%s is not a function", c->func);
+    }
+
+    args = JS_UNDEFINED;
+    if (c->args) {
+        args = JS_ParseJSON(ctx, c->args, c->args_len, "<post>");
+        if (!JS_IsException(args) && !JS_IsArray(ctx, args)) {
+            JS_FreeValue(ctx, args);
+            args = JS_ThrowTypeError(ctx, "arguments must be a JSON array");
+        }
+        if (JS_IsException(args))
+            goto fail;
+        len_val = JS_GetPropertyStr(ctx, args, "length");
+        if (JS_ToInt64(ctx, &len, len_val)) {
+            JS_FreeValue(ctx, len_val);
+            goto fail;
+        }
+        JS_FreeValue(ctx, len_val);
+    }
+
+    if (len > 0) {
+        argv = malloc(sizeof(JSValue) * len);
+        if (!argv) {
+            JS_ThrowOutOfMemory(ctx);
+            goto fail;
+        }
+        for (argc = 0; argc < len; argc++)
+            argv[argc] = JS_GetPropertyUint32(ctx, args, argc);
+    }
+
+    ret = JS_Call(ctx, func, global, argc, (JSValueConst *) argv);
+
+    for (i = 0; i < argc; i++)
+        JS_FreeValue(ctx, argv[i]);
+    free(argv);
+    JS_FreeValue(ctx, args);
+    JS_FreeValue(ctx, func);
+    JS_FreeValue(ctx, global);
+    return ret;
+
+fail:
+    JS_FreeValue(ctx, args);
+    JS_FreeValue(ctx, func);
+    JS_FreeValue(ctx, global);
+    return JS_EXCEPTION;
+}
+
+static void fa_post_dispatch (JSContext *ctx, fa_post_call_t *c) {
+    JSValue ret = fa_post_invoke(ctx, c);
+
+    if (JS_IsException(ret)) {
+        fa_post_complete_value(ctx, c, 1, JS_GetException(ctx));
+        return;
+    }
+
+    if (JS_PromiseState(ctx, ret) < 0) {
+        fa_post_complete_value(ctx, c, 0, ret);
+        return;
+    }
+
+    if (fa_post_await(ctx, c, ret) < 0)
+        fa_post_complete_value(ctx, c, 1, JS_GetException(ctx));
+    JS_FreeValue(ctx, ret);
+}
+
+static void fa_post_cb (uv_async_t *handle) {
+    fa_runtime_t *qrt = handle->data;
+    struct fa_post_s *q = qrt->post;
+    fa_post_call_t *c;
+    int n;
+
+    for (n = 0; n < FA_POST_BATCH; n++) {
+        c = fa_post_pop(q);
+        if (!c)
+            return;
+        fa_post_dispatch(qrt->ctx, c);
+    }
+
+    /* more may be queued, they run in the next loop iteration */
+    uv_async_send(&q->async);
+}
+
+/* Runtime */
+
+int fa_post_init (fa_runtime_t *qrt) {
+    struct fa_post_s *q = malloc(sizeof(struct fa_post_s));
+
+    if (!q)
+        return -1;
+    memset(q, 0, sizeof(struct fa_post_s));
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+
+    if (uv_async_init(&qrt->loop, &q->async, fa_post_cb) < 0) {
+        free(q);
+        return -1;
+    }
+    q->async.data = qrt;
+    /* posts alone do not keep the loop running, see fa_set_post_keep_alive */
+    uv_unref((uv_handle_t *) &q->async);
+
+    if (!JS_IsRegisteredClass(qrt->rt, fa_post_class_id))
+        JS_NewClass(qrt->rt, fa_post_class_id, &fa_post_class);
+
+    qrt->post = q;
+    return 0;
+}
+
+static void fa_post_close_cb (uv_handle_t *handle) {
+    free(handle);
+}
+
+void fa_post_free (fa_runtime_t *qrt) {
+    struct fa_post_s *q = qrt->post;
+    fa_post_call_t *c;
+
+    if (!q)
+        return;
+
+    /* producers must be done by now, what is left is never run */
+    while ((c = fa_post_pop(q)) != NULL)
+        fa_post_complete(c, -1, "runtime freed");
+
+    qrt->post = NULL;
+    /* the handle is the first member */
+    uv_close((uv_handle_t *) &q->async, fa_post_close_cb);
+}
+
+void fa_set_post_keep_alive (fa_runtime_t *rt, int keep_alive) {
+    if (keep_alive)
+        uv_ref((uv_handle_t *) &rt->post->async);
+    else
+        uv_unref((uv_handle_t *) &rt->post->async);
+}
+
+int fa_post_call (
+    fa_runtime_t *rt,
+    const char *func,
+    const char *args_json,
+    fa_post_done_func done,
+    void *opaque
+) {
+    size_t func_len = strlen(func) + 1;
+    size_t args_len = args_json ? strlen(args_json) : 0;
+    fa_post_call_t *c;
+
+    /* one allocation for the call, the name and the arguments */
+    c = malloc(sizeof(fa_post_call_t) + func_len + args_len + 1);
+    if (!c)
+        return -1;
+    c->done = done;
+    c->opaque = opaque;
+    c->func = (char *) (c + 1);
+    memcpy(c->func, func, func_len);
+    c->args = NULL;
+    c->args_len = args_len;
+    if (args_json) {
+        c->args = c->func + func_len;
+        memcpy(c->args, args_json, args_len + 1);
+    }
+
+    fa_post_push(rt->post, c);
+    uv_async_send(&rt->post->async);
+    return 0;
+}
+
+/* Futures */
+
+static void fa_future_release (fa_future_t *f) {
+    if (atomic_fetch_sub(&f->refcount, 1) != 1)
+        return;
+    uv_mutex_destroy(&f->lock);
+    uv_cond_destroy(&f->cond);
+    free(f->result);
+    free(f);
+}
+
+static void fa_future_done (int status, const char *result, void *opaque) {
+    fa_future_t *f = opaque;
+
+    uv_mutex_lock(&f->lock);
+    f->done = 1;
+    f->status = status;
+    f->result = result ? strdup(result) : NULL;
+    uv_cond_signal(&f->cond);
+    uv_mutex_unlock(&f->lock);
+
+    fa_future_release(f);
+}
+
+fa_future_t *fa_post_call_future (fa_runtime_t *rt, const char *func, const char *args_json) {
+    fa_future_t *f = malloc(sizeof(fa_future_t));
+
+    if (!f)
+        return NULL;
+    memset(f, 0, sizeof(fa_future_t));
+    atomic_init(&f->refcount, 2);
+    if (uv_mutex_init(&f->lock) < 0) {
+        free(f);
+        return NULL;
+    }
+    if (uv_cond_init(&f->cond) < 0) {
+        uv_mutex_destroy(&f->lock);
+        free(f);
+        return NULL;
+    }
+
+    if (fa_post_call(rt, func, args_json, fa_future_done, f) < 0) {
+        uv_cond_destroy(&f->cond);
+        uv_mutex_destroy(&f->lock);
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+int fa_future_wait (fa_future_t *f, char **presult) {
+    int status;
+
+    uv_mutex_lock(&f->lock);
+    while (!f->done)
+        uv_cond_wait(&f->cond, &f->lock);
+    status = f->status;
+    if (presult) {
+        *presult = f->result;
+        f->result = NULL;
+    }
+    uv_mutex_unlock(&f->lock);
+
+    return status;
+}
+
+void fa_free_future (fa_future_t *f) {
+    fa_future_release(f);
+}
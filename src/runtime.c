@@ -1,52 +1,180 @@
 #include "runtime.h"
 #include "utils.h"
 #include "modules.h"
+#include "worker.h"
 #include <stdlib.h>
 #include <string.h>
 #include <quickjs/quickjs.h>
 #include <assert.h>
+#include <stdio.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(_WIN32)
+static uint8_t *fa_map_file (const char *filename, size_t *pbuf_len) {
+    return fa_load_file(NULL, pbuf_len, filename);
+}
+
+static void fa_unmap_file (uint8_t *buf, size_t buf_len) {
+    free(buf);
+}
+#else
+static uint8_t *fa_map_file (const char *filename, size_t *pbuf_len) {
+    struct stat st;
+    void *buf;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* the mapping keeps its own reference to the file */
+    close(fd);
+    if (buf == MAP_FAILED)
+        return NULL;
+    *pbuf_len = st.st_size;
+    return buf;
+}
+
+static void fa_unmap_file (uint8_t *buf, size_t buf_len) {
+    munmap(buf, buf_len);
+}
+#endif
 
-static const char fa_sig[] = "FaBC";
+JSClassID fa_timer_class_id;
+JSClassID fa_readable_class_id;
+JSClassID fa_writable_class_id;
+JSClassID fa_worker_class_id;
+JSClassID fa_work_class_id;
+JSClassID fa_post_class_id;
+JSClassID fa_gc_sentinel_class_id;
+JSClassID fa_gc_probe_class_id;
+
+static uv_once_t fa_class_ids_once = UV_ONCE_INIT;
+
+static void fa_class_ids_init (void) {
+    JS_NewClassID(&fa_timer_class_id);
+    JS_NewClassID(&fa_readable_class_id);
+    JS_NewClassID(&fa_writable_class_id);
+    JS_NewClassID(&fa_worker_class_id);
+    JS_NewClassID(&fa_work_class_id);
+    JS_NewClassID(&fa_post_class_id);
+    JS_NewClassID(&fa_gc_sentinel_class_id);
+    JS_NewClassID(&fa_gc_probe_class_id);
+}
 
 static void fa_uv_stop (uv_async_t *handle) {
     fa_runtime_t *qrt = handle->data;
     assert(qrt != NULL);
     /* Stop the loop and finish running */
+    qrt->stopped = 1;
     uv_stop(&qrt->loop);
 }
 
+static int fa_interrupt_handler (JSRuntime *rt, void *opaque) {
+    fa_runtime_t *qrt = opaque;
+
+    /* terminate() stops long running worker scripts too, not just the loop */
+    if (qrt->worker && fa_worker_is_terminating(qrt->worker))
+        return 1;
+    if (qrt->time_limit.active)
+        return fa_time_limit_check(qrt);
+    return 0;
+}
+
 fa_runtime_t *fa_new_runtime (void) {
-    return fa_new_runtime_impl(0);
+    return fa_new_runtime_impl(NULL, 0);
+}
+
+fa_runtime_t *fa_new_runtime2 (const fa_runtime_options_t *options) {
+    return fa_new_runtime_impl(options, 0);
+}
+
+static JSContext *fa_new_realm (fa_runtime_t *qrt) {
+    JSContext *ctx = JS_NewContext(qrt->rt);
+
+    FA_NULL_RETURN(ctx);
+
+    /* Make the extended runtime accesable from the context */
+    JS_SetContextOpaque(ctx, qrt);
+
+    /* Add QuickJS math extensions */
+    JS_AddIntrinsicBigFloat(ctx);
+    JS_AddIntrinsicBigDecimal(ctx);
+    JS_AddIntrinsicOperators(ctx);
+    JS_EnableBignumExt(ctx, 1);
+
+    return ctx;
+}
+
+static JSContext *fa_new_context_impl (fa_runtime_t *qrt) {
+    JSContext *ctx = fa_new_realm(qrt);
+
+    FA_NULL_RETURN(ctx);
+
+    fa_stats_init_context(qrt, ctx);
+
+    return ctx;
 }
 
-fa_runtime_t *fa_new_runtime_impl (int is_worker) {
-    fa_runtime_t *qrt = malloc(sizeof(fa_runtime_t));
+fa_runtime_t *fa_new_runtime_impl (const fa_runtime_options_t *options, int is_worker) {
+    fa_runtime_t *qrt;
+
+    uv_once(&fa_class_ids_once, fa_class_ids_init);
+
+    qrt = malloc(sizeof(fa_runtime_t));
 
     memset(qrt, 0, sizeof(fa_runtime_t));
 
     /* Create QuickJS runtime and context */
-    qrt->rt = JS_NewRuntime();
+    if (options && options->arena_block_size) {
+        qrt->arena = fa_new_arena(options->arena_block_size);
+        FA_NULL_RETURN(qrt->arena);
+        qrt->rt = JS_NewRuntime2(&fa_arena_malloc_functions, qrt->arena);
+    } else if (options && options->malloc_functions) {
+        qrt->rt = JS_NewRuntime2(options->malloc_functions, options->malloc_opaque);
+    } else {
+        qrt->rt = JS_NewRuntime();
+    }
 
     FA_NULL_RETURN(qrt->rt);
 
-    qrt->ctx = JS_NewContext(qrt->rt);
+    if (options && options->memory_limit)
+        JS_SetMemoryLimit(qrt->rt, options->memory_limit);
+    if (options && options->gc_threshold)
+        JS_SetGCThreshold(qrt->rt, options->gc_threshold);
+    if (options && options->max_stack_size)
+        JS_SetMaxStackSize(qrt->rt, options->max_stack_size);
 
-    FA_NULL_RETURN(qrt->ctx);
-
-    /* Make the extended runtime accesable from the QuickJS runtime and context */
+    /* Make the extended runtime accesable from the QuickJS runtime */
     JS_SetRuntimeOpaque(qrt->rt, qrt);
-    JS_SetContextOpaque(qrt->ctx, qrt);
 
-    /* Add QuickJS math extensions */
-    JS_AddIntrinsicBigFloat(qrt->ctx);
-    JS_AddIntrinsicBigDecimal(qrt->ctx);
-    JS_AddIntrinsicOperators(qrt->ctx);
-    JS_EnableBignumExt(qrt->ctx, 1);
+    /* SharedArrayBuffers can be posted to runtimes on other threads */
+    JS_SetSharedArrayBufferFunctions(qrt->rt, &fa_sab_functions);
+
+    /* time limits and worker termination */
+    JS_SetInterruptHandler(qrt->rt, fa_interrupt_handler, qrt);
+
+    qrt->ctx = fa_new_context_impl(qrt);
+
+    FA_NULL_RETURN(qrt->ctx);
 
     qrt->is_worker = is_worker;
 
     /* Create the main event loop */
     FA_CHECK(uv_loop_init(&qrt->loop) == 0);
+#if UV_VERSION_HEX >= 0x012700
+    /* time blocked in poll for fa_runtime_stats */
+    uv_loop_configure(&qrt->loop, UV_METRICS_IDLE_TIME);
+#endif
 
     /* handle which runs the job queue */
     FA_CHECK(uv_prepare_init(&qrt->loop, &qrt->event_handles.prepare) == 0);
@@ -63,6 +191,13 @@ fa_runtime_t *fa_new_runtime_impl (int is_worker) {
     /* handle for stopping this runtime (also works from another thread) */
     FA_CHECK(uv_async_init(&qrt->loop, &qrt->event_handles.stop, fa_uv_stop) == 0);
     qrt->event_handles.stop.data = qrt;
+    /* Async handle keeps worker loops alive even when they do nothing, other
+       loops are only alive with work of their own, also before fa_run */
+    if (!is_worker)
+        uv_unref((uv_handle_t *) &qrt->event_handles.stop);
+
+    /* calls posted from other threads */
+    FA_CHECK(fa_post_init(qrt) == 0);
 
     /* loader for ES6 modules */
     JS_SetModuleLoaderFunc(qrt->rt, NULL, fa_module_loader, qrt);
@@ -75,16 +210,183 @@ fa_runtime_t *fa_new_runtime_impl (int is_worker) {
     return qrt;
 }
 
+void fa_add_cleanup (fa_runtime_t *qrt, fa_cleanup_func func, void *opaque) {
+    struct fa_cleanup_s *c = malloc(sizeof(struct fa_cleanup_s));
+    c->func = func;
+    c->opaque = opaque;
+    c->ctx = NULL;
+    c->next = qrt->cleanups;
+    qrt->cleanups = c;
+}
+
+void fa_add_context_cleanup (JSContext *ctx, fa_cleanup_func func, void *opaque) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+
+    fa_add_cleanup(qrt, func, opaque);
+    qrt->cleanups->ctx = ctx;
+}
+
+void fa_hold_orphan (fa_runtime_t *qrt, JSContext *ctx) {
+    if (ctx)
+        JS_DupContext(ctx);
+    qrt->orphans++;
+}
+
+void fa_release_orphan (fa_runtime_t *qrt, JSContext *ctx) {
+    /* the last reference frees the context of a freed tenant */
+    if (ctx)
+        JS_FreeContext(ctx);
+    qrt->orphans--;
+}
+
+void fa_remove_cleanup (fa_runtime_t *qrt, fa_cleanup_func func, void *opaque) {
+    struct fa_cleanup_s **pc;
+    for (pc = &qrt->cleanups; *pc != NULL; pc = &(*pc)->next) {
+        if ((*pc)->func == func && (*pc)->opaque == opaque) {
+            struct fa_cleanup_s *c = *pc;
+            *pc = c->next;
+            free(c);
+            return;
+        }
+    }
+}
+
+static void fa_run_cleanups (fa_runtime_t *qrt) {
+    /* cleanups may remove themselves, so each is unlinked before it runs */
+    while (qrt->cleanups) {
+        struct fa_cleanup_s *c = qrt->cleanups;
+        qrt->cleanups = c->next;
+        c->func(qrt, c->opaque);
+        free(c);
+    }
+}
+
+static void fa_run_context_cleanups (fa_runtime_t *qrt, JSContext *ctx) {
+    struct fa_cleanup_s **pc = &qrt->cleanups, *c;
+
+    while (*pc != NULL) {
+        if ((*pc)->ctx != ctx) {
+            pc = &(*pc)->next;
+            continue;
+        }
+        c = *pc;
+        *pc = c->next;
+        c->func(qrt, c->opaque);
+        free(c);
+        /* the cleanup may have removed others */
+        pc = &qrt->cleanups;
+    }
+}
+
+fa_tenant_t *fa_new_tenant (fa_runtime_t *rt) {
+    fa_tenant_t *t = malloc(sizeof(fa_tenant_t));
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(fa_tenant_t));
+
+    t->ctx = fa_new_realm(rt);
+    if (!t->ctx) {
+        free(t);
+        return NULL;
+    }
+    t->qrt = rt;
+
+    t->next = rt->tenants;
+    if (rt->tenants)
+        rt->tenants->prev = t;
+    rt->tenants = t;
+    return t;
+}
+
+void fa_free_tenant (fa_tenant_t *t) {
+    fa_runtime_t *qrt = t->qrt;
+
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        qrt->tenants = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+
+    /* nothing the tenant started may reach its context again. The loop is
+       not run, this may be called from its callbacks: requests already
+       running are orphaned and hold the context until they completed. */
+    fa_timers_free_context(qrt, t->ctx);
+    fa_run_context_cleanups(qrt, t->ctx);
+    fa_streams_free_context(qrt, t->ctx);
+    fa_fs_free_context(qrt, t->ctx);
+    fa_works_free_context(qrt, t->ctx);
+
+    /* functions of the tenant still referenced elsewhere keep its realm 
+       alive until they are collected */
+    JS_FreeContext(t->ctx);
+    free(t);
+}
+
+JSContext *fa_tenant_get_context (fa_tenant_t *t) {
+    return t->ctx;
+}
+
+static void fa_free_tenants (fa_runtime_t *qrt) {
+    while (qrt->tenants)
+        fa_free_tenant(qrt->tenants);
+}
+
+int fa_reset_context (fa_runtime_t *qrt) {
+    JSContext *ctx;
+
+    /* limits belong to the script which set them */
+    fa_set_time_limit(qrt, 0, 0);
+    fa_run_cleanups(qrt);
+    fa_free_tenants(qrt);
+
+    /* objects left by the previous script go with its context */
+    JS_FreeContext(qrt->ctx);
+    qrt->ctx = NULL;
+    JS_RunGC(qrt->rt);
+
+    ctx = fa_new_context_impl(qrt);
+    if (!ctx)
+        return -1;
+    qrt->ctx = ctx;
+
+    return 0;
+}
+
 void fa_free_runtime (fa_runtime_t *rt) {
+    fa_set_time_limit(rt, 0, 0);
+    fa_run_cleanups(rt);
+    fa_free_tenants(rt);
+    fa_output_free(rt);
+    fa_post_free(rt);
+
     /* Close all loop handles. */
     uv_close((uv_handle_t *) &rt->event_handles.prepare, NULL);
     uv_close((uv_handle_t *) &rt->event_handles.idle, NULL);
     uv_close((uv_handle_t *) &rt->event_handles.check, NULL);
     uv_close((uv_handle_t *) &rt->event_handles.stop, NULL);
 
-    JS_FreeContext(rt->ctx);
+    /* with every JS facing handle closed the loop only completes orphans,
+       which release the contexts they hold */
+    while (rt->orphans > 0)
+        uv_run(&rt->loop, UV_RUN_ONCE);
+
+    if (rt->ctx)
+        JS_FreeContext(rt->ctx);
     JS_FreeRuntime(rt->rt);
 
+    free(rt->code_cache_dir);
+
+    /* nothing references the bundles once the runtime is gone */
+    while (rt->bundles) {
+        struct fa_runtime_bundle_s *b = rt->bundles;
+        rt->bundles = b->next;
+        if (b->mapped)
+            fa_unmap_file(b->mapped, b->mapped_len);
+        free(b->filename);
+        free(b);
+    }
+
     /* Cleanup loop. All handles should be closed. */
     int closed = 0;
     for (int i = 0; i < 5; i++) {
@@ -102,10 +404,19 @@ void fa_free_runtime (fa_runtime_t *rt) {
 
     assert(closed);
 
+    /* whatever the heap left allocated goes with the arena */
+    if (rt->arena)
+        fa_free_arena(rt->arena);
+
     free(rt);
 }
 
 
+void fa_set_code_cache (fa_runtime_t *rt, const char *dir) {
+    free(rt->code_cache_dir);
+    rt->code_cache_dir = dir ? strdup(dir) : NULL;
+}
+
 JSContext *fa_get_context (fa_runtime_t *rt) {
     return rt->ctx;
 }
@@ -131,49 +442,100 @@ static void fa_uv_prepare_cb(uv_prepare_t *handle) {
     fa_runtime_t *qrt = handle->data;
     assert(qrt != NULL);
 
+    qrt->stats.loop_count++;
+
     /* Before polling i/o idle if active jobs still exist */
     fa_uv_maybe_idle(qrt);
 }
 
-void fa_execute_jobs (JSContext *ctx) {
+/* start is the caller's clock read, the loop callback times itself anyway */
+static void fa_execute_jobs_limit (
+    fa_runtime_t *qrt, 
+    int max_jobs, 
+    uint64_t budget_ns,
+    uint64_t start
+) {
     // job context
     JSContext *ctx1;
-    int err;
+    uint64_t now = start;
+    int err, n = 0, deferred = 0;
 
     /* execute the pending jobs */
     for (;;) {
-        err = JS_ExecutePendingJob(JS_GetRuntime(ctx), &ctx1);
+        err = JS_ExecutePendingJob(qrt->rt, &ctx1);
         if (err <= 0) {
             if (err < 0)
                 fa_dump_error(ctx1);
             break;
         }
+        n++;
+        /* the clock is only read per job when there is a budget to check */
+        if (budget_ns > 0) {
+            now = uv_hrtime();
+            if (now - start >= budget_ns) {
+                deferred = JS_IsJobPending(qrt->rt);
+                break;
+            }
+        }
+        if (max_jobs > 0 && n >= max_jobs) {
+            deferred = JS_IsJobPending(qrt->rt);
+            break;
+        }
+    }
+
+    if (n > 0) {
+        if (budget_ns == 0)
+            now = uv_hrtime();
+        qrt->job_stats.jobs += n;
+        qrt->job_stats.time_ns += now - start;
+        qrt->job_stats.ticks++;
+        qrt->job_stats.deferred += deferred;
     }
 }
 
+void fa_execute_jobs (JSContext *ctx) {
+    fa_execute_jobs_limit(fa_get_runtime(ctx), 0, 0, uv_hrtime());
+}
+
+void fa_set_job_policy (fa_runtime_t *rt, int max_jobs, uint64_t budget_us) {
+    rt->job_policy.max_jobs = max_jobs > 0 ? max_jobs : 0;
+    rt->job_policy.budget_ns = budget_us * 1000;
+}
+
+void fa_get_job_stats (fa_runtime_t *rt, fa_job_stats_t *stats) {
+    *stats = rt->job_stats;
+}
+
 static void fa_uv_check_cb(uv_check_t *handle) {
     fa_runtime_t *qrt = handle->data;
+    uint64_t start = uv_hrtime();
     assert(qrt != NULL);
 
-    /* After I/O was polled execute all the pending jobs and idle untill they are done */
-    fa_execute_jobs(qrt->ctx);
+    /* After I/O was polled execute the pending jobs the policy allows and 
+       idle untill they are done, so I/O is polled between batches */
+    fa_execute_jobs_limit(qrt, qrt->job_policy.max_jobs, qrt->job_policy.budget_ns, start);
 
     fa_uv_maybe_idle(qrt);
+
+    /* the next collection is timed again */
+    fa_stats_arm_gc_probe(qrt);
+
+    qrt->stats.check_time_ns += uv_hrtime() - start;
 }
 
-void fa_run (fa_runtime_t *rt) {
+void fa_run_setup (fa_runtime_t *rt) {
+    rt->stopped = 0;
     assert(uv_prepare_start(&rt->event_handles.prepare, fa_uv_prepare_cb) == 0);
     /* remove reference to the handle so that the loop exits itself */
     uv_unref((uv_handle_t *) &rt->event_handles.prepare);
     assert(uv_check_start(&rt->event_handles.check, fa_uv_check_cb) == 0);
     uv_unref((uv_handle_t *) &rt->event_handles.check);
 
-    /* Async handle keeps worker loops alive even when they do nothing. */
-    if (!rt->is_worker)
-        uv_unref((uv_handle_t *) &rt->event_handles.stop);
-
     fa_uv_maybe_idle(rt);
+}
 
+void fa_run (fa_runtime_t *rt) {
+    fa_run_setup(rt);
     uv_run(&rt->loop, UV_RUN_DEFAULT);
 }
 
@@ -208,14 +570,13 @@ JSValue fa_eval_buf (
     return val;
 }
 
-void fa_eval_binary (
+/* dumps the exception and returns -1 if the evaluation failed */
+static int fa_eval_object (
     JSContext *ctx, 
-    const uint8_t *buf, 
-    size_t buf_len, 
+    JSValue obj, 
     int load_only
 ) {
-    JSValue obj, val;
-    obj = JS_ReadObject(ctx, buf, buf_len, JS_READ_OBJ_BYTECODE);
+    JSValue val;
     if (JS_IsException(obj))
         goto exception;
     if (load_only) {
@@ -234,51 +595,139 @@ void fa_eval_binary (
         if (JS_IsException(val)) {
         exception:
             fa_dump_error(ctx);
-            exit(1);
+            return -1;
         }
         JS_FreeValue(ctx, val);
     }
+    return 0;
 }
 
-void fa_eval_bin_bundle (
+void fa_eval_binary (
     JSContext *ctx, 
     const uint8_t *buf, 
     size_t buf_len, 
     int load_only
 ) {
-    assert(buf_len > 3);
-    
-    int sig_ver = memcmp(buf, fa_sig, 4);
+    if (fa_eval_object(ctx, JS_ReadObject(ctx, buf, buf_len, JS_READ_OBJ_BYTECODE), load_only) < 0) {
+        fa_output_flush(fa_get_runtime(ctx));
+        exit(1);
+    }
+}
 
-    assert(sig_ver == 0);
+static struct fa_runtime_bundle_s *fa_add_bundle (
+    JSContext *ctx, 
+    const uint8_t *buf, 
+    size_t buf_len
+) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    struct fa_runtime_bundle_s *b;
+    const char *err;
+
+    /* bundles outlive contexts, so they are registered again after a reset */
+    for (b = qrt->bundles; b != NULL; b = b->next) {
+        if (b->bundle.buf == buf)
+            return b;
+    }
 
-    size_t cursor = 4;
+    b = malloc(sizeof(struct fa_runtime_bundle_s));
+    if (!b) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    memset(b, 0, sizeof(struct fa_runtime_bundle_s));
+
+    /* the caller reports the error */
+    err = fa_bundle_open(&b->bundle, buf, buf_len);
+    if (err) {
+        free(b);
+        JS_ThrowTypeError(ctx, "invalid bundle: %s", err);
+        return NULL;
+    }
 
-    size_t module_len;
-    
-    while (1) {
-        memcpy(&module_len, buf + cursor, sizeof(size_t));
+    b->next = qrt->bundles;
+    qrt->bundles = b;
 
-        cursor += sizeof(size_t);
+    /* imports are served from the registered bundles from now on */
+    JS_SetModuleLoaderFunc(qrt->rt, NULL, fa_bundle_module_loader, qrt);
 
-        char *mod = malloc(module_len + 1);
+    return b;
+}
 
-        char mod_load_only;
+static int fa_eval_bundle_main (
+    JSContext *ctx, 
+    struct fa_runtime_bundle_s *b, 
+    int load_only
+) {
+    fa_bundle_entry_t e;
 
-        memcpy(&mod_load_only, buf + cursor, 1);
+    if (load_only || b->bundle.header.main_index == FA_BUNDLE_NO_MAIN)
+        return 0;
 
-        cursor++;
+    /* the other modules are read by the loader once they are imported */
+    fa_bundle_get_entry(&b->bundle, b->bundle.header.main_index, &e);
+    return fa_eval_object(ctx, fa_bundle_read_object(ctx, &b->bundle, &e), 
+                          e.flags & FA_BUNDLE_MOD_LOAD_ONLY);
+}
 
-        memcpy(mod, buf + cursor, module_len);
+int fa_try_eval_bin_bundle (
+    JSContext *ctx, 
+    const uint8_t *buf, 
+    size_t buf_len, 
+    int load_only
+) {
+    struct fa_runtime_bundle_s *b = fa_add_bundle(ctx, buf, buf_len);
 
-        cursor += module_len;
+    if (!b) {
+        fa_dump_error(ctx);
+        return -1;
+    }
+    return fa_eval_bundle_main(ctx, b, load_only);
+}
 
-        int end = cursor >= (buf_len - 1);
+void fa_eval_bin_bundle (
+    JSContext *ctx, 
+    const uint8_t *buf, 
+    size_t buf_len, 
+    int load_only
+) {
+    if (fa_try_eval_bin_bundle(ctx, buf, buf_len, load_only) < 0) {
+        fa_output_flush(fa_get_runtime(ctx));
+        exit(1);
+    }
+}
 
-        fa_eval_binary(ctx, mod, module_len, !end | load_only | mod_load_only);
+int fa_eval_bin_bundle_file (
+    JSContext *ctx, 
+    const char *filename, 
+    int load_only
+) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    struct fa_runtime_bundle_s *b;
+    uint8_t *buf;
+    size_t buf_len;
+
+    /* already mapped before the context was reset */
+    for (b = qrt->bundles; b != NULL; b = b->next) {
+        if (b->filename && !strcmp(b->filename, filename)) {
+            return fa_eval_bundle_main(ctx, b, load_only);
+        }
+    }
 
-        free(mod);
+    buf = fa_map_file(filename, &buf_len);
+    if (!buf) {
+        fprintf(stderr, "Could not map bundle '%s'\n", filename);
+        return -1;
+    }
 
-        if (end) break;
-    };
+    b = fa_add_bundle(ctx, buf, buf_len);
+    if (!b) {
+        fa_dump_error(ctx);
+        fa_unmap_file(buf, buf_len);
+        return -1;
+    }
+    b->mapped = buf;
+    b->mapped_len = buf_len;
+    b->filename = strdup(filename);
+
+    return fa_eval_bundle_main(ctx, b, load_only);
 }
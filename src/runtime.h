@@ -2,8 +2,99 @@
 #define FA_RUNTIME_H
 
 #include "fireant.h"
+#include "bundle.h"
 
-fa_runtime_t *fa_new_runtime_impl (int is_worker);
+struct fa_runtime_bundle_s {
+    fa_bundle_t bundle;
+    /* set if the runtime mapped the bundle and has to unmap it */
+    uint8_t *mapped;
+    size_t mapped_len;
+    char *filename;
+    struct fa_runtime_bundle_s *next;
+};
+
+struct fa_tenant_s {
+    fa_runtime_t *qrt;
+    JSContext *ctx;
+    struct fa_tenant_s *prev;
+    struct fa_tenant_s *next;
+};
+
+/**
+ * Native modules holding JS values or loop handles register a cleanup, it
+ * runs before the context is freed. Cleanups never run the loop: requests
+ * which can't be stopped right away and handles closing with JS values are
+ * orphaned, see fa_hold_orphan.
+ */
+typedef void (*fa_cleanup_func)(fa_runtime_t *qrt, void *opaque);
+
+struct fa_cleanup_s {
+    fa_cleanup_func func;
+    void *opaque;
+    /* set if it also runs when this tenant context is freed */
+    JSContext *ctx;
+    struct fa_cleanup_s *next;
+};
+
+void fa_add_cleanup (fa_runtime_t *qrt, fa_cleanup_func func, void *opaque);
+void fa_remove_cleanup (fa_runtime_t *qrt, fa_cleanup_func func, void *opaque);
+// for state belonging to ctx, also runs if ctx is a tenant which is freed
+void fa_add_context_cleanup (JSContext *ctx, fa_cleanup_func func, void *opaque);
+/* An orphan is a request or handle whose callback is still due after its
+   state was torn down. It keeps ctx, if not NULL, and the runtime until the
+   callback released it; the callback only frees and settles nothing. */
+void fa_hold_orphan (fa_runtime_t *qrt, JSContext *ctx);
+void fa_release_orphan (fa_runtime_t *qrt, JSContext *ctx);
+
+/* stop what a tenant's context left in the runtime wide module state */
+void fa_timers_free_context (fa_runtime_t *qrt, JSContext *ctx);
+void fa_streams_free_context (fa_runtime_t *qrt, JSContext *ctx);
+void fa_fs_free_context (fa_runtime_t *qrt, JSContext *ctx);
+void fa_works_free_context (fa_runtime_t *qrt, JSContext *ctx);
+
+/**
+ * Class ids of the native modules. JS_NewClassID is not thread-safe, so
+ * they are all allocated once by the first runtime, before any worker or
+ * scheduler thread can create another. Classes are still registered per
+ * runtime.
+ */
+extern JSClassID fa_timer_class_id;
+extern JSClassID fa_readable_class_id;
+extern JSClassID fa_writable_class_id;
+extern JSClassID fa_worker_class_id;
+extern JSClassID fa_work_class_id;
+extern JSClassID fa_post_class_id;
+extern JSClassID fa_gc_sentinel_class_id;
+extern JSClassID fa_gc_probe_class_id;
+
+/* print and printf output, buffered once fa_set_stdout_buffered was called */
+void fa_output_write (fa_runtime_t *qrt, const void *buf, size_t len);
+void fa_output_flush (fa_runtime_t *qrt);
+void fa_output_free (fa_runtime_t *qrt);
+
+/* queue for fa_post_call, set up with the loop */
+int fa_post_init (fa_runtime_t *qrt);
+void fa_post_free (fa_runtime_t *qrt);
+
+/* called from the interrupt handler, returns 1 once a time limit is hit */
+int fa_time_limit_check (fa_runtime_t *qrt);
+
+/* GC observation objects, see stats.c */
+void fa_stats_init_context (fa_runtime_t *qrt, JSContext *ctx);
+void fa_stats_arm_gc_probe (fa_runtime_t *qrt);
+
+fa_runtime_t *fa_new_runtime_impl (const fa_runtime_options_t *options, int is_worker);
+// replace the context with a fresh one, bundles and the loop are kept
+int fa_reset_context (fa_runtime_t *qrt);
 void fa_execute_jobs (JSContext *ctx);
+// fa_eval_bin_bundle reporting errors with -1 instead of exiting
+int fa_try_eval_bin_bundle (
+    JSContext *ctx, 
+    const uint8_t *buf, 
+    size_t buf_len, 
+    int load_only
+);
+// starts the handles fa_run needs, the caller runs the loop
+void fa_run_setup (fa_runtime_t *rt);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,596 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include "runtime.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/**
+ * M:N scheduler. Runtimes handed to a scheduler are run in slices of one
+ * non-blocking loop iteration by a fixed set of threads. A runtime is
+ * runnable when it has pending jobs, ready I/O (its loop's backend fd polls
+ * readable) or a due timer. Every runtime is owned by at most one thread at
+ * a time: it is either queued on one thread, running on it, or waiting in
+ * the poller, and a slice re-arms the one-shot poll only when it is done.
+ *
+ * Each thread has its own run queue and prefers the runtimes it ran last,
+ * idle threads steal from the back of the other queues. A poller thread
+ * waits on the backend fds of all waiting runtimes and on their next timer.
+ * A wake-up arriving while the runtime runs is remembered and the runtime
+ * is queued again instead of waiting. Entries of finished runtimes are
+ * freed by the poller, once no event it fetched can still point at them.
+ */
+
+#if defined(__linux__)
+
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+enum {
+    FA_SCHED_WAITING,
+    FA_SCHED_QUEUED,
+    FA_SCHED_RUNNING,
+    /* woken while running */
+    FA_SCHED_NOTIFIED,
+    FA_SCHED_DEAD,
+};
+
+struct fa_sched_entry_s {
+    fa_runtime_t *rt;
+    fa_scheduler_t *s;
+    atomic_int state;
+    /* bumped on every wait, stale timers are skipped */
+    atomic_uint gen;
+    /* thread which ran the runtime last */
+    int thread;
+    fa_scheduler_exit_func on_exit;
+    void *opaque;
+    /* run queue link */
+    struct fa_sched_entry_s *next;
+    struct fa_sched_entry_s *prev;
+    /* all entries of the scheduler */
+    struct fa_sched_entry_s *all_next;
+    struct fa_sched_entry_s *all_prev;
+};
+
+typedef struct fa_sched_timer_s {
+    uint64_t due;
+    unsigned gen;
+    struct fa_sched_entry_s *e;
+} fa_sched_timer_t;
+
+typedef struct fa_sched_thread_s {
+    fa_scheduler_t *s;
+    int id;
+    int cpu;
+    uv_thread_t thread;
+    uv_mutex_t lock;
+    struct fa_sched_entry_s *head;
+    struct fa_sched_entry_s *tail;
+} fa_sched_thread_t;
+
+struct fa_scheduler_s {
+    fa_sched_thread_t *threads;
+    int thread_count;
+
+    /* sleeping threads wait for queued runtimes */
+    uv_mutex_t idle_lock;
+    uv_cond_t idle_cond;
+    atomic_int queued;
+    atomic_int stopping;
+
+    int epfd;
+    int wakefd;
+    uv_thread_t poller;
+
+    /* min-heap of timers, guarded by timer_lock */
+    uv_mutex_t timer_lock;
+    fa_sched_timer_t *timers;
+    int timer_count;
+    int timer_size;
+
+    uv_mutex_t all_lock;
+    struct fa_sched_entry_s *all;
+    int count;
+    /* finished entries the poller frees, linked through next */
+    struct fa_sched_entry_s *dead;
+};
+
+/* Run queues */
+
+static void fa_sched_push (fa_sched_thread_t *t, struct fa_sched_entry_s *e) {
+    fa_scheduler_t *s = t->s;
+
+    uv_mutex_lock(&t->lock);
+    e->next = NULL;
+    e->prev = t->tail;
+    if (t->tail)
+        t->tail->next = e;
+    else
+        t->head = e;
+    t->tail = e;
+    uv_mutex_unlock(&t->lock);
+
+    atomic_fetch_add(&s->queued, 1);
+    uv_mutex_lock(&s->idle_lock);
+    uv_cond_signal(&s->idle_cond);
+    uv_mutex_unlock(&s->idle_lock);
+}
+
+/* own runtimes are taken from the front, stolen ones from the back */
+static struct fa_sched_entry_s *fa_sched_pop (fa_sched_thread_t *t, int steal) {
+    struct fa_sched_entry_s *e;
+
+    uv_mutex_lock(&t->lock);
+    e = steal ? t->tail : t->head;
+    if (e) {
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            t->head = e->next;
+        if (e->next)
+            e->next->prev = e->prev;
+        else
+            t->tail = e->prev;
+        atomic_fetch_sub(&t->s->queued, 1);
+    }
+    uv_mutex_unlock(&t->lock);
+    return e;
+}
+
+static struct fa_sched_entry_s *fa_sched_take (fa_sched_thread_t *t) {
+    fa_scheduler_t *s = t->s;
+    struct fa_sched_entry_s *e;
+    int i;
+
+    e = fa_sched_pop(t, 0);
+    for (i = 1; !e && i < s->thread_count; i++)
+        e = fa_sched_pop(&s->threads[(t->id + i) % s->thread_count], 1);
+    return e;
+}
+
+/* the runtime became runnable, from the poller or a timer */
+static void fa_sched_wake (struct fa_sched_entry_s *e, unsigned gen, int check_gen) {
+    int state;
+
+    if (check_gen && atomic_load(&e->gen) != gen)
+        return;
+
+    for (;;) {
+        state = atomic_load(&e->state);
+        if (state == FA_SCHED_WAITING) {
+            if (atomic_compare_exchange_weak(&e->state, &state, FA_SCHED_QUEUED)) {
+                fa_sched_push(&e->s->threads[e->thread], e);
+                return;
+            }
+        } else if (state == FA_SCHED_RUNNING) {
+            if (atomic_compare_exchange_weak(&e->state, &state, FA_SCHED_NOTIFIED))
+                return;
+        } else {
+            /* already queued or notified, or finished */
+            return;
+        }
+    }
+}
+
+/* Timers */
+
+static void fa_sched_timer_swap (fa_sched_timer_t *a, fa_sched_timer_t *b) {
+    fa_sched_timer_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static int fa_sched_add_timer (fa_scheduler_t *s, struct fa_sched_entry_s *e, unsigned gen, uint64_t due) {
+    fa_sched_timer_t *timers;
+    int i, parent, first;
+
+    uv_mutex_lock(&s->timer_lock);
+    if (s->timer_count == s->timer_size) {
+        int size = s->timer_size ? s->timer_size * 2 : 64;
+        timers = realloc(s->timers, size * sizeof(fa_sched_timer_t));
+        if (!timers) {
+            uv_mutex_unlock(&s->timer_lock);
+            return -1;
+        }
+        s->timers = timers;
+        s->timer_size = size;
+    }
+
+    i = s->timer_count++;
+    s->timers[i].due = due;
+    s->timers[i].gen = gen;
+    s->timers[i].e = e;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (s->timers[parent].due <= s->timers[i].due)
+            break;
+        fa_sched_timer_swap(&s->timers[parent], &s->timers[i]);
+        i = parent;
+    }
+    first = i == 0;
+    uv_mutex_unlock(&s->timer_lock);
+
+    /* the poller sleeps until the previous first timer */
+    if (first) {
+        uint64_t one = 1;
+        if (write(s->wakefd, &one, sizeof(one)) < 0) {}
+    }
+    return 0;
+}
+
+/* finished runtimes drop their timers before the entry is freed */
+static void fa_sched_remove_timers (fa_scheduler_t *s, struct fa_sched_entry_s *e) {
+    int i, j, child, n = 0;
+
+    uv_mutex_lock(&s->timer_lock);
+    for (i = 0; i < s->timer_count; i++) {
+        if (s->timers[i].e != e)
+            s->timers[n++] = s->timers[i];
+    }
+    s->timer_count = n;
+    /* heapify again */
+    for (i = n / 2 - 1; i >= 0; i--) {
+        for (j = i; (child = 2 * j + 1) < n; j = child) {
+            if (child + 1 < n && s->timers[child + 1].due < s->timers[child].due)
+                child++;
+            if (s->timers[j].due <= s->timers[child].due)
+                break;
+            fa_sched_timer_swap(&s->timers[j], &s->timers[child]);
+        }
+    }
+    uv_mutex_unlock(&s->timer_lock);
+}
+
+static void fa_sched_free_dead (fa_scheduler_t *s) {
+    struct fa_sched_entry_s *e, *next;
+
+    uv_mutex_lock(&s->all_lock);
+    e = s->dead;
+    s->dead = NULL;
+    uv_mutex_unlock(&s->all_lock);
+
+    for (; e != NULL; e = next) {
+        next = e->next;
+        free(e);
+    }
+}
+
+/* pops the due timers into woken, returns the ms until the next one or -1 */
+static int fa_sched_pop_timers (fa_scheduler_t *s, fa_sched_timer_t *woken, int *pcount, int max) {
+    uint64_t now = uv_hrtime() / 1000000;
+    int i, child, timeout = -1;
+
+    *pcount = 0;
+    uv_mutex_lock(&s->timer_lock);
+    while (s->timer_count > 0 && *pcount < max) {
+        if (s->timers[0].due > now) {
+            timeout = (int) (s->timers[0].due - now);
+            break;
+        }
+        woken[(*pcount)++] = s->timers[0];
+        s->timers[0] = s->timers[--s->timer_count];
+        for (i = 0; (child = 2 * i + 1) < s->timer_count; i = child) {
+            if (child + 1 < s->timer_count && s->timers[child + 1].due < s->timers[child].due)
+                child++;
+            if (s->timers[i].due <= s->timers[child].due)
+                break;
+            fa_sched_timer_swap(&s->timers[i], &s->timers[child]);
+        }
+    }
+    if (*pcount == max)
+        timeout = 0;
+    uv_mutex_unlock(&s->timer_lock);
+    return timeout;
+}
+
+/* Poller */
+
+#define FA_SCHED_MAX_EVENTS 64
+
+static void fa_sched_poller (void *opaque) {
+    fa_scheduler_t *s = opaque;
+    struct epoll_event events[FA_SCHED_MAX_EVENTS];
+    fa_sched_timer_t woken[FA_SCHED_MAX_EVENTS];
+    int i, n, count, timeout;
+    uint64_t val;
+
+    while (!atomic_load(&s->stopping)) {
+        /* the events of the last batch are handled */
+        fa_sched_free_dead(s);
+
+        timeout = fa_sched_pop_timers(s, woken, &count, FA_SCHED_MAX_EVENTS);
+        for (i = 0; i < count; i++)
+            fa_sched_wake(woken[i].e, woken[i].gen, 1);
+
+        n = epoll_wait(s->epfd, events, FA_SCHED_MAX_EVENTS, timeout);
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (read(s->wakefd, &val, sizeof(val)) < 0) {}
+                continue;
+            }
+            fa_sched_wake(events[i].data.ptr, 0, 0);
+        }
+    }
+}
+
+/* Slices */
+
+static void fa_sched_finish (fa_scheduler_t *s, struct fa_sched_entry_s *e) {
+    fa_runtime_t *rt = e->rt;
+
+    atomic_store(&e->state, FA_SCHED_DEAD);
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, uv_backend_fd(&rt->loop), NULL);
+    fa_sched_remove_timers(s, e);
+    rt->sched = NULL;
+
+    uv_mutex_lock(&s->all_lock);
+    if (e->all_prev)
+        e->all_prev->all_next = e->all_next;
+    else
+        s->all = e->all_next;
+    if (e->all_next)
+        e->all_next->all_prev = e->all_prev;
+    s->count--;
+    e->next = s->dead;
+    s->dead = e;
+    uv_mutex_unlock(&s->all_lock);
+
+    /* may free the runtime */
+    if (e->on_exit)
+        e->on_exit(rt, e->opaque);
+}
+
+static void fa_sched_wait (fa_sched_thread_t *t, struct fa_sched_entry_s *e, int timeout) {
+    fa_scheduler_t *s = t->s;
+    struct epoll_event ev;
+    unsigned gen;
+    int state = FA_SCHED_RUNNING;
+
+    /* armed while the runtime is still ours, wake-ups until it waits are
+       remembered by fa_sched_wake */
+    gen = atomic_fetch_add(&e->gen, 1) + 1;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = e;
+    epoll_ctl(s->epfd, EPOLL_CTL_MOD, uv_backend_fd(&e->rt->loop), &ev);
+
+    /* without a timer it is polled again right away instead of missing it */
+    if (timeout < 0 || fa_sched_add_timer(s, e, gen, uv_hrtime() / 1000000 + timeout) == 0) {
+        if (atomic_compare_exchange_strong(&e->state, &state, FA_SCHED_WAITING))
+            return;
+    }
+
+    atomic_store(&e->state, FA_SCHED_QUEUED);
+    fa_sched_push(t, e);
+}
+
+static void fa_sched_run_slice (fa_sched_thread_t *t, struct fa_sched_entry_s *e) {
+    fa_scheduler_t *s = t->s;
+    fa_runtime_t *rt = e->rt;
+    int timeout;
+
+    atomic_store(&e->state, FA_SCHED_RUNNING);
+    e->thread = t->id;
+
+    /* stack limits are checked against the thread the runtime runs on */
+    JS_UpdateStackTop(rt->rt);
+    uv_run(&rt->loop, UV_RUN_NOWAIT);
+
+    if (rt->stopped || (!uv_loop_alive(&rt->loop) && !JS_IsJobPending(rt->rt))) {
+        fa_sched_finish(s, e);
+        return;
+    }
+
+    /* 0 with pending jobs (the idle handle) or closing handles */
+    timeout = uv_backend_timeout(&rt->loop);
+    if (timeout == 0) {
+        atomic_store(&e->state, FA_SCHED_QUEUED);
+        fa_sched_push(t, e);
+        return;
+    }
+
+    fa_sched_wait(t, e, timeout);
+}
+
+static void fa_sched_thread (void *opaque) {
+    fa_sched_thread_t *t = opaque;
+    fa_scheduler_t *s = t->s;
+    struct fa_sched_entry_s *e;
+
+    if (t->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while (!atomic_load(&s->stopping)) {
+        e = fa_sched_take(t);
+        if (e) {
+            fa_sched_run_slice(t, e);
+            continue;
+        }
+
+        uv_mutex_lock(&s->idle_lock);
+        while (atomic_load(&s->queued) == 0 && !atomic_load(&s->stopping))
+            uv_cond_wait(&s->idle_cond, &s->idle_lock);
+        uv_mutex_unlock(&s->idle_lock);
+    }
+}
+
+/* API */
+
+fa_scheduler_t *fa_new_scheduler (const fa_scheduler_options_t *options) {
+    fa_scheduler_t *s;
+    struct epoll_event ev;
+    int i, n;
+
+    n = options && options->threads > 0 ? options->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+
+    s = malloc(sizeof(fa_scheduler_t));
+    if (!s)
+        return NULL;
+    memset(s, 0, sizeof(fa_scheduler_t));
+    s->epfd = -1;
+    s->wakefd = -1;
+
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    s->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (s->epfd < 0 || s->wakefd < 0)
+        goto fail;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wakefd, &ev) < 0)
+        goto fail;
+
+    FA_CHECK(uv_mutex_init(&s->idle_lock) == 0);
+    FA_CHECK(uv_cond_init(&s->idle_cond) == 0);
+    FA_CHECK(uv_mutex_init(&s->timer_lock) == 0);
+    FA_CHECK(uv_mutex_init(&s->all_lock) == 0);
+
+    s->threads = malloc(n * sizeof(fa_sched_thread_t));
+    if (!s->threads)
+        goto fail;
+    memset(s->threads, 0, n * sizeof(fa_sched_thread_t));
+    s->thread_count = n;
+
+    for (i = 0; i < n; i++) {
+        fa_sched_thread_t *t = &s->threads[i];
+        t->s = s;
+        t->id = i;
+        t->cpu = options && options->cpu_count > 0 ? options->cpus[i % options->cpu_count] : -1;
+        FA_CHECK(uv_mutex_init(&t->lock) == 0);
+    }
+    for (i = 0; i < n; i++)
+        FA_CHECK(uv_thread_create(&s->threads[i].thread, fa_sched_thread, &s->threads[i]) == 0);
+    FA_CHECK(uv_thread_create(&s->poller, fa_sched_poller, s) == 0);
+
+    return s;
+
+fail:
+    if (s->epfd >= 0)
+        close(s->epfd);
+    if (s->wakefd >= 0)
+        close(s->wakefd);
+    free(s);
+    return NULL;
+}
+
+int fa_scheduler_add (
+    fa_scheduler_t *s,
+    fa_runtime_t *rt,
+    fa_scheduler_exit_func on_exit,
+    void *opaque
+) {
+    struct fa_sched_entry_s *e;
+    struct epoll_event ev;
+    static atomic_int next_thread;
+
+    e = malloc(sizeof(struct fa_sched_entry_s));
+    if (!e)
+        return -1;
+    memset(e, 0, sizeof(struct fa_sched_entry_s));
+    e->rt = rt;
+    e->s = s;
+    e->on_exit = on_exit;
+    e->opaque = opaque;
+    e->thread = atomic_fetch_add(&next_thread, 1) % s->thread_count;
+    atomic_init(&e->state, FA_SCHED_QUEUED);
+    atomic_init(&e->gen, 0);
+
+    /* registered disarmed, the first slice arms it */
+    ev.events = EPOLLONESHOT;
+    ev.data.ptr = e;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, uv_backend_fd(&rt->loop), &ev) < 0) {
+        free(e);
+        return -1;
+    }
+
+    fa_run_setup(rt);
+    rt->sched = e;
+
+    uv_mutex_lock(&s->all_lock);
+    e->all_next = s->all;
+    if (s->all)
+        s->all->all_prev = e;
+    s->all = e;
+    s->count++;
+    uv_mutex_unlock(&s->all_lock);
+
+    fa_sched_push(&s->threads[e->thread], e);
+    return 0;
+}
+
+int fa_scheduler_count (fa_scheduler_t *s) {
+    int count;
+
+    uv_mutex_lock(&s->all_lock);
+    count = s->count;
+    uv_mutex_unlock(&s->all_lock);
+    return count;
+}
+
+void fa_free_scheduler (fa_scheduler_t *s) {
+    uint64_t one = 1;
+    int i;
+
+    atomic_store(&s->stopping, 1);
+    uv_mutex_lock(&s->idle_lock);
+    uv_cond_broadcast(&s->idle_cond);
+    uv_mutex_unlock(&s->idle_lock);
+    if (write(s->wakefd, &one, sizeof(one)) < 0) {}
+
+    for (i = 0; i < s->thread_count; i++)
+        uv_thread_join(&s->threads[i].thread);
+    uv_thread_join(&s->poller);
+
+    /* the runtimes still scheduled go back to the embedder */
+    while (s->all)
+        fa_sched_finish(s, s->all);
+    fa_sched_free_dead(s);
+
+    for (i = 0; i < s->thread_count; i++)
+        uv_mutex_destroy(&s->threads[i].lock);
+    uv_mutex_destroy(&s->idle_lock);
+    uv_cond_destroy(&s->idle_cond);
+    uv_mutex_destroy(&s->timer_lock);
+    uv_mutex_destroy(&s->all_lock);
+    close(s->epfd);
+    close(s->wakefd);
+    free(s->timers);
+    free(s->threads);
+    free(s);
+}
+
+#else
+
+fa_scheduler_t *fa_new_scheduler (const fa_scheduler_options_t *options) {
+    return NULL;
+}
+
+int fa_scheduler_add (
+    fa_scheduler_t *s,
+    fa_runtime_t *rt,
+    fa_scheduler_exit_func on_exit,
+    void *opaque
+) {
+    return -1;
+}
+
+int fa_scheduler_count (fa_scheduler_t *s) {
+    return 0;
+}
+
+void fa_free_scheduler (fa_scheduler_t *s) {
+}
+
+#endif
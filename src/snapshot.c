@@ -0,0 +1,217 @@
+#include "runtime.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A snapshot is the bundle a context was initialised from plus the global 
+ * state its initialisation produced:
+ * 
+ * [header][pad][FaBC bundle][pad][JS_WriteObject state]
+ * 
+ * QuickJS can only serialise data, not closures, so globals holding functions
+ * (or objects reaching them) are left out and modules are read lazily from the
+ * embedded bundle when they are imported again.
+ */
+
+#define FA_SNAPSHOT_VERSION 1
+
+static const char fa_snapshot_sig[] = "FaSS";
+
+struct fa_snapshot_header_s {
+    char        sig[4];
+    uint32_t    version;
+    uint64_t    bundle_offset;
+    uint64_t    bundle_size;
+    uint64_t    state_offset;
+    uint64_t    state_size;
+};
+
+typedef struct fa_snapshot_header_s fa_snapshot_header_t;
+
+static int fa_atom_in_list (JSAtom atom, JSPropertyEnum *tab, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (tab[i].atom == atom)
+            return 1;
+    }
+    return 0;
+}
+
+static void fa_free_prop_enum (JSContext *ctx, JSPropertyEnum *tab, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++)
+        JS_FreeAtom(ctx, tab[i].atom);
+    js_free(ctx, tab);
+}
+
+/* collects the serialisable globals which a pristine context does not have */
+static JSValue fa_capture_globals (JSContext *ctx) {
+    JSPropertyEnum *tab = NULL, *base_tab = NULL;
+    uint32_t len = 0, base_len = 0;
+    JSContext *base_ctx;
+    JSValue global, base_global, holder = JS_UNDEFINED;
+
+    base_ctx = JS_NewContext(JS_GetRuntime(ctx));
+    if (!base_ctx)
+        return JS_ThrowOutOfMemory(ctx);
+    JS_AddIntrinsicBigFloat(base_ctx);
+    JS_AddIntrinsicBigDecimal(base_ctx);
+    JS_AddIntrinsicOperators(base_ctx);
+    base_global = JS_GetGlobalObject(base_ctx);
+    int ret = JS_GetOwnPropertyNames(base_ctx, &base_tab, &base_len, base_global, JS_GPN_STRING_MASK);
+    JS_FreeValue(base_ctx, base_global);
+    if (ret < 0) {
+        JS_FreeContext(base_ctx);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+
+    global = JS_GetGlobalObject(ctx);
+    if (JS_GetOwnPropertyNames(ctx, &tab, &len, global, JS_GPN_STRING_MASK) < 0)
+        goto done;
+
+    holder = JS_NewObject(ctx);
+    if (JS_IsException(holder))
+        goto done;
+
+    for (uint32_t i = 0; i < len; i++) {
+        size_t size;
+        uint8_t *test;
+        JSValue val;
+
+        /* atoms are shared by the contexts of a runtime */
+        if (fa_atom_in_list(tab[i].atom, base_tab, base_len))
+            continue;
+
+        val = JS_GetProperty(ctx, global, tab[i].atom);
+        if (JS_IsException(val)) {
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            continue;
+        }
+
+        test = JS_WriteObject(ctx, &size, val, JS_WRITE_OBJ_REFERENCE);
+        if (!test) {
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            JS_FreeValue(ctx, val);
+            continue;
+        }
+        js_free(ctx, test);
+
+        JS_DefinePropertyValue(ctx, holder, tab[i].atom, val, JS_PROP_C_W_E);
+    }
+
+done:
+    if (tab)
+        fa_free_prop_enum(ctx, tab, len);
+    fa_free_prop_enum(base_ctx, base_tab, base_len);
+    JS_FreeContext(base_ctx);
+    JS_FreeValue(ctx, global);
+    return JS_IsUndefined(holder) ? JS_EXCEPTION : holder;
+}
+
+uint8_t *fa_write_snapshot (
+    JSContext *ctx,
+    const uint8_t *bundle, 
+    size_t bundle_len,
+    size_t *psize
+) {
+    fa_snapshot_header_t header;
+    uint8_t *state, *out;
+    size_t state_len;
+    JSValue holder;
+
+    holder = fa_capture_globals(ctx);
+    if (JS_IsException(holder))
+        return NULL;
+
+    /* references keep shared and cyclic objects intact */
+    state = JS_WriteObject(ctx, &state_len, holder, JS_WRITE_OBJ_REFERENCE);
+    JS_FreeValue(ctx, holder);
+    if (!state)
+        return NULL;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.sig, fa_snapshot_sig, 4);
+    header.version = FA_SNAPSHOT_VERSION;
+    header.bundle_offset = fa_bundle_align(sizeof(header));
+    header.bundle_size = bundle_len;
+    header.state_offset = fa_bundle_align(header.bundle_offset + bundle_len);
+    header.state_size = state_len;
+
+    *psize = header.state_offset + state_len;
+    out = calloc(1, *psize);
+    if (!out) {
+        js_free(ctx, state);
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + header.bundle_offset, bundle, bundle_len);
+    memcpy(out + header.state_offset, state, state_len);
+
+    js_free(ctx, state);
+    return out;
+}
+
+static int fa_restore_globals (JSContext *ctx, const uint8_t *state, size_t state_len) {
+    JSPropertyEnum *tab;
+    uint32_t len;
+    JSValue holder, global;
+    int ret = -1;
+
+    holder = JS_ReadObject(ctx, state, state_len, JS_READ_OBJ_REFERENCE);
+    if (JS_IsException(holder))
+        return -1;
+
+    global = JS_GetGlobalObject(ctx);
+    if (JS_GetOwnPropertyNames(ctx, &tab, &len, holder, JS_GPN_STRING_MASK) == 0) {
+        for (uint32_t i = 0; i < len; i++) {
+            JSValue val = JS_GetProperty(ctx, holder, tab[i].atom);
+            JS_DefinePropertyValue(ctx, global, tab[i].atom, val, JS_PROP_C_W_E);
+        }
+        fa_free_prop_enum(ctx, tab, len);
+        ret = 0;
+    }
+
+    JS_FreeValue(ctx, global);
+    JS_FreeValue(ctx, holder);
+    return ret;
+}
+
+fa_runtime_t *fa_new_runtime_from_snapshot (
+    const uint8_t *buf, 
+    size_t buf_len,
+    fa_runtime_init_func init,
+    void *opaque
+) {
+    fa_snapshot_header_t header;
+    fa_runtime_t *rt;
+
+    if (buf_len < sizeof(header) || memcmp(buf, fa_snapshot_sig, 4) != 0)
+        return NULL;
+    memcpy(&header, buf, sizeof(header));
+    if (header.version != FA_SNAPSHOT_VERSION ||
+        header.bundle_offset > buf_len || header.bundle_size > buf_len - header.bundle_offset ||
+        header.state_offset > buf_len || header.state_size > buf_len - header.state_offset)
+        return NULL;
+
+    rt = fa_new_runtime();
+    if (!rt)
+        return NULL;
+
+    if (init && init(rt, rt->ctx, opaque) < 0)
+        goto fail;
+
+    /* the main module already ran when the snapshot was taken */
+    if (fa_try_eval_bin_bundle(rt->ctx, buf + header.bundle_offset, header.bundle_size, 1) < 0)
+        goto fail;
+
+    if (fa_restore_globals(rt->ctx, buf + header.state_offset, header.state_size) < 0) {
+        fa_dump_error(rt->ctx);
+        goto fail;
+    }
+
+    return rt;
+
+fail:
+    fa_free_runtime(rt);
+    return NULL;
+}
@@ -0,0 +1,140 @@
+#include "runtime.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * QuickJS has no GC hooks, so collections are observed through two objects
+ * per context. The sentinel is kept alive by the runtime and has a gc_mark,
+ * which the collector calls once in its decref phase and once in its scan
+ * phase; the decref call starts a cycle. The probe is an unreachable cycle
+ * whose finalizer runs when the collector frees garbage at the end of the
+ * cycle, which ends the measured pause. A new probe is armed from the check
+ * handle, collections running before that are counted but not timed.
+ *
+ * This relies on internals of the collector of the vendored QuickJS
+ * (deps/quickjs/src): gc_decref and then gc_scan call the gc_mark of every
+ * live object once each, with their own mark function. Nothing promises
+ * that, so the first context of a runtime checks it on a collection of its
+ * own. If another QuickJS does not match, gc_supported stays 0 and the GC
+ * counters are not updated.
+ */
+
+static void fa_gc_sentinel_mark (JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func) {
+    fa_runtime_t *qrt = JS_GetRuntimeOpaque(rt);
+
+    if (qrt->stats.gc_calibrating) {
+        /* the first call is from the decref phase, -1 flags a mismatch */
+        if (qrt->stats.gc_mark_calls++ == 0)
+            qrt->stats.gc_decref_func = (void *) mark_func;
+        else if ((void *) mark_func == qrt->stats.gc_decref_func)
+            qrt->stats.gc_calibrating = -1;
+        return;
+    }
+    if (!qrt->stats.gc_supported || (void *) mark_func != qrt->stats.gc_decref_func)
+        return;
+
+    qrt->stats.gc_count++;
+    qrt->stats.gc_start = uv_hrtime();
+}
+
+static void fa_gc_probe_finalizer (JSRuntime *rt, JSValue val) {
+    fa_runtime_t *qrt = JS_GetRuntimeOpaque(rt);
+
+    /* probes freed with their context are not a collection */
+    if (!qrt->stats.gc_probe_armed)
+        return;
+
+    qrt->stats.gc_probe_armed = 0;
+    qrt->stats.gc_timed++;
+    qrt->stats.gc_time_ns += uv_hrtime() - qrt->stats.gc_start;
+}
+
+static JSClassDef fa_gc_sentinel_class = {
+    "GCSentinel",
+    .gc_mark = fa_gc_sentinel_mark,
+};
+
+static JSClassDef fa_gc_probe_class = {
+    "GCProbe",
+    .finalizer = fa_gc_probe_finalizer,
+};
+
+/* runs one collection with the sentinel alive, which has to see exactly a
+   decref and a scan call told apart by their mark functions */
+static void fa_stats_calibrate_gc (fa_runtime_t *qrt) {
+    qrt->stats.gc_calibrating = 1;
+    qrt->stats.gc_mark_calls = 0;
+    JS_RunGC(qrt->rt);
+
+    qrt->stats.gc_supported = qrt->stats.gc_calibrating == 1 && qrt->stats.gc_mark_calls == 2;
+    qrt->stats.gc_calibrating = 0;
+    qrt->stats.gc_calibrated = 1;
+}
+
+static void fa_stats_cleanup (fa_runtime_t *qrt, void *opaque) {
+    qrt->stats.gc_probe_armed = 0;
+    JS_FreeValue(qrt->ctx, qrt->stats.gc_sentinel);
+    qrt->stats.gc_sentinel = JS_UNDEFINED;
+}
+
+void fa_stats_init_context (fa_runtime_t *qrt, JSContext *ctx) {
+    if (!JS_IsRegisteredClass(qrt->rt, fa_gc_sentinel_class_id)) {
+        JS_NewClass(qrt->rt, fa_gc_sentinel_class_id, &fa_gc_sentinel_class);
+        JS_NewClass(qrt->rt, fa_gc_probe_class_id, &fa_gc_probe_class);
+    }
+
+    qrt->stats.gc_sentinel = JS_NewObjectClass(ctx, fa_gc_sentinel_class_id);
+    if (JS_IsException(qrt->stats.gc_sentinel)) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        qrt->stats.gc_sentinel = JS_UNDEFINED;
+        return;
+    }
+    fa_add_cleanup(qrt, fa_stats_cleanup, NULL);
+
+    if (!qrt->stats.gc_calibrated)
+        fa_stats_calibrate_gc(qrt);
+}
+
+void fa_stats_arm_gc_probe (fa_runtime_t *qrt) {
+    JSValue probe;
+
+    if (qrt->stats.gc_probe_armed || !qrt->stats.gc_supported ||
+        JS_IsUndefined(qrt->stats.gc_sentinel))
+        return;
+
+    probe = JS_NewObjectClass(qrt->ctx, fa_gc_probe_class_id);
+    if (JS_IsException(probe)) {
+        JS_FreeValue(qrt->ctx, JS_GetException(qrt->ctx));
+        return;
+    }
+    /* only a collection can free the cycle */
+    if (JS_SetPropertyStr(qrt->ctx, probe, "self", JS_DupValue(qrt->ctx, probe)) < 0) {
+        JS_FreeValue(qrt->ctx, JS_GetException(qrt->ctx));
+        JS_FreeValue(qrt->ctx, probe);
+        return;
+    }
+    qrt->stats.gc_probe_armed = 1;
+    JS_FreeValue(qrt->ctx, probe);
+}
+
+void fa_runtime_stats (fa_runtime_t *rt, fa_runtime_stats_t *stats) {
+    memset(stats, 0, sizeof(fa_runtime_stats_t));
+
+    JS_ComputeMemoryUsage(rt->rt, &stats->memory);
+
+    stats->gc_supported = rt->stats.gc_supported;
+    stats->gc_count = rt->stats.gc_count;
+    stats->gc_timed = rt->stats.gc_timed;
+    stats->gc_time_ns = rt->stats.gc_time_ns;
+
+    stats->jobs = rt->job_stats;
+
+    stats->loop_count = rt->stats.loop_count;
+    stats->check_time_ns = rt->stats.check_time_ns;
+#if UV_VERSION_HEX >= 0x012700
+    stats->poll_time_ns = uv_metrics_idle_time(&rt->loop);
+#endif
+
+    stats->module_loads = rt->stats.module_loads;
+    stats->module_load_time_ns = rt->stats.module_load_time_ns;
+}
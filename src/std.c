@@ -1,6 +1,10 @@
 #include "modules.h"
+#include "runtime.h"
 #include <quickjs.h>
 #include <cutils.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 static JSValue js_print (
     JSContext *ctx, 
@@ -8,20 +12,21 @@ static JSValue js_print (
     int argc, 
     JSValueConst *argv
 ) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
     int i;
     const char *str;
     size_t len;
 
     for(i = 0; i < argc; i++) {
         if (i != 0)
-            putchar(' ');
+            fa_output_write(qrt, " ", 1);
         str = JS_ToCStringLen(ctx, &len, argv[i]);
         if (!str)
             return JS_EXCEPTION;
-        fwrite(str, sizeof(char), len, stdout);
+        fa_output_write(qrt, str, len);
         JS_FreeCString(ctx, str);
     }
-    putchar('\n');
+    fa_output_write(qrt, "\n", 1);
     return JS_UNDEFINED;
 }
 
@@ -30,22 +35,324 @@ static int my_isdigit (int c) {
     return (c >= '0' && c <= '9');
 }
 
-static JSValue js_printf_internal (
-    JSContext *ctx,
+/**
+ * printf formats are parsed once into a list of ops and cached per runtime,
+ * keyed by the atom of the format string. Conversions without flags, width
+ * or precision are formatted directly, the others rebuild the C format and
+ * go through dbuf_printf like before.
+ */
+
+/* direct mapped, a power of two */
+#define FA_PRINTF_CACHE_SIZE 64
+
+enum {
+    FA_FMT_LITERAL,
+    FA_FMT_PERCENT,
+    FA_FMT_CONV,
+    /* stops the format, the conversions before it still run */
+    FA_FMT_INVALID,
+};
+
+typedef struct fa_fmt_op_s {
+    uint8_t type;
+    uint8_t conv;
+    /* 'l' or ' ' */
+    uint8_t mod;
+    /* the spec is only "%" */
+    uint8_t plain;
+    /* literal text, or the spec from '%' up to the modifier, in str */
+    uint32_t off;
+    uint32_t len;
+} fa_fmt_op_t;
+
+typedef struct fa_fmt_s {
+    /* the cache and every printf using it, conversions may call printf */
+    int refcount;
+    JSAtom atom;
+    int op_count;
+    char *str;
+    fa_fmt_op_t ops[];
+} fa_fmt_t;
+
+typedef struct fa_printf_cache_s {
+    fa_fmt_t *fmts[FA_PRINTF_CACHE_SIZE];
+} fa_printf_cache_t;
+
+static void fa_fmt_free (JSRuntime *rt, fa_fmt_t *f) {
+    if (--f->refcount > 0)
+        return;
+    JS_FreeAtomRT(rt, f->atom);
+    free(f);
+}
+
+static void fa_printf_cache_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_printf_cache_t *cache = opaque;
+    int i;
+
+    for (i = 0; i < FA_PRINTF_CACHE_SIZE; i++) {
+        if (cache->fmts[i])
+            fa_fmt_free(qrt->rt, cache->fmts[i]);
+    }
+    free(cache);
+    qrt->printf_cache = NULL;
+}
+
+/* takes the atom */
+static fa_fmt_t *fa_fmt_compile (JSContext *ctx, JSAtom atom) {
+    const uint8_t *fmt, *fmt_end, *p;
+    const char *fmt_str;
+    fa_fmt_op_t *op;
+    fa_fmt_t *f;
+    size_t fmt_len;
+    JSValue str;
+    int spec_len;
+
+    str = JS_AtomToString(ctx, atom);
+    if (JS_IsException(str)) {
+        JS_FreeAtom(ctx, atom);
+        return NULL;
+    }
+    fmt_str = JS_ToCStringLen(ctx, &fmt_len, str);
+    JS_FreeValue(ctx, str);
+    if (!fmt_str) {
+        JS_FreeAtom(ctx, atom);
+        return NULL;
+    }
+
+    /* every op takes at least one byte of the format */
+    f = malloc(sizeof(fa_fmt_t) + fmt_len * sizeof(fa_fmt_op_t) + fmt_len + 1);
+    if (!f) {
+        JS_FreeCString(ctx, fmt_str);
+        JS_FreeAtom(ctx, atom);
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    f->refcount = 1;
+    f->atom = atom;
+    f->op_count = 0;
+    f->str = (char *) &f->ops[fmt_len];
+    /* keeps the terminating null, a trailing '%' reads it like before */
+    memcpy(f->str, fmt_str, fmt_len + 1);
+    JS_FreeCString(ctx, fmt_str);
+
+    fmt = (const uint8_t *) f->str;
+    fmt_end = fmt + fmt_len;
+    while (fmt < fmt_end) {
+        for (p = fmt; fmt < fmt_end && *fmt != '%'; fmt++)
+            continue;
+        if (fmt > p) {
+            op = &f->ops[f->op_count++];
+            op->type = FA_FMT_LITERAL;
+            op->off = p - (const uint8_t *) f->str;
+            op->len = fmt - p;
+        }
+        if (fmt >= fmt_end)
+            break;
+
+        op = &f->ops[f->op_count++];
+        p = fmt++;
+
+        /* flags */
+        while (*fmt == '0' || *fmt == '#' || *fmt == '+' || *fmt == '-' || 
+               *fmt == ' ' || *fmt == '\'')
+            fmt++;
+        /* width */
+        if (*fmt == '*') {
+            fmt++;
+        } else {
+            while (my_isdigit(*fmt))
+                fmt++;
+        }
+        /* precision */
+        if (*fmt == '.') {
+            fmt++;
+            if (*fmt == '*') {
+                fmt++;
+            } else {
+                while (my_isdigit(*fmt))
+                    fmt++;
+            }
+        }
+
+        op->off = p - (const uint8_t *) f->str;
+        op->len = fmt - p;
+        op->plain = op->len == 1;
+
+        /* we only support the "l" modifier for 64 bit numbers */
+        op->mod = ' ';
+        if (*fmt == 'l')
+            op->mod = *fmt++;
+        op->conv = *fmt++;
+
+        /* room for the spec, stars expanded, "ll" or "I64", type and null */
+        spec_len = op->len;
+        for (p = (const uint8_t *) f->str + op->off; p < fmt; p++) {
+            if (*p == '*')
+                spec_len += 10;
+        }
+
+        switch (op->conv) {
+        case 'c':
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        case 's':
+        case 'e': case 'f': case 'g': case 'a':
+        case 'E': case 'F': case 'G': case 'A':
+            op->type = spec_len + 5 <= 32 ? FA_FMT_CONV : FA_FMT_INVALID;
+            break;
+        case '%':
+            op->type = FA_FMT_PERCENT;
+            break;
+        default:
+            op->type = FA_FMT_INVALID;
+            break;
+        }
+        if (op->type == FA_FMT_INVALID)
+            break;
+    }
+
+    return f;
+}
+
+static fa_fmt_t *fa_printf_get_format (JSContext *ctx, JSValueConst fmt_val) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    fa_printf_cache_t *cache = qrt->printf_cache;
+    fa_fmt_t *f, **pf;
+    JSValue str;
+    JSAtom atom;
+
+    if (!cache) {
+        cache = malloc(sizeof(fa_printf_cache_t));
+        if (!cache) {
+            JS_ThrowOutOfMemory(ctx);
+            return NULL;
+        }
+        memset(cache, 0, sizeof(fa_printf_cache_t));
+        qrt->printf_cache = cache;
+        fa_add_cleanup(qrt, fa_printf_cache_cleanup, cache);
+    }
+
+    /* symbols throw like they did when the format was converted directly */
+    str = JS_ToString(ctx, fmt_val);
+    if (JS_IsException(str))
+        return NULL;
+    atom = JS_ValueToAtom(ctx, str);
+    JS_FreeValue(ctx, str);
+    if (atom == JS_ATOM_NULL)
+        return NULL;
+
+    pf = &cache->fmts[atom & (FA_PRINTF_CACHE_SIZE - 1)];
+    if (*pf && (*pf)->atom == atom) {
+        JS_FreeAtom(ctx, atom);
+        return *pf;
+    }
+
+    f = fa_fmt_compile(ctx, atom);
+    if (!f)
+        return NULL;
+    if (*pf)
+        fa_fmt_free(qrt->rt, *pf);
+    *pf = f;
+    return f;
+}
+
+static void fa_put_u64 (DynBuf *dbuf, uint64_t v, int base, int upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buf[24];
+    char *q = buf + sizeof(buf);
+
+    do {
+        *--q = digits[v % base];
+        v /= base;
+    } while (v != 0);
+    dbuf_put(dbuf, (uint8_t *) q, buf + sizeof(buf) - q);
+}
+
+static void fa_put_i64 (DynBuf *dbuf, int64_t v) {
+    if (v < 0) {
+        dbuf_putc(dbuf, '-');
+        fa_put_u64(dbuf, -(uint64_t) v, 10, 0);
+    } else {
+        fa_put_u64(dbuf, v, 10, 0);
+    }
+}
+
+/* %f and %F without width and precision */
+static void fa_put_double_fixed (DynBuf *dbuf, double d, int conv) {
+    char buf[32];
+    int len;
+
+    /* integral values are common and need no rounding */
+    if (d > -9007199254740992.0 && d < 9007199254740992.0 && d == (int64_t) d) {
+        if (d == 0 && signbit(d))
+            dbuf_putc(dbuf, '-');
+        fa_put_i64(dbuf, (int64_t) d);
+        dbuf_put(dbuf, (const uint8_t *) ".000000", 7);
+        return;
+    }
+
+    len = snprintf(buf, sizeof(buf), conv == 'F' ? "%F" : "%f", d);
+    if (len < (int) sizeof(buf))
+        dbuf_put(dbuf, (uint8_t *) buf, len);
+    else
+        dbuf_printf(dbuf, conv == 'F' ? "%F" : "%f", d);
+}
+
+/* rebuilds the C format of a conversion, '*' takes the next argument */
+static int fa_fmt_spec (
+    JSContext *ctx, 
+    const fa_fmt_t *f, 
+    const fa_fmt_op_t *op, 
+    char *fmtbuf, 
     int argc, 
     JSValueConst *argv, 
-    FILE *fp
+    int *pi
+) {
+    const char *p = f->str + op->off, *end = p + op->len;
+    char *q = fmtbuf;
+    int32_t int32_arg;
+
+    for (; p < end; p++) {
+        if (*p != '*') {
+            *q++ = *p;
+            continue;
+        }
+        if (*pi >= argc) {
+            JS_ThrowReferenceError(ctx, "missing argument for conversion specifier");
+            return -1;
+        }
+        if (JS_ToInt32(ctx, &int32_arg, argv[(*pi)++]))
+            return -1;
+        q += snprintf(q, 12, "%d", int32_arg);
+    }
+
+    if (op->mod == 'l' && strchr("diouxX", op->conv)) {
+        /* 64 bit number */
+#if defined(_WIN32)
+        *q++ = 'I';
+        *q++ = '6';
+        *q++ = '4';
+#else
+        *q++ = 'l';
+        *q++ = 'l';
+#endif
+    }
+    *q++ = op->conv;
+    *q = '\0';
+    return 0;
+}
+
+static int fa_printf_format (
+    JSContext *ctx, 
+    DynBuf *dbuf, 
+    const fa_fmt_t *f, 
+    int argc, 
+    JSValueConst *argv
 ) {
     char fmtbuf[32];
     uint8_t cbuf[UTF8_CHAR_LEN_MAX+1];
-    JSValue res;
-    DynBuf dbuf;
-    const char *fmt_str;
-    const uint8_t *fmt, *fmt_end;
+    const fa_fmt_op_t *op, *ops_end = f->ops + f->op_count;
     const uint8_t *p;
-    char *q;
-    int i, c, len, mod;
-    size_t fmt_len;
+    int i = 1, len;
     int32_t int32_arg;
     int64_t int64_arg;
     double double_arg;
@@ -53,188 +360,138 @@ static JSValue js_printf_internal (
     /* Use indirect call to dbuf_printf to prevent gcc warning */
     int (*dbuf_printf_fun)(DynBuf *s, const char *fmt, ...) = (void*)dbuf_printf;
 
-    dbuf_init2(&dbuf, JS_GetRuntime(ctx), (DynBufReallocFunc *)js_realloc_rt);
+    for (op = f->ops; op < ops_end; op++) {
+        switch (op->type) {
+        case FA_FMT_LITERAL:
+            dbuf_put(dbuf, (const uint8_t *) f->str + op->off, op->len);
+            continue;
+        case FA_FMT_PERCENT:
+            dbuf_putc(dbuf, '%');
+            continue;
+        case FA_FMT_INVALID:
+            JS_ThrowTypeError(ctx, "invalid conversion specifier in format string");
+            return -1;
+        }
 
-    if (argc > 0) {
-        fmt_str = JS_ToCStringLen(ctx, &fmt_len, argv[0]);
-        if (!fmt_str)
-            goto fail;
+        /* stars come before the value */
+        if (!op->plain && fa_fmt_spec(ctx, f, op, fmtbuf, argc, argv, &i))
+            return -1;
+        if (i >= argc) {
+            JS_ThrowReferenceError(ctx, "missing argument for conversion specifier");
+            return -1;
+        }
 
-        i = 1;
-        fmt = (const uint8_t *)fmt_str;
-        fmt_end = fmt + fmt_len;
-        while (fmt < fmt_end) {
-            for (p = fmt; fmt < fmt_end && *fmt != '%'; fmt++)
-                continue;
-            dbuf_put(&dbuf, p, fmt - p);
-            if (fmt >= fmt_end)
-                break;
-            q = fmtbuf;
-            *q++ = *fmt++;  /* copy '%' */
-            
-            /* flags */
-            for(;;) {
-                c = *fmt;
-                if (c == '0' || c == '#' || c == '+' || c == '-' || c == ' ' ||
-                    c == '\'') {
-                    if (q >= fmtbuf + sizeof(fmtbuf) - 1)
-                        goto invalid;
-                    *q++ = c;
-                    fmt++;
-                } else {
-                    break;
-                }
-            }
-            /* width */
-            if (*fmt == '*') {
-                if (i >= argc)
-                    goto missing;
-                if (JS_ToInt32(ctx, &int32_arg, argv[i++]))
-                    goto fail;
-                q += snprintf(q, fmtbuf + sizeof(fmtbuf) - q, "%d", int32_arg);
-                fmt++;
+        switch (op->conv) {
+        case 'c':
+            if (JS_IsString(argv[i])) {
+                string_arg = JS_ToCString(ctx, argv[i++]);
+                if (!string_arg)
+                    return -1;
+                int32_arg = unicode_from_utf8((uint8_t *)string_arg, UTF8_CHAR_LEN_MAX, &p);
+                JS_FreeCString(ctx, string_arg);
             } else {
-                while (my_isdigit(*fmt)) {
-                    if (q >= fmtbuf + sizeof(fmtbuf) - 1)
-                        goto invalid;
-                    *q++ = *fmt++;
-                }
-            }
-            if (*fmt == '.') {
-                if (q >= fmtbuf + sizeof(fmtbuf) - 1)
-                    goto invalid;
-                *q++ = *fmt++;
-                if (*fmt == '*') {
-                    if (i >= argc)
-                        goto missing;
-                    if (JS_ToInt32(ctx, &int32_arg, argv[i++]))
-                        goto fail;
-                    q += snprintf(q, fmtbuf + sizeof(fmtbuf) - q, "%d", int32_arg);
-                    fmt++;
-                } else {
-                    while (my_isdigit(*fmt)) {
-                        if (q >= fmtbuf + sizeof(fmtbuf) - 1)
-                            goto invalid;
-                        *q++ = *fmt++;
-                    }
-                }
+                if (JS_ToInt32(ctx, &int32_arg, argv[i++]))
+                    return -1;
             }
+            /* handle utf-8 encoding explicitly */
+            if ((unsigned)int32_arg > 0x10FFFF)
+                int32_arg = 0xFFFD;
+            /* ignore conversion flags, width and precision */
+            len = unicode_to_utf8(cbuf, int32_arg);
+            dbuf_put(dbuf, cbuf, len);
+            break;
 
-            /* we only support the "l" modifier for 64 bit numbers */
-            mod = ' ';
-            if (*fmt == 'l') {
-                mod = *fmt++;
-            }
-            
-            /* type */
-            c = *fmt++;
-            if (q >= fmtbuf + sizeof(fmtbuf) - 1)
-                goto invalid;
-            *q++ = c;
-            *q = '\0';
-            
-            switch (c) {
-            case 'c':
-                if (i >= argc)
-                    goto missing;
-                if (JS_IsString(argv[i])) {
-                    string_arg = JS_ToCString(ctx, argv[i++]);
-                    if (!string_arg)
-                        goto fail;
-                    int32_arg = unicode_from_utf8((uint8_t *)string_arg, UTF8_CHAR_LEN_MAX, &p);
-                    JS_FreeCString(ctx, string_arg);
-                } else {
-                    if (JS_ToInt32(ctx, &int32_arg, argv[i++]))
-                        goto fail;
-                }
-                /* handle utf-8 encoding explicitly */
-                if ((unsigned)int32_arg > 0x10FFFF)
-                    int32_arg = 0xFFFD;
-                /* ignore conversion flags, width and precision */
-                len = unicode_to_utf8(cbuf, int32_arg);
-                dbuf_put(&dbuf, cbuf, len);
-                break;
-                
-            case 'd':
-            case 'i':
-            case 'o':
-            case 'u':
-            case 'x':
-            case 'X':
-                if (i >= argc)
-                    goto missing;
-                if (JS_ToInt64Ext(ctx, &int64_arg, argv[i++]))
-                    goto fail;
-                if (mod == 'l') {
-                    /* 64 bit number */
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            if (JS_ToInt64Ext(ctx, &int64_arg, argv[i++]))
+                return -1;
+            if (op->plain) {
+                /* without the modifier the value is truncated to an int */
+                if (op->mod != 'l')
+                    int64_arg = (int) int64_arg;
+                if (op->conv == 'd' || op->conv == 'i')
+                    fa_put_i64(dbuf, int64_arg);
+                else if (op->mod == 'l')
+                    fa_put_u64(dbuf, int64_arg, op->conv == 'o' ? 8 : op->conv == 'u' ? 10 : 16, 
+                               op->conv == 'X');
+                else
+                    fa_put_u64(dbuf, (unsigned) int64_arg, op->conv == 'o' ? 8 : op->conv == 'u' ? 10 : 16, 
+                               op->conv == 'X');
+            } else if (op->mod == 'l') {
 #if defined(_WIN32)
-                    if (q >= fmtbuf + sizeof(fmtbuf) - 3)
-                        goto invalid;
-                    q[2] = q[-1];
-                    q[-1] = 'I';
-                    q[0] = '6';
-                    q[1] = '4';
-                    q[3] = '\0';
-                    dbuf_printf_fun(&dbuf, fmtbuf, (int64_t)int64_arg);
+                dbuf_printf_fun(dbuf, fmtbuf, (int64_t)int64_arg);
 #else
-                    if (q >= fmtbuf + sizeof(fmtbuf) - 2)
-                        goto invalid;
-                    q[1] = q[-1];
-                    q[-1] = q[0] = 'l';
-                    q[2] = '\0';
-                    dbuf_printf_fun(&dbuf, fmtbuf, (long long)int64_arg);
+                dbuf_printf_fun(dbuf, fmtbuf, (long long)int64_arg);
 #endif
-                } else {
-                    dbuf_printf_fun(&dbuf, fmtbuf, (int)int64_arg);
-                }
-                break;
-
-            case 's':
-                if (i >= argc)
-                    goto missing;
-                /* XXX: handle strings containing null characters */
-                string_arg = JS_ToCString(ctx, argv[i++]);
-                if (!string_arg)
-                    goto fail;
-                dbuf_printf_fun(&dbuf, fmtbuf, string_arg);
-                JS_FreeCString(ctx, string_arg);
-                break;
-                
-            case 'e':
-            case 'f':
-            case 'g':
-            case 'a':
-            case 'E':
-            case 'F':
-            case 'G':
-            case 'A':
-                if (i >= argc)
-                    goto missing;
-                if (JS_ToFloat64(ctx, &double_arg, argv[i++]))
-                    goto fail;
-                dbuf_printf_fun(&dbuf, fmtbuf, double_arg);
-                break;
-                
-            case '%':
-                dbuf_putc(&dbuf, '%');
-                break;
-                
-            default:
-                /* XXX: should support an extension mechanism */
-            invalid:
-                JS_ThrowTypeError(ctx, "invalid conversion specifier in format string");
-                goto fail;
-            missing:
-                JS_ThrowReferenceError(ctx, "missing argument for conversion specifier");
-                goto fail;
+            } else {
+                dbuf_printf_fun(dbuf, fmtbuf, (int)int64_arg);
             }
+            break;
+
+        case 's':
+            /* XXX: handle strings containing null characters */
+            string_arg = JS_ToCString(ctx, argv[i++]);
+            if (!string_arg)
+                return -1;
+            if (op->plain)
+                dbuf_put(dbuf, (const uint8_t *) string_arg, strlen(string_arg));
+            else
+                dbuf_printf_fun(dbuf, fmtbuf, string_arg);
+            JS_FreeCString(ctx, string_arg);
+            break;
+
+        default:
+            if (JS_ToFloat64(ctx, &double_arg, argv[i++]))
+                return -1;
+            if (op->plain && (op->conv == 'f' || op->conv == 'F') && isfinite(double_arg))
+                fa_put_double_fixed(dbuf, double_arg, op->conv);
+            else if (op->plain)
+                dbuf_printf_fun(dbuf, op->conv == 'e' ? "%e" : op->conv == 'E' ? "%E" :
+                                op->conv == 'g' ? "%g" : op->conv == 'G' ? "%G" :
+                                op->conv == 'a' ? "%a" : op->conv == 'A' ? "%A" :
+                                op->conv == 'F' ? "%F" : "%f", double_arg);
+            else
+                dbuf_printf_fun(dbuf, fmtbuf, double_arg);
+            break;
         }
-        JS_FreeCString(ctx, fmt_str);
+    }
+    return 0;
+}
+
+static JSValue js_printf_internal (
+    JSContext *ctx,
+    int argc, 
+    JSValueConst *argv, 
+    FILE *fp
+) {
+    JSValue res;
+    DynBuf dbuf;
+    fa_fmt_t *f;
+    int len, ret;
+
+    dbuf_init2(&dbuf, JS_GetRuntime(ctx), (DynBufReallocFunc *)js_realloc_rt);
+
+    if (argc > 0) {
+        f = fa_printf_get_format(ctx, argv[0]);
+        if (!f)
+            goto fail;
+        f->refcount++;
+        ret = fa_printf_format(ctx, &dbuf, f, argc, argv);
+        fa_fmt_free(JS_GetRuntime(ctx), f);
+        if (ret)
+            goto fail;
     }
     if (dbuf.error) {
         res = JS_ThrowOutOfMemory(ctx);
     } else {
-        if (fp) {
+        if (fp == stdout) {
+            fa_output_write(fa_get_runtime(ctx), dbuf.buf, dbuf.size);
+            res = JS_NewInt32(ctx, dbuf.size);
+        } else if (fp) {
             len = fwrite(dbuf.buf, 1, dbuf.size, fp);
             res = JS_NewInt32(ctx, len);
         } else {
@@ -258,9 +515,86 @@ static JSValue js_std_printf (
     return js_printf_internal(ctx, argc, argv, stdout);
 }
 
+#define FA_SET_STAT(obj, s, field) \
+    JS_SetPropertyStr(ctx, obj, #field, JS_NewInt64(ctx, (int64_t) (s)->field))
+
+/* the counters of fa_runtime_stats, times are in nanoseconds */
+static JSValue js_std_stats (
+    JSContext *ctx, 
+    JSValueConst this_val,
+    int argc, 
+    JSValueConst *argv
+) {
+    fa_runtime_stats_t st;
+    JSValue obj, memory, gc, jobs, loop, modules;
+
+    fa_runtime_stats(fa_get_runtime(ctx), &st);
+
+    obj = JS_NewObject(ctx);
+    if (JS_IsException(obj))
+        return obj;
+
+    memory = JS_NewObject(ctx);
+    FA_SET_STAT(memory, &st.memory, malloc_size);
+    FA_SET_STAT(memory, &st.memory, malloc_limit);
+    FA_SET_STAT(memory, &st.memory, memory_used_size);
+    FA_SET_STAT(memory, &st.memory, malloc_count);
+    FA_SET_STAT(memory, &st.memory, memory_used_count);
+    FA_SET_STAT(memory, &st.memory, atom_count);
+    FA_SET_STAT(memory, &st.memory, atom_size);
+    FA_SET_STAT(memory, &st.memory, str_count);
+    FA_SET_STAT(memory, &st.memory, str_size);
+    FA_SET_STAT(memory, &st.memory, obj_count);
+    FA_SET_STAT(memory, &st.memory, obj_size);
+    FA_SET_STAT(memory, &st.memory, prop_count);
+    FA_SET_STAT(memory, &st.memory, prop_size);
+    FA_SET_STAT(memory, &st.memory, shape_count);
+    FA_SET_STAT(memory, &st.memory, shape_size);
+    FA_SET_STAT(memory, &st.memory, js_func_count);
+    FA_SET_STAT(memory, &st.memory, js_func_size);
+    FA_SET_STAT(memory, &st.memory, js_func_code_size);
+    FA_SET_STAT(memory, &st.memory, js_func_pc2line_count);
+    FA_SET_STAT(memory, &st.memory, js_func_pc2line_size);
+    FA_SET_STAT(memory, &st.memory, c_func_count);
+    FA_SET_STAT(memory, &st.memory, array_count);
+    FA_SET_STAT(memory, &st.memory, fast_array_count);
+    FA_SET_STAT(memory, &st.memory, fast_array_elements);
+    FA_SET_STAT(memory, &st.memory, binary_object_count);
+    FA_SET_STAT(memory, &st.memory, binary_object_size);
+    JS_SetPropertyStr(ctx, obj, "memory", memory);
+
+    gc = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, gc, "supported", JS_NewBool(ctx, st.gc_supported));
+    JS_SetPropertyStr(ctx, gc, "count", JS_NewInt64(ctx, st.gc_count));
+    JS_SetPropertyStr(ctx, gc, "timed", JS_NewInt64(ctx, st.gc_timed));
+    JS_SetPropertyStr(ctx, gc, "time", JS_NewInt64(ctx, st.gc_time_ns));
+    JS_SetPropertyStr(ctx, obj, "gc", gc);
+
+    jobs = JS_NewObject(ctx);
+    FA_SET_STAT(jobs, &st.jobs, jobs);
+    JS_SetPropertyStr(ctx, jobs, "time", JS_NewInt64(ctx, st.jobs.time_ns));
+    FA_SET_STAT(jobs, &st.jobs, ticks);
+    FA_SET_STAT(jobs, &st.jobs, deferred);
+    JS_SetPropertyStr(ctx, obj, "jobs", jobs);
+
+    loop = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, loop, "iterations", JS_NewInt64(ctx, st.loop_count));
+    JS_SetPropertyStr(ctx, loop, "checkTime", JS_NewInt64(ctx, st.check_time_ns));
+    JS_SetPropertyStr(ctx, loop, "pollTime", JS_NewInt64(ctx, st.poll_time_ns));
+    JS_SetPropertyStr(ctx, obj, "loop", loop);
+
+    modules = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, modules, "loads", JS_NewInt64(ctx, st.module_loads));
+    JS_SetPropertyStr(ctx, modules, "time", JS_NewInt64(ctx, st.module_load_time_ns));
+    JS_SetPropertyStr(ctx, obj, "modules", modules);
+
+    return obj;
+}
+
 static const JSCFunctionListEntry js_std_funcs[] = {
     JS_CFUNC_DEF("printf", 1, js_std_printf),
     JS_CFUNC_DEF("print", 1, js_print),
+    JS_CFUNC_DEF("stats", 0, js_std_stats),
 };
 
 static int js_std_init (JSContext *ctx, JSModuleDef *m) {
@@ -0,0 +1,808 @@
+#include "stream.h"
+#include "runtime.h"
+#include "utils.h"
+#include <cutils.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <assert.h>
+
+/* chunks kept for reuse per runtime */
+#define FA_CHUNK_POOL_MAX 64
+
+typedef struct fa_chunk_s {
+    struct fa_streams_s *owner;
+    /* free list or stream queue */
+    struct fa_chunk_s *next;
+    /* bytes [off, len) are still queued */
+    size_t off;
+    size_t len;
+    alignas(16) uint8_t data[];
+} fa_chunk_t;
+
+#define FA_CHUNK(ptr) ((fa_chunk_t *)((uint8_t *)(ptr) - offsetof(fa_chunk_t, data)))
+
+/**
+ * Per runtime stream state. Chunks handed to ArrayBuffers may be freed by
+ * the finalizers after the context is gone, so every outstanding chunk holds
+ * a reference besides the runtime's.
+ */
+typedef struct fa_streams_s {
+    fa_runtime_t *qrt;
+    int refcount;
+    fa_chunk_t *free_list;
+    int free_count;
+    /* streams still attached to a source or sink */
+    fa_stream_t *open;
+} fa_streams_t;
+
+typedef struct fa_stream_req_s {
+    struct fa_stream_req_s *next;
+    fa_promise_t promise;
+} fa_stream_req_t;
+
+struct fa_stream_s {
+    JSContext *ctx;
+    fa_streams_t *st;
+    const fa_stream_ops_t *ops;
+    void *opaque;
+    /* not owned, referenced while open */
+    JSValue obj;
+    int is_writable;
+    /* attached to its source or sink */
+    int open;
+    /* readable: the source ended, writable: close() was called */
+    int ended;
+    int err;
+    /* readable: the source waits for pull */
+    int paused;
+    /* writable: bytes handed to the sink */
+    size_t writing;
+    size_t hwm;
+    size_t buffered;
+    /* queued chunks, linked through their headers */
+    fa_chunk_t *head;
+    fa_chunk_t *tail;
+    /* readable: pending reads, writable: writes waiting for a drain */
+    fa_stream_req_t *reqs;
+    fa_stream_req_t *reqs_tail;
+    fa_promise_t close_promise;
+    fa_stream_t *prev;
+    fa_stream_t *next;
+};
+
+/* Chunks */
+
+static void fa_streams_unref (fa_streams_t *st) {
+    if (--st->refcount > 0)
+        return;
+    while (st->free_list) {
+        fa_chunk_t *c = st->free_list;
+        st->free_list = c->next;
+        free(c);
+    }
+    free(st);
+}
+
+static uint8_t *fa_streams_chunk_alloc (fa_streams_t *st) {
+    fa_chunk_t *c = st->free_list;
+
+    if (c) {
+        st->free_list = c->next;
+        st->free_count--;
+    } else {
+        c = malloc(sizeof(fa_chunk_t) + FA_STREAM_CHUNK_SIZE);
+        if (!c)
+            return NULL;
+        c->owner = st;
+    }
+    st->refcount++;
+
+    return c->data;
+}
+
+void fa_chunk_free (uint8_t *chunk) {
+    fa_chunk_t *c = FA_CHUNK(chunk);
+    fa_streams_t *st = c->owner;
+
+    if (st->qrt && st->free_count < FA_CHUNK_POOL_MAX) {
+        c->next = st->free_list;
+        st->free_list = c;
+        st->free_count++;
+    } else {
+        free(c);
+    }
+    fa_streams_unref(st);
+}
+
+static void fa_chunk_free_buffer (JSRuntime *rt, void *opaque, void *ptr) {
+    fa_chunk_free(ptr);
+}
+
+JSValue fa_chunk_new_array_buffer (JSContext *ctx, uint8_t *chunk, size_t len) {
+    JSValue ab = JS_NewArrayBuffer(ctx, chunk, len, fa_chunk_free_buffer, NULL, 0);
+    if (JS_IsException(ab))
+        fa_chunk_free(chunk);
+    return ab;
+}
+
+/* Streams */
+
+static void fa_stream_detach (fa_stream_t *s);
+
+static void fa_streams_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_streams_t *st = opaque;
+
+    /* sources and sinks must not outlive the context */
+    while (st->open)
+        fa_stream_detach(st->open);
+
+    st->qrt = NULL;
+    qrt->streams = NULL;
+    fa_streams_unref(st);
+}
+
+void fa_streams_free_context (fa_runtime_t *qrt, JSContext *ctx) {
+    fa_streams_t *st = qrt->streams;
+    fa_stream_t *s;
+
+    if (!st)
+        return;
+
+    /* detaching may settle and free streams, so start over each time */
+    for (s = st->open; s != NULL; ) {
+        if (s->ctx == ctx) {
+            fa_stream_detach(s);
+            s = st->open;
+        } else {
+            s = s->next;
+        }
+    }
+}
+
+static void fa_streams_init_classes (JSContext *ctx);
+
+static fa_streams_t *fa_get_streams (JSContext *ctx) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    fa_streams_t *st = qrt->streams;
+
+    /* tenants create streams in their own context */
+    fa_streams_init_classes(ctx);
+
+    if (st)
+        return st;
+
+    st = malloc(sizeof(fa_streams_t));
+    if (!st)
+        return NULL;
+    memset(st, 0, sizeof(fa_streams_t));
+    st->qrt = qrt;
+    st->refcount = 1;
+
+    qrt->streams = st;
+    fa_add_cleanup(qrt, fa_streams_cleanup, st);
+
+    return st;
+}
+
+uint8_t *fa_chunk_alloc (fa_runtime_t *qrt) {
+    fa_streams_t *st = fa_get_streams(qrt->ctx);
+    return st ? fa_streams_chunk_alloc(st) : NULL;
+}
+
+void *fa_stream_get_opaque (fa_stream_t *s) {
+    return s->opaque;
+}
+
+/* consumes value, an exception is passed on so the read is rejected with it */
+static JSValue fa_stream_iter_result (JSContext *ctx, JSValue value, int done) {
+    JSValue obj;
+
+    if (JS_IsException(value))
+        return value;
+
+    obj = JS_NewObject(ctx);
+    if (JS_IsException(obj)) {
+        JS_FreeValue(ctx, value);
+        return obj;
+    }
+    JS_DefinePropertyValueStr(ctx, obj, "value", value, JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "done", JS_NewBool(ctx, done), JS_PROP_C_W_E);
+    return obj;
+}
+
+static void fa_stream_settle (JSContext *ctx, fa_promise_t *p, int is_reject, JSValue value) {
+    if (JS_IsException(value)) {
+        value = JS_GetException(ctx);
+        is_reject = 1;
+    }
+    fa_settle_promise(ctx, p, is_reject, 1, (JSValueConst *) &value);
+}
+
+static fa_stream_req_t *fa_stream_req_push (fa_stream_t *s, JSValue *ppromise) {
+    fa_stream_req_t *r = malloc(sizeof(fa_stream_req_t));
+    if (!r) {
+        JS_ThrowOutOfMemory(s->ctx);
+        return NULL;
+    }
+    r->next = NULL;
+    *ppromise = fa_init_promise(s->ctx, &r->promise);
+    if (JS_IsException(*ppromise)) {
+        free(r);
+        return NULL;
+    }
+    if (s->reqs_tail)
+        s->reqs_tail->next = r;
+    else
+        s->reqs = r;
+    s->reqs_tail = r;
+    return r;
+}
+
+static fa_stream_req_t *fa_stream_req_shift (fa_stream_t *s) {
+    fa_stream_req_t *r = s->reqs;
+    if (r) {
+        s->reqs = r->next;
+        if (!s->reqs)
+            s->reqs_tail = NULL;
+    }
+    return r;
+}
+
+/* value is consumed by every settled request */
+static void fa_stream_settle_all (fa_stream_t *s, int is_reject, JSValue (*value)(fa_stream_t *s)) {
+    fa_stream_req_t *r;
+    while ((r = fa_stream_req_shift(s)) != NULL) {
+        fa_stream_settle(s->ctx, &r->promise, is_reject, value(s));
+        free(r);
+    }
+}
+
+static JSValue fa_stream_error_value (fa_stream_t *s) {
+    return fa_new_uv_error(s->ctx, s->err);
+}
+
+static JSValue fa_stream_done_value (fa_stream_t *s) {
+    return fa_stream_iter_result(s->ctx, JS_UNDEFINED, 1);
+}
+
+static JSValue fa_stream_undefined_value (fa_stream_t *s) {
+    return JS_UNDEFINED;
+}
+
+static void fa_stream_queue (fa_stream_t *s, fa_chunk_t *c) {
+    c->next = NULL;
+    if (s->tail)
+        s->tail->next = c;
+    else
+        s->head = c;
+    s->tail = c;
+}
+
+static fa_chunk_t *fa_stream_dequeue (fa_stream_t *s) {
+    fa_chunk_t *c = s->head;
+    if (c) {
+        s->head = c->next;
+        if (!s->head)
+            s->tail = NULL;
+    }
+    return c;
+}
+
+static void fa_stream_free_bufs (fa_stream_t *s) {
+    fa_chunk_t *c;
+    while ((c = fa_stream_dequeue(s)) != NULL)
+        fa_chunk_free(c->data);
+    s->buffered = 0;
+}
+
+static void fa_stream_attach (fa_stream_t *s) {
+    fa_streams_t *st = s->st;
+
+    /* the source may push until it is closed, the object has to stay */
+    s->obj = JS_DupValue(s->ctx, s->obj);
+    s->open = 1;
+    s->next = st->open;
+    if (s->next)
+        s->next->prev = s;
+    st->open = s;
+}
+
+/* closes the source or sink and drops the reference the stream held */
+static void fa_stream_detach (fa_stream_t *s) {
+    fa_streams_t *st = s->st;
+
+    if (!s->open)
+        return;
+    s->open = 0;
+
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        st->open = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+
+    /* nothing else would settle them */
+    if (s->err)
+        fa_stream_settle_all(s, 1, fa_stream_error_value);
+    else if (s->is_writable)
+        fa_stream_settle_all(s, 0, fa_stream_undefined_value);
+    else
+        fa_stream_settle_all(s, 0, fa_stream_done_value);
+
+    s->ops->close(s);
+    /* may run the finalizer */
+    JS_FreeValue(s->ctx, s->obj);
+}
+
+static fa_stream_t *fa_stream_new (
+    JSContext *ctx,
+    JSClassID class_id,
+    const fa_stream_ops_t *ops,
+    void *opaque,
+    size_t hwm,
+    JSValue *pobj
+) {
+    fa_streams_t *st = fa_get_streams(ctx);
+    fa_stream_t *s;
+    JSValue obj;
+
+    if (!st) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+
+    obj = JS_NewObjectClass(ctx, class_id);
+    if (JS_IsException(obj))
+        return NULL;
+
+    s = malloc(sizeof(fa_stream_t));
+    if (!s) {
+        JS_FreeValue(ctx, obj);
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    memset(s, 0, sizeof(fa_stream_t));
+    s->ctx = ctx;
+    s->st = st;
+    s->ops = ops;
+    s->opaque = opaque;
+    s->obj = obj;
+    s->hwm = hwm > 0 ? hwm : FA_STREAM_CHUNK_SIZE;
+    fa_clear_promise(ctx, &s->close_promise);
+    /* chunks outlive the stream state of a reset context */
+    st->refcount++;
+    JS_SetOpaque(obj, s);
+
+    fa_stream_attach(s);
+
+    *pobj = obj;
+    return s;
+}
+
+/* either class */
+static fa_stream_t *fa_stream_get (JSValueConst val) {
+    fa_stream_t *s = JS_GetOpaque(val, fa_readable_class_id);
+    return s ? s : JS_GetOpaque(val, fa_writable_class_id);
+}
+
+static void fa_stream_finalizer (JSRuntime *rt, JSValue val) {
+    fa_stream_t *s = fa_stream_get(val);
+    fa_stream_req_t *r;
+
+    if (!s)
+        return;
+
+    /* open streams hold a reference to themselves */
+    assert(!s->open);
+    while ((r = fa_stream_req_shift(s)) != NULL) {
+        fa_free_promise_rt(rt, &r->promise);
+        free(r);
+    }
+    fa_free_promise_rt(rt, &s->close_promise);
+    fa_stream_free_bufs(s);
+    fa_streams_unref(s->st);
+    free(s);
+}
+
+static void fa_stream_mark (JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func) {
+    fa_stream_t *s = fa_stream_get(val);
+    fa_stream_req_t *r;
+
+    if (!s)
+        return;
+
+    for (r = s->reqs; r != NULL; r = r->next)
+        fa_mark_promise(rt, &r->promise, mark_func);
+    fa_mark_promise(rt, &s->close_promise, mark_func);
+}
+
+/* Readable */
+
+JSValue fa_new_readable (
+    JSContext *ctx,
+    const fa_stream_ops_t *ops,
+    void *opaque,
+    size_t hwm,
+    fa_stream_t **ps
+) {
+    JSValue obj;
+    fa_stream_t *s = fa_stream_new(ctx, fa_readable_class_id, ops, opaque, hwm, &obj);
+    if (!s)
+        return JS_EXCEPTION;
+    *ps = s;
+    return obj;
+}
+
+int fa_readable_push (fa_stream_t *s, uint8_t *chunk, size_t len) {
+    fa_stream_req_t *r;
+    fa_chunk_t *c;
+
+    if (!s->open || s->ended) {
+        fa_chunk_free(chunk);
+        return 0;
+    }
+
+    /* a waiting reader gets the chunk as is */
+    r = fa_stream_req_shift(s);
+    if (r) {
+        fa_stream_settle(s->ctx, &r->promise, 0,
+            fa_stream_iter_result(s->ctx, fa_chunk_new_array_buffer(s->ctx, chunk, len), 0));
+        free(r);
+        return 1;
+    }
+
+    c = FA_CHUNK(chunk);
+    c->off = 0;
+    c->len = len;
+    fa_stream_queue(s, c);
+    s->buffered += len;
+
+    if (s->buffered >= s->hwm) {
+        s->paused = 1;
+        return 0;
+    }
+    return 1;
+}
+
+void fa_readable_end (fa_stream_t *s, int err) {
+    if (s->ended)
+        return;
+    s->ended = 1;
+    s->err = err;
+    if (err)
+        fa_stream_free_bufs(s);
+    fa_stream_detach(s);
+}
+
+static JSValue fa_readable_read (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_stream_t *s = JS_GetOpaque2(ctx, this_val, fa_readable_class_id);
+    fa_chunk_t *c;
+    JSValue value, promise;
+
+    if (!s)
+        return JS_EXCEPTION;
+
+    c = fa_stream_dequeue(s);
+    if (c) {
+        s->buffered -= c->len;
+        value = fa_chunk_new_array_buffer(ctx, c->data, c->len);
+
+        /* below the high water mark again */
+        if (s->paused && s->open && s->buffered < s->hwm) {
+            s->paused = 0;
+            s->ops->pull(s);
+        }
+
+        if (JS_IsException(value))
+            return JS_EXCEPTION;
+        value = fa_stream_iter_result(ctx, value, 0);
+        if (JS_IsException(value))
+            return JS_EXCEPTION;
+        return fa_resolved_promise(ctx, 1, (JSValueConst *) &value);
+    }
+
+    if (!s->open) {
+        if (s->err) {
+            value = fa_new_uv_error(ctx, s->err);
+            return fa_rejected_promise(ctx, 1, (JSValueConst *) &value);
+        }
+        value = fa_stream_iter_result(ctx, JS_UNDEFINED, 1);
+        return fa_resolved_promise(ctx, 1, (JSValueConst *) &value);
+    }
+
+    if (!fa_stream_req_push(s, &promise))
+        return JS_EXCEPTION;
+    if (s->paused) {
+        s->paused = 0;
+        s->ops->pull(s);
+    }
+    return promise;
+}
+
+/* stops reading, the source is closed and buffered data dropped */
+static JSValue fa_readable_cancel (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_stream_t *s = JS_GetOpaque2(ctx, this_val, fa_readable_class_id);
+    JSValue value;
+
+    if (!s)
+        return JS_EXCEPTION;
+
+    fa_stream_free_bufs(s);
+    s->ended = 1;
+    fa_stream_detach(s);
+
+    value = fa_stream_iter_result(ctx, JS_UNDEFINED, 1);
+    return fa_resolved_promise(ctx, 1, (JSValueConst *) &value);
+}
+
+static JSValue fa_readable_iterator (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    return JS_DupValue(ctx, this_val);
+}
+
+static const JSCFunctionListEntry fa_readable_proto_funcs[] = {
+    JS_CFUNC_DEF("read", 0, fa_readable_read),
+    JS_CFUNC_DEF("cancel", 0, fa_readable_cancel),
+    /* async iteration */
+    JS_CFUNC_DEF("next", 0, fa_readable_read),
+    JS_CFUNC_DEF("return", 0, fa_readable_cancel),
+    JS_CFUNC_DEF("[Symbol.asyncIterator]", 0, fa_readable_iterator),
+    JS_PROP_STRING_DEF("[Symbol.toStringTag]", "ReadableStream", JS_PROP_CONFIGURABLE),
+};
+
+/* Writable */
+
+JSValue fa_new_writable (
+    JSContext *ctx,
+    const fa_stream_ops_t *ops,
+    void *opaque,
+    size_t hwm,
+    fa_stream_t **ps
+) {
+    JSValue obj;
+    fa_stream_t *s = fa_stream_new(ctx, fa_writable_class_id, ops, opaque, hwm, &obj);
+    if (!s)
+        return JS_EXCEPTION;
+    s->is_writable = 1;
+    *ps = s;
+    return obj;
+}
+
+static void fa_writable_finish (fa_stream_t *s) {
+    JSContext *ctx = s->ctx;
+
+    if (fa_is_promise_pending(ctx, &s->close_promise)) {
+        if (s->err)
+            fa_stream_settle(ctx, &s->close_promise, 1, fa_new_uv_error(ctx, s->err));
+        else
+            fa_stream_settle(ctx, &s->close_promise, 0, JS_UNDEFINED);
+    }
+    fa_stream_detach(s);
+}
+
+static void fa_writable_flush (fa_stream_t *s) {
+    fa_chunk_t *c = s->head;
+    int err;
+
+    if (s->writing > 0 || !s->open)
+        return;
+
+    if (!c || c->off == c->len) {
+        if (s->ended)
+            fa_writable_finish(s);
+        return;
+    }
+
+    s->writing = c->len - c->off;
+    err = s->ops->write(s, c->data + c->off, s->writing);
+    if (err < 0)
+        fa_writable_done(s, err);
+}
+
+void fa_writable_done (fa_stream_t *s, int err) {
+    fa_chunk_t *c = s->head;
+
+    if (!s->open)
+        return;
+
+    if (err < 0) {
+        s->err = err;
+        s->writing = 0;
+        fa_stream_free_bufs(s);
+        fa_writable_finish(s);
+        return;
+    }
+
+    c->off += s->writing;
+    s->buffered -= s->writing;
+    s->writing = 0;
+
+    /* the tail chunk keeps collecting small writes */
+    if (c->off == c->len && (c->next || c->len == FA_STREAM_CHUNK_SIZE)) {
+        fa_stream_dequeue(s);
+        fa_chunk_free(c->data);
+    } else if (c->off == c->len) {
+        c->off = c->len = 0;
+    }
+
+    if (s->buffered < s->hwm)
+        fa_stream_settle_all(s, 0, fa_stream_undefined_value);
+
+    fa_writable_flush(s);
+}
+
+uint8_t *fa_writable_take_chunk (fa_stream_t *s) {
+    fa_chunk_t *c;
+
+    if (!s->writing)
+        return NULL;
+
+    c = fa_stream_dequeue(s);
+    s->buffered -= c->len - c->off;
+    s->writing = 0;
+    return c->data;
+}
+
+static int fa_writable_append (fa_stream_t *s, const uint8_t *data, size_t len) {
+    fa_chunk_t *c;
+    uint8_t *chunk;
+    size_t n;
+
+    while (len > 0) {
+        c = s->tail;
+        /* the tail may be appended to while the sink writes its start */
+        if (!c || c->len == FA_STREAM_CHUNK_SIZE) {
+            chunk = fa_streams_chunk_alloc(s->st);
+            if (!chunk)
+                return UV_ENOMEM;
+            c = FA_CHUNK(chunk);
+            c->off = c->len = 0;
+            fa_stream_queue(s, c);
+        }
+        n = FA_STREAM_CHUNK_SIZE - c->len;
+        if (n > len)
+            n = len;
+        memcpy(c->data + c->len, data, n);
+        c->len += n;
+        s->buffered += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* write(data) settles once the buffer is below the high water mark */
+static JSValue fa_writable_write (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_stream_t *s = JS_GetOpaque2(ctx, this_val, fa_writable_class_id);
+    JSValue promise, ab, error;
+    const uint8_t *data;
+    const char *str = NULL;
+    size_t len, offset, bpe;
+    int err;
+
+    if (!s)
+        return JS_EXCEPTION;
+    if (s->err) {
+        error = fa_new_uv_error(ctx, s->err);
+        return fa_rejected_promise(ctx, 1, (JSValueConst *) &error);
+    }
+    if (s->ended || !s->open)
+        return JS_ThrowTypeError(ctx, "write after close");
+
+    if (JS_IsString(argv[0])) {
+        str = JS_ToCStringLen(ctx, &len, argv[0]);
+        if (!str)
+            return JS_EXCEPTION;
+        data = (const uint8_t *) str;
+    } else {
+        data = JS_GetArrayBuffer(ctx, &len, argv[0]);
+        if (!data) {
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            ab = JS_GetTypedArrayBuffer(ctx, argv[0], &offset, &len, &bpe);
+            if (JS_IsException(ab))
+                return JS_EXCEPTION;
+            data = JS_GetArrayBuffer(ctx, &bpe, ab);
+            JS_FreeValue(ctx, ab);
+            if (!data)
+                return JS_EXCEPTION;
+            data += offset;
+        }
+    }
+
+    /* copied into pooled chunks, the caller may reuse its buffer right away */
+    err = fa_writable_append(s, data, len);
+    if (str)
+        JS_FreeCString(ctx, str);
+    if (err < 0)
+        return JS_ThrowOutOfMemory(ctx);
+
+    fa_writable_flush(s);
+
+    if (s->buffered < s->hwm || !s->open)
+        return fa_resolved_promise(ctx, 0, NULL);
+
+    if (!fa_stream_req_push(s, &promise))
+        return JS_EXCEPTION;
+    return promise;
+}
+
+/* close() settles once everything was written and the sink is closed */
+static JSValue fa_writable_close (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_stream_t *s = JS_GetOpaque2(ctx, this_val, fa_writable_class_id);
+    JSValue promise, error;
+
+    if (!s)
+        return JS_EXCEPTION;
+    if (s->err) {
+        error = fa_new_uv_error(ctx, s->err);
+        return fa_rejected_promise(ctx, 1, (JSValueConst *) &error);
+    }
+    if (!s->open)
+        return fa_resolved_promise(ctx, 0, NULL);
+    if (fa_is_promise_pending(ctx, &s->close_promise))
+        return JS_DupValue(ctx, s->close_promise.p);
+
+    promise = fa_init_promise(ctx, &s->close_promise);
+    if (JS_IsException(promise))
+        return promise;
+
+    s->ended = 1;
+    fa_writable_flush(s);
+
+    return promise;
+}
+
+static JSValue fa_stream_get_buffered (JSContext *ctx, JSValueConst this_val) {
+    fa_stream_t *s = fa_stream_get(this_val);
+    if (!s)
+        return JS_ThrowTypeError(ctx, "not a stream");
+    return JS_NewInt64(ctx, s->buffered);
+}
+
+static const JSCFunctionListEntry fa_writable_proto_funcs[] = {
+    JS_CFUNC_DEF("write", 1, fa_writable_write),
+    JS_CFUNC_DEF("close", 0, fa_writable_close),
+    JS_CGETSET_DEF("buffered", fa_stream_get_buffered, NULL),
+    JS_PROP_STRING_DEF("[Symbol.toStringTag]", "WritableStream", JS_PROP_CONFIGURABLE),
+};
+
+static JSClassDef fa_readable_class = {
+    "ReadableStream",
+    .finalizer = fa_stream_finalizer,
+    .gc_mark = fa_stream_mark,
+};
+
+static JSClassDef fa_writable_class = {
+    "WritableStream",
+    .finalizer = fa_stream_finalizer,
+    .gc_mark = fa_stream_mark,
+};
+
+static void fa_streams_init_classes (JSContext *ctx) {
+    JSRuntime *rt = JS_GetRuntime(ctx);
+    JSValue proto;
+
+    /* class ids are global, classes are registered per runtime */
+    if (!JS_IsRegisteredClass(rt, fa_readable_class_id)) {
+        JS_NewClass(rt, fa_readable_class_id, &fa_readable_class);
+        JS_NewClass(rt, fa_writable_class_id, &fa_writable_class);
+    }
+
+    /* prototypes are per context, set by its first stream */
+    proto = JS_GetClassProto(ctx, fa_readable_class_id);
+    JS_FreeValue(ctx, proto);
+    if (JS_IsObject(proto))
+        return;
+
+    proto = JS_NewObject(ctx);
+    JS_SetPropertyFunctionList(ctx, proto, fa_readable_proto_funcs, countof(fa_readable_proto_funcs));
+    JS_SetClassProto(ctx, fa_readable_class_id, proto);
+
+    proto = JS_NewObject(ctx);
+    JS_SetPropertyFunctionList(ctx, proto, fa_writable_proto_funcs, countof(fa_writable_proto_funcs));
+    JS_SetClassProto(ctx, fa_writable_class_id, proto);
+}
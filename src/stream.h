@@ -0,0 +1,65 @@
+#ifndef FA_STREAM_H
+#define FA_STREAM_H
+
+#include "fireant.h"
+
+/**
+ * Byte streams for native modules. A readable stream is fed by a native
+ * source with fa_readable_push and read from JS with read() or for await,
+ * a writable stream collects the bytes written from JS into chunks and
+ * hands them to a native sink one at a time. Both buffer up to a high water
+ * mark: readable sources are asked to pause past it, writes past it return
+ * a promise which only settles once the sink caught up.
+ */
+
+/* Size of the pooled chunks streams buffer their data in */
+#define FA_STREAM_CHUNK_SIZE (64 * 1024)
+
+uint8_t *fa_chunk_alloc (fa_runtime_t *qrt);
+void fa_chunk_free (uint8_t *chunk);
+/* adopts the chunk, it goes back to the pool once the ArrayBuffer is collected */
+JSValue fa_chunk_new_array_buffer (JSContext *ctx, uint8_t *chunk, size_t len);
+
+typedef struct fa_stream_s fa_stream_t;
+
+typedef struct fa_stream_ops_s {
+    /* readable: the buffer dropped below the high water mark again, push more */
+    void (*pull) (fa_stream_t *s);
+    /* writable: write the bytes and call fa_writable_done once finished, the
+       buffer stays valid until then. Returns a uv error if it failed early */
+    int (*write) (fa_stream_t *s, const uint8_t *buf, size_t len);
+    /* the stream is done with the source or sink, called exactly once */
+    void (*close) (fa_stream_t *s);
+} fa_stream_ops_t;
+
+JSValue fa_new_readable (
+    JSContext *ctx,
+    const fa_stream_ops_t *ops,
+    void *opaque,
+    size_t hwm,
+    fa_stream_t **ps
+);
+/* takes a chunk from fa_chunk_alloc, returns 0 once the source should wait 
+   for pull */
+int fa_readable_push (fa_stream_t *s, uint8_t *chunk, size_t len);
+/* no more data, err is 0 or a uv error. Closes the source, which must not
+   be used afterwards. */
+void fa_readable_end (fa_stream_t *s, int err);
+
+JSValue fa_new_writable (
+    JSContext *ctx,
+    const fa_stream_ops_t *ops,
+    void *opaque,
+    size_t hwm,
+    fa_stream_t **ps
+);
+/* err is 0 or a uv error. Closes the sink on errors or once a closing 
+   stream is flushed, so the sink must not be used afterwards. */
+void fa_writable_done (fa_stream_t *s, int err);
+/* hands the chunk of the write in flight to a sink torn down before the
+   write finished, it frees it with fa_chunk_free. NULL if none is. */
+uint8_t *fa_writable_take_chunk (fa_stream_t *s);
+
+void *fa_stream_get_opaque (fa_stream_t *s);
+
+#endif
@@ -0,0 +1,542 @@
+#include "runtime.h"
+#include "utils.h"
+#include <cutils.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/**
+ * All timers of a runtime share one uv timer. They are kept in a
+ * hierarchical timer wheel with 1ms ticks: level 0 holds the timers due in
+ * the next 64 ticks, one slot per tick, each level above covers 64 times
+ * the range of the one below. When the wheel time crosses a level boundary
+ * the matching slot of the level above is cascaded down. Insert and cancel
+ * are O(1), the uv timer is armed for the next level 0 slot or cascade.
+ *
+ * import { setTimeout, setInterval, clearTimeout, sleep } from 'timers';
+ */
+
+#define FA_WHEEL_BITS 6
+#define FA_WHEEL_SIZE (1 << FA_WHEEL_BITS)
+#define FA_WHEEL_MASK (FA_WHEEL_SIZE - 1)
+#define FA_WHEEL_LEVELS 4
+/* timers further out are parked in the top level and cascaded again */
+#define FA_WHEEL_MAX_DELTA ((1ULL << (FA_WHEEL_BITS * FA_WHEEL_LEVELS)) - 1)
+
+typedef struct fa_timer_link_s {
+    struct fa_timer_link_s *prev;
+    struct fa_timer_link_s *next;
+} fa_timer_link_t;
+
+typedef struct fa_timer_s {
+    /* first so a link can be cast back to its timer */
+    fa_timer_link_t link;
+    /* -1 while not in the wheel */
+    int level;
+    /* set while the wheel holds a reference to obj */
+    int active;
+    uint64_t expire;
+    uint64_t interval;
+    /* context the callback runs in */
+    JSContext *ctx;
+    /* not owned, the wheel holds a reference while the timer is active */
+    JSValue obj;
+    JSValue func;
+    int argc;
+    JSValue *argv;
+    /* set for sleep() */
+    fa_promise_t promise;
+} fa_timer_t;
+
+typedef struct fa_timers_s {
+    fa_runtime_t *qrt;
+    uv_timer_t handle;
+    /* last wheel tick which was processed, on the loop clock */
+    uint64_t tick;
+    /* when the uv timer fires, 0 if it is not armed */
+    uint64_t due;
+    int count[FA_WHEEL_LEVELS];
+    fa_timer_link_t wheel[FA_WHEEL_LEVELS][FA_WHEEL_SIZE];
+} fa_timers_t;
+
+static inline void fa_timer_list_init (fa_timer_link_t *head) {
+    head->prev = head->next = head;
+}
+
+static inline int fa_timer_list_empty (fa_timer_link_t *head) {
+    return head->next == head;
+}
+
+static inline void fa_timer_list_add_tail (fa_timer_link_t *head, fa_timer_link_t *l) {
+    l->prev = head->prev;
+    l->next = head;
+    head->prev->next = l;
+    head->prev = l;
+}
+
+static inline void fa_timer_list_del (fa_timer_link_t *l) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->prev = l->next = NULL;
+}
+
+/* moves all entries of from to the end of to */
+static inline void fa_timer_list_splice (fa_timer_link_t *from, fa_timer_link_t *to) {
+    if (fa_timer_list_empty(from))
+        return;
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    fa_timer_list_init(from);
+}
+
+/* Wheel */
+
+static void fa_timers_cb (uv_timer_t *handle);
+
+static void fa_timers_arm (fa_timers_t *ts, uint64_t when) {
+    uint64_t now = uv_now(&ts->qrt->loop);
+
+    if (ts->due != 0 && ts->due <= when)
+        return;
+
+    ts->due = when;
+    uv_timer_start(&ts->handle, fa_timers_cb, when > now ? when - now : 0, 0);
+}
+
+/* base is the first tick the timer may be put in */
+static void fa_timers_insert (fa_timers_t *ts, fa_timer_t *t, uint64_t base) {
+    uint64_t e = t->expire < base ? base : t->expire;
+    uint64_t delta = e - ts->tick;
+    int level;
+
+    if (delta > FA_WHEEL_MAX_DELTA) {
+        e = ts->tick + FA_WHEEL_MAX_DELTA;
+        delta = FA_WHEEL_MAX_DELTA;
+    }
+
+    for (level = 0; level < FA_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << (FA_WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    t->level = level;
+    ts->count[level]++;
+    fa_timer_list_add_tail(&ts->wheel[level][(e >> (FA_WHEEL_BITS * level)) & FA_WHEEL_MASK], &t->link);
+}
+
+static void fa_timers_remove (fa_timers_t *ts, fa_timer_t *t) {
+    if (t->level >= 0)
+        ts->count[t->level]--;
+    t->level = -1;
+    if (t->link.next)
+        fa_timer_list_del(&t->link);
+}
+
+/* the earliest tick at which the wheel has to be looked at again */
+static uint64_t fa_timers_next (fa_timers_t *ts) {
+    uint64_t next = UINT64_MAX, step;
+    int i, level;
+
+    if (ts->count[0] > 0) {
+        for (i = 1; i <= FA_WHEEL_SIZE; i++) {
+            if (!fa_timer_list_empty(&ts->wheel[0][(ts->tick + i) & FA_WHEEL_MASK])) {
+                next = ts->tick + i;
+                break;
+            }
+        }
+    }
+
+    /* the lowest non-empty level cascades first */
+    for (level = 1; level < FA_WHEEL_LEVELS; level++) {
+        if (ts->count[level] > 0) {
+            step = 1ULL << (FA_WHEEL_BITS * level);
+            if (((ts->tick | (step - 1)) + 1) < next)
+                next = (ts->tick | (step - 1)) + 1;
+            break;
+        }
+    }
+
+    return next;
+}
+
+static void fa_timers_cascade (fa_timers_t *ts, int level) {
+    fa_timer_link_t list, *l;
+    fa_timer_link_t *slot = &ts->wheel[level][(ts->tick >> (FA_WHEEL_BITS * level)) & FA_WHEEL_MASK];
+
+    fa_timer_list_init(&list);
+    fa_timer_list_splice(slot, &list);
+
+    while (!fa_timer_list_empty(&list)) {
+        l = list.next;
+        fa_timer_list_del(l);
+        ts->count[level]--;
+        /* timers due at this very tick still fire in it */
+        fa_timers_insert(ts, (fa_timer_t *) l, ts->tick);
+    }
+}
+
+/* advances the wheel to now and moves the due timers to expired */
+static void fa_timers_advance (fa_timers_t *ts, uint64_t now, fa_timer_link_t *expired) {
+    fa_timer_link_t *slot, *l;
+    uint64_t step, next;
+    int level;
+
+    while (ts->tick < now) {
+        for (level = 0; level < FA_WHEEL_LEVELS && ts->count[level] == 0; level++)
+            continue;
+        if (level == FA_WHEEL_LEVELS) {
+            ts->tick = now;
+            break;
+        }
+
+        /* nothing happens before the next boundary of the lowest used level */
+        step = 1ULL << (FA_WHEEL_BITS * level);
+        next = (ts->tick | (step - 1)) + 1;
+        if (next > now) {
+            ts->tick = now;
+            break;
+        }
+        ts->tick = next;
+
+        /* higher levels first, they may spill into the slot cascaded next */
+        for (level = FA_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((ts->tick & ((1ULL << (FA_WHEEL_BITS * level)) - 1)) == 0)
+                fa_timers_cascade(ts, level);
+        }
+
+        slot = &ts->wheel[0][ts->tick & FA_WHEEL_MASK];
+        for (l = slot->next; l != slot; l = l->next) {
+            ((fa_timer_t *) l)->level = -1;
+            ts->count[0]--;
+        }
+        fa_timer_list_splice(slot, expired);
+    }
+}
+
+/* Timers */
+
+static int fa_timers_empty (fa_timers_t *ts) {
+    int level;
+    for (level = 0; level < FA_WHEEL_LEVELS; level++) {
+        if (ts->count[level] > 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void fa_timer_release (fa_timers_t *ts, fa_timer_t *t) {
+    JSContext *ctx = ts->qrt->ctx;
+
+    if (!t->active)
+        return;
+    t->active = 0;
+    fa_timers_remove(ts, t);
+
+    /* cleared timers must not keep the loop alive */
+    if (fa_timers_empty(ts)) {
+        uv_timer_stop(&ts->handle);
+        ts->due = 0;
+    }
+    /* may run the finalizer */
+    JS_FreeValue(ctx, t->obj);
+}
+
+static void fa_timer_fire (fa_timers_t *ts, fa_timer_t *t) {
+    JSContext *ctx = t->ctx;
+    JSValue obj, ret;
+
+    /* clearTimeout in the callback must not free the timer under us */
+    obj = JS_DupValue(ctx, t->obj);
+
+    if (fa_is_promise_pending(ctx, &t->promise)) {
+        fa_resolve_promise(ctx, &t->promise, 0, NULL);
+    } else {
+        ret = JS_Call(ctx, t->func, JS_UNDEFINED, t->argc, (JSValueConst *) t->argv);
+        fa_eval_std_free(ctx, ret);
+    }
+
+    if (t->active) {
+        if (t->interval > 0) {
+            t->expire = uv_now(&ts->qrt->loop) + t->interval;
+            fa_timers_insert(ts, t, ts->tick + 1);
+        } else {
+            fa_timer_release(ts, t);
+        }
+    }
+
+    JS_FreeValue(ctx, obj);
+}
+
+static void fa_timers_cb (uv_timer_t *handle) {
+    fa_timers_t *ts = handle->data;
+    fa_timer_link_t expired;
+    fa_timer_t *t;
+    uint64_t next;
+
+    ts->due = 0;
+
+    fa_timer_list_init(&expired);
+    fa_timers_advance(ts, uv_now(&ts->qrt->loop), &expired);
+
+    /* callbacks may add timers or clear the ones still in the list */
+    while (!fa_timer_list_empty(&expired)) {
+        t = (fa_timer_t *) expired.next;
+        fa_timer_list_del(&t->link);
+        fa_timer_fire(ts, t);
+    }
+
+    next = fa_timers_next(ts);
+    if (next != UINT64_MAX)
+        fa_timers_arm(ts, next);
+}
+
+static void fa_timers_on_close (uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void fa_timers_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_timers_t *ts = opaque;
+    fa_timer_link_t *slot;
+    int level, i;
+
+    /* pending timers never fire once the context goes away */
+    for (level = 0; level < FA_WHEEL_LEVELS; level++) {
+        for (i = 0; i < FA_WHEEL_SIZE; i++) {
+            slot = &ts->wheel[level][i];
+            while (!fa_timer_list_empty(slot))
+                fa_timer_release(ts, (fa_timer_t *) slot->next);
+        }
+    }
+
+    qrt->timers = NULL;
+    uv_close((uv_handle_t *) &ts->handle, fa_timers_on_close);
+}
+
+void fa_timers_free_context (fa_runtime_t *qrt, JSContext *ctx) {
+    fa_timers_t *ts = qrt->timers;
+    fa_timer_link_t *slot, *l, *next;
+    int level, i;
+
+    if (!ts)
+        return;
+
+    for (level = 0; level < FA_WHEEL_LEVELS; level++) {
+        for (i = 0; i < FA_WHEEL_SIZE; i++) {
+            slot = &ts->wheel[level][i];
+            for (l = slot->next; l != slot; l = next) {
+                next = l->next;
+                if (((fa_timer_t *) l)->ctx == ctx)
+                    fa_timer_release(ts, (fa_timer_t *) l);
+            }
+        }
+    }
+}
+
+static fa_timers_t *fa_get_timers (JSContext *ctx) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    fa_timers_t *ts = qrt->timers;
+    int level, i;
+
+    if (ts)
+        return ts;
+
+    ts = malloc(sizeof(fa_timers_t));
+    if (!ts) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    memset(ts, 0, sizeof(fa_timers_t));
+    ts->qrt = qrt;
+    ts->tick = uv_now(&qrt->loop);
+    for (level = 0; level < FA_WHEEL_LEVELS; level++) {
+        for (i = 0; i < FA_WHEEL_SIZE; i++)
+            fa_timer_list_init(&ts->wheel[level][i]);
+    }
+
+    FA_CHECK(uv_timer_init(&qrt->loop, &ts->handle) == 0);
+    ts->handle.data = ts;
+
+    qrt->timers = ts;
+    fa_add_cleanup(qrt, fa_timers_cleanup, ts);
+
+    return ts;
+}
+
+static void fa_timer_finalizer (JSRuntime *rt, JSValue val) {
+    fa_timer_t *t = JS_GetOpaque(val, fa_timer_class_id);
+    int i;
+
+    if (!t)
+        return;
+
+    JS_FreeValueRT(rt, t->func);
+    for (i = 0; i < t->argc; i++)
+        JS_FreeValueRT(rt, t->argv[i]);
+    free(t->argv);
+    fa_free_promise_rt(rt, &t->promise);
+    free(t);
+}
+
+static void fa_timer_mark (JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func) {
+    fa_timer_t *t = JS_GetOpaque(val, fa_timer_class_id);
+    int i;
+
+    if (!t)
+        return;
+
+    JS_MarkValue(rt, t->func, mark_func);
+    for (i = 0; i < t->argc; i++)
+        JS_MarkValue(rt, t->argv[i], mark_func);
+    fa_mark_promise(rt, &t->promise, mark_func);
+}
+
+static JSClassDef fa_timer_class = {
+    "Timer",
+    .finalizer = fa_timer_finalizer,
+    .gc_mark = fa_timer_mark,
+};
+
+/* creates an active timer, the caller sets func or promise */
+static fa_timer_t *fa_timer_new (JSContext *ctx, JSValueConst delay, int repeat, JSValue *pobj) {
+    fa_timers_t *ts = fa_get_timers(ctx);
+    fa_timer_t *t;
+    int64_t ms;
+    JSValue obj;
+
+    if (!ts)
+        return NULL;
+    if (JS_ToInt64(ctx, &ms, delay))
+        return NULL;
+    if (ms < 0)
+        ms = 0;
+    /* like in browsers, an interval of 0 would never yield to I/O */
+    if (repeat && ms == 0)
+        ms = 1;
+
+    obj = JS_NewObjectClass(ctx, fa_timer_class_id);
+    if (JS_IsException(obj))
+        return NULL;
+
+    t = malloc(sizeof(fa_timer_t));
+    if (!t) {
+        JS_FreeValue(ctx, obj);
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    memset(t, 0, sizeof(fa_timer_t));
+    t->level = -1;
+    t->ctx = ctx;
+    t->obj = obj;
+    t->func = JS_UNDEFINED;
+    fa_clear_promise(ctx, &t->promise);
+    t->expire = uv_now(&ts->qrt->loop) + ms;
+    t->interval = repeat ? ms : 0;
+    JS_SetOpaque(obj, t);
+
+    /* the wheel keeps the object while the timer is active */
+    t->active = 1;
+    *pobj = JS_DupValue(ctx, obj);
+    fa_timers_insert(ts, t, ts->tick + 1);
+    fa_timers_arm(ts, fa_timers_next(ts));
+
+    return t;
+}
+
+static JSValue fa_set_timer (
+    JSContext *ctx,
+    JSValueConst this_val,
+    int argc,
+    JSValueConst *argv,
+    int repeat
+) {
+    fa_timer_t *t;
+    JSValue obj;
+    int i;
+
+    if (!JS_IsFunction(ctx, argv[0]))
+        return JS_ThrowTypeError(ctx, "not a function");
+
+    t = fa_timer_new(ctx, argv[1], repeat, &obj);
+    if (!t)
+        return JS_EXCEPTION;
+
+    t->func = JS_DupValue(ctx, argv[0]);
+    if (argc > 2) {
+        t->argv = malloc(sizeof(JSValue) * (argc - 2));
+        if (!t->argv) {
+            fa_timer_release(fa_get_runtime(ctx)->timers, t);
+            JS_FreeValue(ctx, obj);
+            return JS_ThrowOutOfMemory(ctx);
+        }
+        for (i = 2; i < argc; i++)
+            t->argv[t->argc++] = JS_DupValue(ctx, argv[i]);
+    }
+
+    return obj;
+}
+
+static JSValue fa_set_timeout (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    return fa_set_timer(ctx, this_val, argc, argv, 0);
+}
+
+static JSValue fa_set_interval (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    return fa_set_timer(ctx, this_val, argc, argv, 1);
+}
+
+static JSValue fa_clear_timer (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_timers_t *ts = fa_get_runtime(ctx)->timers;
+    fa_timer_t *t;
+
+    /* clearing anything but a timer is a no-op, like in browsers */
+    t = JS_GetOpaque(argv[0], fa_timer_class_id);
+    if (t && ts)
+        fa_timer_release(ts, t);
+
+    return JS_UNDEFINED;
+}
+
+static JSValue fa_sleep (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    fa_timer_t *t;
+    JSValue obj, promise;
+
+    t = fa_timer_new(ctx, argv[0], 0, &obj);
+    if (!t)
+        return JS_EXCEPTION;
+
+    promise = fa_init_promise(ctx, &t->promise);
+    if (JS_IsException(promise))
+        fa_timer_release(fa_get_runtime(ctx)->timers, t);
+
+    /* only the wheel references the timer */
+    JS_FreeValue(ctx, obj);
+
+    return promise;
+}
+
+static const JSCFunctionListEntry js_timers_funcs[] = {
+    JS_CFUNC_DEF("setTimeout", 2, fa_set_timeout),
+    JS_CFUNC_DEF("setInterval", 2, fa_set_interval),
+    JS_CFUNC_DEF("clearTimeout", 1, fa_clear_timer),
+    JS_CFUNC_DEF("clearInterval", 1, fa_clear_timer),
+    JS_CFUNC_DEF("sleep", 1, fa_sleep),
+};
+
+static int js_timers_init (JSContext *ctx, JSModuleDef *m) {
+    JSRuntime *rt = JS_GetRuntime(ctx);
+
+    /* class ids are global, classes are registered per runtime */
+    if (!JS_IsRegisteredClass(rt, fa_timer_class_id))
+        JS_NewClass(rt, fa_timer_class_id, &fa_timer_class);
+
+    return JS_SetModuleExportList(ctx, m, js_timers_funcs, countof(js_timers_funcs));
+}
+
+JSModuleDef *js_init_module_timers (JSContext *ctx, const char *module_name) {
+    JSModuleDef *m;
+    m = JS_NewCModule(ctx, module_name, js_timers_init);
+    if (!m) return NULL;
+    JS_AddModuleExportList(ctx, m, js_timers_funcs, countof(js_timers_funcs));
+    return m;
+}
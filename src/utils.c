@@ -8,6 +8,16 @@
  * JS_FreeValue -> Decreases reference counter to object (does not release memory!)
  */
 
+uint64_t fa_hash_bytes (const void *buf, size_t len, uint64_t seed) {
+    const uint8_t *p = buf;
+    uint64_t h = seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
 static void js_dump_obj(JSContext *ctx, FILE *f, JSValueConst val)
 {
     const char *str;
@@ -46,6 +56,19 @@ void fa_dump_error(JSContext *ctx)
     JS_FreeValue(ctx, exception_val);
 }
 
+JSValue fa_new_uv_error (JSContext *ctx, int err) {
+    JSValue obj = JS_NewError(ctx);
+    if (JS_IsException(obj))
+        return obj;
+    JS_DefinePropertyValueStr(ctx, obj, "message", JS_NewString(ctx, uv_strerror(err)),
+                              JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+    JS_DefinePropertyValueStr(ctx, obj, "code", JS_NewString(ctx, uv_err_name(err)),
+                              JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+    JS_DefinePropertyValueStr(ctx, obj, "errno", JS_NewInt32(ctx, err),
+                              JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+    return obj;
+}
+
 int fa_eval_check_exception (JSContext *ctx, JSValue val) {
     int ret;
     if (JS_IsException(val)) {
@@ -68,8 +91,9 @@ JSValue fa_init_promise (JSContext *ctx, fa_promise_t *p) {
     p->p = JS_NewPromiseCapability(ctx, rfuncs);
     if (JS_IsException(p->p))
         return JS_EXCEPTION;
-    p->rfuncs[0] = JS_DupValue(ctx, rfuncs[0]);
-    p->rfuncs[1] = JS_DupValue(ctx, rfuncs[1]);
+    /* the capability already returned owned references */
+    p->rfuncs[0] = rfuncs[0];
+    p->rfuncs[1] = rfuncs[1];
     return JS_DupValue(ctx, p->p);
 }
 
@@ -107,17 +131,17 @@ void fa_settle_promise (JSContext *ctx, fa_promise_t *p, int is_reject, int argc
     for (int i = 0; i < argc; i++)
         JS_FreeValue(ctx, argv[i]);
     JS_FreeValue(ctx, ret); /* XXX: what to do if exception ? */
-    JS_FreeValue(ctx, p->rfuncs[0]);
-    JS_FreeValue(ctx, p->rfuncs[1]);
-    TJS_FreePromise(ctx, p);
+    fa_free_promise(ctx, p);
+    /* no longer pending */
+    fa_clear_promise(ctx, p);
 }
 
 void fa_resolve_promise (JSContext *ctx, fa_promise_t *p, int argc, JSValueConst *argv) {
-    TJS_SettlePromise(ctx, p, 0, argc, argv);
+    fa_settle_promise(ctx, p, 0, argc, argv);
 }
 
 void fa_reject_promise (JSContext *ctx, fa_promise_t *p, int argc, JSValueConst *argv) {
-    TJS_SettlePromise(ctx, p, 1, argc, argv);
+    fa_settle_promise(ctx, p, 1, argc, argv);
 }
 
 static inline JSValue fa_settled_promise(JSContext *ctx, int is_reject, int argc, JSValueConst *argv) {
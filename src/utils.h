@@ -15,10 +15,17 @@ struct fa_promise_s {
 
 typedef struct fa_promise_s fa_promise_t;
 
+/* 64-bit FNV-1a, chain calls by passing the previous hash as the seed */
+#define FA_HASH_SEED 0xcbf29ce484222325ULL
+uint64_t fa_hash_bytes (const void *buf, size_t len, uint64_t seed);
+
 void fa_dump_error1(JSContext *ctx, JSValueConst exception_val);
 
 void fa_dump_error(JSContext *ctx);
 
+/* Error with the libuv message, code (e.g. ENOENT) and errno */
+JSValue fa_new_uv_error (JSContext *ctx, int err);
+
 /* Promises */
 JSValue fa_init_promise (JSContext *ctx, fa_promise_t *p);
 // bool return type
@@ -0,0 +1,108 @@
+#include "runtime.h"
+#include "utils.h"
+#include <stdatomic.h>
+
+/**
+ * Time limits are checked from the interrupt handler QuickJS calls every
+ * few thousand operations, so the check has to be cheap. Instead of reading
+ * the clock there, a watchdog thread publishes a coarse millisecond clock
+ * while any runtime has a limit set and the handler only compares it to the
+ * runtime's deadlines.
+ *
+ * The turn limit bounds how long JS runs without returning to the loop: a
+ * turn starts with the first check after the loop went through a poll, the
+ * prepare handle counting loop iterations marks that.
+ */
+
+#define FA_WATCHDOG_TICK_MS 1
+
+static atomic_uint_fast64_t fa_watchdog_clock;
+
+static uv_once_t fa_watchdog_once = UV_ONCE_INIT;
+static uv_mutex_t fa_watchdog_lock;
+static uv_cond_t fa_watchdog_cond;
+static uv_thread_t fa_watchdog_thread;
+/* runtimes with a limit, the thread sleeps while there are none */
+static int fa_watchdog_users;
+
+static uint64_t fa_watchdog_time (void) {
+    return uv_hrtime() / 1000000;
+}
+
+static void fa_watchdog_run (void *opaque) {
+    for (;;) {
+        uv_mutex_lock(&fa_watchdog_lock);
+        while (fa_watchdog_users == 0)
+            uv_cond_wait(&fa_watchdog_cond, &fa_watchdog_lock);
+        uv_mutex_unlock(&fa_watchdog_lock);
+
+        atomic_store_explicit(&fa_watchdog_clock, fa_watchdog_time(), memory_order_relaxed);
+        uv_sleep(FA_WATCHDOG_TICK_MS);
+    }
+}
+
+static void fa_watchdog_init (void) {
+    FA_CHECK(uv_mutex_init(&fa_watchdog_lock) == 0);
+    FA_CHECK(uv_cond_init(&fa_watchdog_cond) == 0);
+    /* lives as long as the process */
+    FA_CHECK(uv_thread_create(&fa_watchdog_thread, fa_watchdog_run, NULL) == 0);
+}
+
+static void fa_watchdog_add_user (int n) {
+    uv_once(&fa_watchdog_once, fa_watchdog_init);
+
+    uv_mutex_lock(&fa_watchdog_lock);
+    fa_watchdog_users += n;
+    if (fa_watchdog_users > 0) {
+        /* the clock may be stale after sleeping */
+        atomic_store_explicit(&fa_watchdog_clock, fa_watchdog_time(), memory_order_relaxed);
+        uv_cond_signal(&fa_watchdog_cond);
+    }
+    uv_mutex_unlock(&fa_watchdog_lock);
+}
+
+void fa_set_time_limit (fa_runtime_t *rt, uint64_t turn_ms, uint64_t total_ms) {
+    int had_limit = rt->time_limit.active;
+
+    rt->time_limit.active = turn_ms > 0 || total_ms > 0;
+    rt->time_limit.turn_ms = turn_ms;
+    rt->time_limit.expired = 0;
+    rt->time_limit.turn_start = 0;
+    rt->time_limit.turn_count = rt->stats.loop_count;
+
+    if (rt->time_limit.active != had_limit)
+        fa_watchdog_add_user(rt->time_limit.active ? 1 : -1);
+
+    rt->time_limit.deadline = total_ms > 0 ? fa_watchdog_time() + total_ms : 0;
+}
+
+int fa_time_limit_expired (fa_runtime_t *rt) {
+    return rt->time_limit.expired;
+}
+
+int fa_time_limit_check (fa_runtime_t *qrt) {
+    uint64_t now = atomic_load_explicit(&fa_watchdog_clock, memory_order_relaxed);
+
+    if (qrt->time_limit.deadline && now >= qrt->time_limit.deadline) {
+        /* the runtime is out of time for good */
+        qrt->time_limit.expired = 1;
+        /* like fa_stop, a scheduler drops the runtime too */
+        qrt->stopped = 1;
+        uv_stop(&qrt->loop);
+        return 1;
+    }
+
+    if (qrt->time_limit.turn_ms) {
+        if (qrt->time_limit.turn_count != qrt->stats.loop_count || !qrt->time_limit.turn_start) {
+            qrt->time_limit.turn_count = qrt->stats.loop_count;
+            qrt->time_limit.turn_start = now;
+        } else if (now - qrt->time_limit.turn_start >= qrt->time_limit.turn_ms) {
+            /* the next turn starts with a fresh budget */
+            qrt->time_limit.expired = 1;
+            qrt->time_limit.turn_start = 0;
+            return 1;
+        }
+    }
+
+    return 0;
+}
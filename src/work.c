@@ -0,0 +1,220 @@
+#include "runtime.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Threadpool jobs for native modules. The work callback runs on the uv
+ * threadpool and must not touch JS, the done callback runs on the loop
+ * thread and turns the result into the value the promise settles with.
+ *
+ * Each job is the opaque of a Work object, which owns the promise and marks
+ * it for the cycle collector. The runtime keeps the object alive while the
+ * job is in flight, afterwards only the promise's reactions do.
+ */
+
+typedef struct fa_works_s {
+    fa_runtime_t *qrt;
+    /* jobs in flight */
+    struct fa_work_s *pending;
+} fa_works_t;
+
+typedef struct fa_work_s {
+    uv_work_t req;
+    /* NULL once orphaned by a cleanup */
+    fa_works_t *works;
+    JSContext *ctx;
+    /* not owned, the pending list holds a reference while in flight */
+    JSValue obj;
+    fa_promise_t promise;
+    fa_work_func work;
+    fa_work_done_func done;
+    void *opaque;
+    struct fa_work_s *prev;
+    struct fa_work_s *next;
+} fa_work_t;
+
+/* cancels the jobs of ctx, or all if NULL. Running ones can't be stopped
+   and may use memory the done callback releases, so every job is orphaned:
+   fa_work_after_cb only lets done release opaque and settles nothing. */
+static void fa_works_orphan (fa_runtime_t *qrt, fa_works_t *works, JSContext *ctx) {
+    fa_work_t *w, *next;
+
+    for (w = works->pending; w != NULL; w = next) {
+        next = w->next;
+        if (ctx && w->ctx != ctx)
+            continue;
+
+        if (w->prev)
+            w->prev->next = w->next;
+        else
+            works->pending = w->next;
+        if (w->next)
+            w->next->prev = w->prev;
+        w->prev = w->next = NULL;
+        w->works = NULL;
+
+        fa_hold_orphan(qrt, w->ctx);
+        uv_cancel((uv_req_t *) &w->req);
+    }
+}
+
+static void fa_works_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_works_t *works = opaque;
+
+    fa_works_orphan(qrt, works, NULL);
+
+    qrt->works = NULL;
+    free(works);
+}
+
+void fa_works_free_context (fa_runtime_t *qrt, JSContext *ctx) {
+    if (qrt->works)
+        fa_works_orphan(qrt, qrt->works, ctx);
+}
+
+static fa_works_t *fa_get_works (JSContext *ctx) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    fa_works_t *works = qrt->works;
+
+    if (works)
+        return works;
+
+    works = malloc(sizeof(fa_works_t));
+    if (!works)
+        return NULL;
+    works->qrt = qrt;
+    works->pending = NULL;
+
+    qrt->works = works;
+    fa_add_cleanup(qrt, fa_works_cleanup, works);
+
+    return works;
+}
+
+static void fa_work_finalizer (JSRuntime *rt, JSValue val) {
+    fa_work_t *w = JS_GetOpaque(val, fa_work_class_id);
+
+    if (!w)
+        return;
+
+    fa_free_promise_rt(rt, &w->promise);
+    free(w);
+}
+
+static void fa_work_mark (JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func) {
+    fa_work_t *w = JS_GetOpaque(val, fa_work_class_id);
+
+    if (w)
+        fa_mark_promise(rt, &w->promise, mark_func);
+}
+
+static JSClassDef fa_work_class = {
+    "Work",
+    .finalizer = fa_work_finalizer,
+    .gc_mark = fa_work_mark,
+};
+
+static void fa_work_cb (uv_work_t *req) {
+    fa_work_t *w = req->data;
+
+    w->work(w->opaque);
+}
+
+static void fa_work_after_cb (uv_work_t *req, int status) {
+    fa_work_t *w = req->data;
+    JSContext *ctx = w->ctx;
+    JSValue result;
+
+    if (!w->works) {
+        /* whatever the job did, its context is gone */
+        if (w->done) {
+            result = w->done(ctx, UV_ECANCELED, w->opaque);
+            if (JS_IsException(result))
+                result = JS_GetException(ctx);
+            JS_FreeValue(ctx, result);
+        }
+        JS_FreeValue(ctx, w->obj);
+        fa_release_orphan(fa_get_runtime(ctx), ctx);
+        return;
+    }
+
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        w->works->pending = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+
+    if (w->done)
+        result = w->done(ctx, status, w->opaque);
+    else if (status < 0)
+        result = JS_Throw(ctx, fa_new_uv_error(ctx, status));
+    else
+        result = JS_UNDEFINED;
+
+    if (JS_IsException(result)) {
+        JSValue error = JS_GetException(ctx);
+        fa_reject_promise(ctx, &w->promise, 1, (JSValueConst *) &error);
+    } else {
+        fa_resolve_promise(ctx, &w->promise, 1, (JSValueConst *) &result);
+    }
+
+    /* the object goes with the last reference to the promise's reactions */
+    JS_FreeValue(ctx, w->obj);
+}
+
+JSValue fa_queue_work (JSContext *ctx, fa_work_func work, fa_work_done_func done, void *opaque) {
+    JSRuntime *rt = JS_GetRuntime(ctx);
+    fa_works_t *works;
+    fa_work_t *w;
+    JSValue obj, promise;
+    int err;
+
+    if (!JS_IsRegisteredClass(rt, fa_work_class_id))
+        JS_NewClass(rt, fa_work_class_id, &fa_work_class);
+
+    works = fa_get_works(ctx);
+    if (!works)
+        return JS_ThrowOutOfMemory(ctx);
+
+    obj = JS_NewObjectClass(ctx, fa_work_class_id);
+    if (JS_IsException(obj))
+        return JS_EXCEPTION;
+
+    w = malloc(sizeof(fa_work_t));
+    if (!w) {
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    memset(w, 0, sizeof(fa_work_t));
+    w->req.data = w;
+    w->works = works;
+    w->ctx = ctx;
+    w->obj = obj;
+    w->work = work;
+    w->done = done;
+    w->opaque = opaque;
+    fa_clear_promise(ctx, &w->promise);
+    JS_SetOpaque(obj, w);
+
+    promise = fa_init_promise(ctx, &w->promise);
+    if (JS_IsException(promise)) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+
+    err = uv_queue_work(&works->qrt->loop, &w->req, fa_work_cb, fa_work_after_cb);
+    if (err < 0) {
+        JS_FreeValue(ctx, promise);
+        JS_FreeValue(ctx, obj);
+        return JS_Throw(ctx, fa_new_uv_error(ctx, err));
+    }
+
+    w->next = works->pending;
+    if (w->next)
+        w->next->prev = w;
+    works->pending = w;
+
+    return promise;
+}
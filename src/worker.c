@@ -0,0 +1,702 @@
+#include "worker.h"
+#include "runtime.h"
+#include "utils.h"
+#include "modules.h"
+#include <cutils.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+/**
+ * Workers run a script in their own runtime on their own thread. QuickJS
+ * values can't cross runtimes, so messages are serialised with
+ * JS_WriteObject on the sending side and read back on the receiving side.
+ *
+ * import { Worker, parent } from 'worker';
+ *
+ * const w = new Worker('child.js');     // source file or FaBC bundle
+ * w.onmessage = (e) => print(e.data);
+ * w.postMessage({ hello: 'world' });
+ * w.postMessage(frame, [frame]);        // transfer, frame is detached
+ * w.postMessage(new SharedArrayBuffer(n)); // shared, never copied
+ * w.terminate();
+ *
+ * Inside the worker `parent` has postMessage, close and onmessage, in the
+ * main thread it is null.
+ */
+
+typedef struct fa_worker_handle_s {
+    fa_worker_t *w;
+    fa_runtime_t *qrt;
+    JSContext *ctx;
+    /* keeps the Worker object alive while its thread runs */
+    JSValue obj;
+    uv_async_t async;
+    int closing;
+} fa_worker_handle_t;
+
+/* SharedArrayBuffers */
+
+typedef struct fa_sab_s {
+    atomic_int refcount;
+    alignas(16) uint8_t data[];
+} fa_sab_t;
+
+static void *fa_sab_alloc (void *opaque, size_t size) {
+    fa_sab_t *sab = malloc(sizeof(fa_sab_t) + size);
+    if (!sab)
+        return NULL;
+    atomic_init(&sab->refcount, 1);
+    return sab->data;
+}
+
+static void fa_sab_free (void *opaque, void *ptr) {
+    fa_sab_t *sab = (fa_sab_t *)((uint8_t *)ptr - offsetof(fa_sab_t, data));
+    if (atomic_fetch_sub(&sab->refcount, 1) == 1)
+        free(sab);
+}
+
+static void fa_sab_dup (void *opaque, void *ptr) {
+    fa_sab_t *sab = (fa_sab_t *)((uint8_t *)ptr - offsetof(fa_sab_t, data));
+    atomic_fetch_add(&sab->refcount, 1);
+}
+
+const JSSharedArrayBufferFunctions fa_sab_functions = {
+    .sab_alloc = fa_sab_alloc,
+    .sab_free = fa_sab_free,
+    .sab_dup = fa_sab_dup,
+};
+
+/* Messages */
+
+static int fa_is_shared_array_buffer (JSContext *ctx, JSValueConst val) {
+    JSValue global, ctor;
+    int ret;
+
+    global = JS_GetGlobalObject(ctx);
+    ctor = JS_GetPropertyStr(ctx, global, "SharedArrayBuffer");
+    ret = JS_IsInstanceOf(ctx, val, ctor);
+    JS_FreeValue(ctx, ctor);
+    JS_FreeValue(ctx, global);
+
+    return ret;
+}
+
+static void fa_free_transfer_list (JSContext *ctx, JSValue *tab, int64_t len) {
+    int64_t i;
+    for (i = 0; i < len; i++)
+        JS_FreeValue(ctx, tab[i]);
+    js_free(ctx, tab);
+}
+
+/* returns the number of buffers to transfer or -1, the caller frees tab */
+static int64_t fa_get_transfer_list (JSContext *ctx, JSValueConst transfer, JSValue **ptab) {
+    JSValue *tab, len_val;
+    int64_t len, i;
+    size_t size;
+
+    *ptab = NULL;
+    if (JS_IsUndefined(transfer))
+        return 0;
+
+    if (!JS_IsArray(ctx, transfer)) {
+        JS_ThrowTypeError(ctx, "transfer list must be an array");
+        return -1;
+    }
+
+    len_val = JS_GetPropertyStr(ctx, transfer, "length");
+    if (JS_ToInt64(ctx, &len, len_val)) {
+        JS_FreeValue(ctx, len_val);
+        return -1;
+    }
+    JS_FreeValue(ctx, len_val);
+    if (len == 0)
+        return 0;
+
+    tab = js_mallocz(ctx, sizeof(JSValue) * len);
+    if (!tab)
+        return -1;
+    for (i = 0; i < len; i++) {
+        tab[i] = JS_GetPropertyUint32(ctx, transfer, i);
+        if (!JS_GetArrayBuffer(ctx, &size, tab[i]) || fa_is_shared_array_buffer(ctx, tab[i])) {
+            JS_ThrowTypeError(ctx, "only ArrayBuffers can be transferred");
+            fa_free_transfer_list(ctx, tab, i + 1);
+            return -1;
+        }
+    }
+
+    *ptab = tab;
+    return len;
+}
+
+fa_message_t *fa_message_new (JSContext *ctx, JSValueConst val, JSValueConst transfer) {
+    fa_message_t *m;
+    JSValue *tab;
+    int64_t tab_len, i;
+    uint8_t *buf, **sab_tab;
+    size_t len, sab_tab_len;
+    int is_buffer = 0;
+
+    tab_len = fa_get_transfer_list(ctx, transfer, &tab);
+    if (tab_len < 0)
+        return NULL;
+
+    /* a transferred buffer sent on its own skips the serialiser */
+    for (i = 0; i < tab_len; i++) {
+        if (JS_IsObject(val) && JS_VALUE_GET_PTR(val) == JS_VALUE_GET_PTR(tab[i]))
+            is_buffer = 1;
+    }
+
+    if (is_buffer) {
+        buf = JS_GetArrayBuffer(ctx, &len, val);
+        m = malloc(sizeof(fa_message_t) + len);
+        if (!m)
+            goto oom;
+        memset(m, 0, sizeof(fa_message_t));
+        m->is_buffer = 1;
+        m->len = len;
+        memcpy(m->data, buf, len);
+    } else {
+        buf = JS_WriteObject2(ctx, &len, val, JS_WRITE_OBJ_REFERENCE | JS_WRITE_OBJ_SAB,
+                              &sab_tab, &sab_tab_len);
+        if (!buf)
+            goto fail;
+
+        /* the JS buffers belong to the sending runtime */
+        m = malloc(sizeof(fa_message_t) + len);
+        if (!m) {
+            js_free(ctx, buf);
+            js_free(ctx, sab_tab);
+            goto oom;
+        }
+        memset(m, 0, sizeof(fa_message_t));
+        m->len = len;
+        memcpy(m->data, buf, len);
+        js_free(ctx, buf);
+
+        if (sab_tab_len > 0) {
+            m->sab_tab = malloc(sizeof(uint8_t *) * sab_tab_len);
+            if (!m->sab_tab) {
+                js_free(ctx, sab_tab);
+                free(m);
+                goto oom;
+            }
+            /* the shared memory lives as long as the message holds it */
+            for (i = 0; i < sab_tab_len; i++) {
+                fa_sab_dup(NULL, sab_tab[i]);
+                m->sab_tab[i] = sab_tab[i];
+            }
+            m->sab_tab_len = sab_tab_len;
+        }
+        js_free(ctx, sab_tab);
+    }
+
+    /* the sender loses access to transferred buffers */
+    for (i = 0; i < tab_len; i++)
+        JS_DetachArrayBuffer(ctx, tab[i]);
+    fa_free_transfer_list(ctx, tab, tab_len);
+
+    return m;
+
+oom:
+    JS_ThrowOutOfMemory(ctx);
+fail:
+    fa_free_transfer_list(ctx, tab, tab_len);
+    return NULL;
+}
+
+static void fa_message_free_buffer (JSRuntime *rt, void *opaque, void *ptr) {
+    fa_message_free(opaque);
+}
+
+JSValue fa_message_read (JSContext *ctx, fa_message_t *m) {
+    JSValue val;
+
+    /* the receiving runtime adopts the message as the buffer's storage */
+    if (m->is_buffer) {
+        val = JS_NewArrayBuffer(ctx, m->data, m->len, fa_message_free_buffer, m, 0);
+        if (JS_IsException(val))
+            fa_message_free(m);
+        return val;
+    }
+
+    /* shared buffers take their own references while being read */
+    val = JS_ReadObject(ctx, m->data, m->len, JS_READ_OBJ_REFERENCE | JS_READ_OBJ_SAB);
+    fa_message_free(m);
+    return val;
+}
+
+void fa_message_free (fa_message_t *m) {
+    size_t i;
+    for (i = 0; i < m->sab_tab_len; i++)
+        fa_sab_free(NULL, m->sab_tab[i]);
+    free(m->sab_tab);
+    free(m);
+}
+static void fa_message_queue_push (fa_message_queue_t *q, fa_message_t *m) {
+    if (q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+    q->tail = m;
+}
+
+/* takes the whole queue, call with the lock held */
+static fa_message_t *fa_message_queue_take (fa_message_queue_t *q) {
+    fa_message_t *m = q->head;
+    q->head = q->tail = NULL;
+    return m;
+}
+
+static void fa_message_list_free (fa_message_t *m) {
+    while (m) {
+        fa_message_t *next = m->next;
+        fa_message_free(m);
+        m = next;
+    }
+}
+
+static void fa_worker_unref (fa_worker_t *w) {
+    int refcount;
+
+    uv_mutex_lock(&w->lock);
+    refcount = --w->refcount;
+    uv_mutex_unlock(&w->lock);
+
+    if (refcount > 0)
+        return;
+
+    fa_message_list_free(w->to_worker.head);
+    fa_message_list_free(w->to_parent.head);
+    uv_mutex_destroy(&w->lock);
+    free(w->filename);
+    free(w);
+}
+
+/* calls target.onmessage({ data }) and consumes the message, messages 
+   without a handler are dropped */
+static void fa_worker_dispatch (JSContext *ctx, JSValueConst target, fa_message_t *m) {
+    JSValue data, handler, ev, ret;
+
+    data = fa_message_read(ctx, m);
+    if (JS_IsException(data)) {
+        fa_dump_error(ctx);
+        return;
+    }
+
+    handler = JS_GetPropertyStr(ctx, target, "onmessage");
+    if (JS_IsFunction(ctx, handler)) {
+        ev = JS_NewObject(ctx);
+        JS_SetPropertyStr(ctx, ev, "data", data);
+        ret = JS_Call(ctx, handler, target, 1, (JSValueConst *)&ev);
+        fa_eval_std_free(ctx, ret);
+        JS_FreeValue(ctx, ev);
+    } else {
+        JS_FreeValue(ctx, data);
+    }
+    JS_FreeValue(ctx, handler);
+}
+
+static int fa_worker_post (
+    JSContext *ctx,
+    fa_worker_t *w,
+    int to_worker,
+    JSValueConst val,
+    JSValueConst transfer
+) {
+    fa_message_t *m = fa_message_new(ctx, val, transfer);
+    if (!m)
+        return -1;
+
+    uv_mutex_lock(&w->lock);
+    if (to_worker) {
+        if (w->exited) {
+            fa_message_free(m);
+        } else {
+            fa_message_queue_push(&w->to_worker, m);
+            /* queued messages are flushed once the worker loop is set up */
+            if (w->worker_async)
+                uv_async_send(w->worker_async);
+        }
+    } else {
+        if (w->parent_async) {
+            fa_message_queue_push(&w->to_parent, m);
+            uv_async_send(w->parent_async);
+        } else {
+            fa_message_free(m);
+        }
+    }
+    uv_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/* Worker thread */
+
+int fa_worker_is_terminating (fa_worker_t *w) {
+    int terminating;
+
+    uv_mutex_lock(&w->lock);
+    terminating = w->terminating;
+    uv_mutex_unlock(&w->lock);
+
+    return terminating;
+}
+
+static void fa_worker_on_parent_message (uv_async_t *handle) {
+    fa_worker_t *w = handle->data;
+    JSContext *ctx = w->worker_rt->ctx;
+    fa_message_t *m, *next;
+
+    uv_mutex_lock(&w->lock);
+    m = fa_message_queue_take(&w->to_worker);
+    uv_mutex_unlock(&w->lock);
+
+    for (; m != NULL; m = next) {
+        next = m->next;
+        if (!JS_IsUndefined(w->port))
+            fa_worker_dispatch(ctx, w->port, m);
+        else
+            fa_message_free(m);
+    }
+}
+
+static int fa_worker_eval (fa_runtime_t *qrt, const char *filename) {
+    JSContext *ctx = qrt->ctx;
+    uint8_t *buf;
+    size_t buf_len;
+    int is_bundle;
+
+    buf = fa_load_file(ctx, &buf_len, filename);
+    if (!buf) {
+        fprintf(stderr, "Could not load worker script '%s'\n", filename);
+        return -1;
+    }
+
+    is_bundle = buf_len >= 4 && !memcmp(buf, "FaBC", 4);
+    if (is_bundle) {
+        /* bundles are mapped instead, modules are read from it lazily */
+        js_free(ctx, buf);
+        return fa_eval_bin_bundle_file(ctx, filename, 0);
+    }
+
+    return fa_eval_std_free(ctx, fa_eval_buf(ctx, buf, buf_len, filename, JS_EVAL_TYPE_MODULE));
+}
+
+static void fa_worker_thread (void *opaque) {
+    fa_worker_t *w = opaque;
+    fa_runtime_t *qrt;
+    int terminating;
+
+    qrt = fa_new_runtime_impl(NULL, 1);
+    qrt->worker = w;
+
+    js_init_module_std(qrt->ctx, "std");
+    js_init_module_worker(qrt->ctx, "worker");
+    js_init_module_timers(qrt->ctx, "timers");
+    js_init_module_fs(qrt->ctx, "fs");
+
+    FA_CHECK(uv_async_init(&qrt->loop, &w->worker_async_handle, fa_worker_on_parent_message) == 0);
+    w->worker_async_handle.data = w;
+
+    uv_mutex_lock(&w->lock);
+    w->worker_rt = qrt;
+    w->worker_async = &w->worker_async_handle;
+    terminating = w->terminating;
+    uv_mutex_unlock(&w->lock);
+
+    if (!terminating) {
+        /* deliver what was posted before the thread was up */
+        uv_async_send(&w->worker_async_handle);
+
+        /* worker loops run until parent.close() or terminate() */
+        if (fa_worker_eval(qrt, w->filename) == 0)
+            fa_run(qrt);
+    }
+
+    uv_mutex_lock(&w->lock);
+    w->worker_rt = NULL;
+    w->worker_async = NULL;
+    w->exited = 1;
+    if (w->parent_async)
+        uv_async_send(w->parent_async);
+    uv_mutex_unlock(&w->lock);
+
+    uv_close((uv_handle_t *) &w->worker_async_handle, NULL);
+    fa_free_runtime(qrt);
+
+    fa_worker_unref(w);
+}
+
+/* Parent side */
+
+static void fa_worker_handle_on_close (uv_handle_t *handle) {
+    fa_worker_handle_t *h = handle->data;
+    fa_runtime_t *qrt = h->qrt;
+    JSContext *ctx = h->ctx;
+
+    /* may run the finalizer, which frees h */
+    JS_FreeValue(ctx, h->obj);
+    fa_release_orphan(qrt, ctx);
+}
+
+/* the context may be freed before the close callback runs */
+static void fa_worker_handle_uv_close (fa_worker_handle_t *h) {
+    fa_hold_orphan(h->qrt, h->ctx);
+    uv_close((uv_handle_t *) &h->async, fa_worker_handle_on_close);
+}
+
+static void fa_worker_handle_cleanup (fa_runtime_t *qrt, void *opaque);
+
+static void fa_worker_handle_close (fa_worker_handle_t *h) {
+    fa_worker_t *w = h->w;
+
+    if (h->closing)
+        return;
+    h->closing = 1;
+
+    uv_mutex_lock(&w->lock);
+    w->terminating = 1;
+    w->parent_async = NULL;
+    if (w->worker_rt)
+        fa_stop(w->worker_rt);
+    uv_mutex_unlock(&w->lock);
+
+    uv_thread_join(&w->thread);
+
+    fa_remove_cleanup(h->qrt, fa_worker_handle_cleanup, h);
+    fa_worker_handle_uv_close(h);
+}
+
+static void fa_worker_handle_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_worker_handle_close(opaque);
+}
+
+static void fa_worker_on_worker_message (uv_async_t *handle) {
+    fa_worker_handle_t *h = handle->data;
+    fa_worker_t *w = h->w;
+    fa_message_t *m, *next;
+    int exited;
+
+    uv_mutex_lock(&w->lock);
+    m = fa_message_queue_take(&w->to_parent);
+    exited = w->exited;
+    uv_mutex_unlock(&w->lock);
+
+    for (; m != NULL; m = next) {
+        next = m->next;
+        /* onmessage may terminate the worker */
+        if (!h->closing)
+            fa_worker_dispatch(h->ctx, h->obj, m);
+        else
+            fa_message_free(m);
+    }
+
+    if (exited)
+        fa_worker_handle_close(h);
+}
+
+static void fa_worker_finalizer (JSRuntime *rt, JSValue val) {
+    fa_worker_handle_t *h = JS_GetOpaque(val, fa_worker_class_id);
+    if (h) {
+        fa_worker_unref(h->w);
+        free(h);
+    }
+}
+
+static JSClassDef fa_worker_class = {
+    "Worker",
+    .finalizer = fa_worker_finalizer,
+};
+
+static JSValue fa_worker_ctor (
+    JSContext *ctx,
+    JSValueConst new_target,
+    int argc,
+    JSValueConst *argv
+) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    fa_worker_handle_t *h;
+    fa_worker_t *w;
+    JSValue proto, obj;
+    const char *filename;
+
+    filename = JS_ToCString(ctx, argv[0]);
+    if (!filename)
+        return JS_EXCEPTION;
+
+    proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+    if (JS_IsException(proto))
+        goto fail_filename;
+    obj = JS_NewObjectProtoClass(ctx, proto, fa_worker_class_id);
+    JS_FreeValue(ctx, proto);
+    if (JS_IsException(obj))
+        goto fail_filename;
+
+    w = malloc(sizeof(fa_worker_t));
+    h = malloc(sizeof(fa_worker_handle_t));
+    if (!w || !h) {
+        free(w);
+        free(h);
+        JS_ThrowOutOfMemory(ctx);
+        goto fail_obj;
+    }
+    memset(w, 0, sizeof(fa_worker_t));
+    memset(h, 0, sizeof(fa_worker_handle_t));
+
+    FA_CHECK(uv_mutex_init(&w->lock) == 0);
+    w->refcount = 2;
+    w->filename = strdup(filename);
+    w->port = JS_UNDEFINED;
+    w->parent_async = &h->async;
+
+    h->w = w;
+    h->qrt = qrt;
+    h->ctx = ctx;
+    h->obj = JS_DupValue(ctx, obj);
+
+    FA_CHECK(uv_async_init(&qrt->loop, &h->async, fa_worker_on_worker_message) == 0);
+    h->async.data = h;
+
+    if (uv_thread_create(&w->thread, fa_worker_thread, w) != 0) {
+        JS_ThrowInternalError(ctx, "could not start worker thread");
+        /* nothing else holds the shared state */
+        w->refcount = 1;
+        fa_worker_handle_uv_close(h);
+        JS_SetOpaque(obj, h);
+        goto fail_obj;
+    }
+
+    JS_SetOpaque(obj, h);
+    /* the thread is joined before the context goes away */
+    fa_add_context_cleanup(ctx, fa_worker_handle_cleanup, h);
+
+    JS_FreeCString(ctx, filename);
+    return obj;
+
+fail_obj:
+    JS_FreeValue(ctx, obj);
+fail_filename:
+    JS_FreeCString(ctx, filename);
+    return JS_EXCEPTION;
+}
+
+static JSValue fa_worker_post_message (
+    JSContext *ctx,
+    JSValueConst this_val,
+    int argc,
+    JSValueConst *argv
+) {
+    fa_worker_handle_t *h = JS_GetOpaque2(ctx, this_val, fa_worker_class_id);
+    if (!h)
+        return JS_EXCEPTION;
+    if (h->closing)
+        return JS_UNDEFINED;
+    if (fa_worker_post(ctx, h->w, 1, argv[0], argc > 1 ? argv[1] : JS_UNDEFINED) < 0)
+        return JS_EXCEPTION;
+    return JS_UNDEFINED;
+}
+
+static JSValue fa_worker_terminate (
+    JSContext *ctx,
+    JSValueConst this_val,
+    int argc,
+    JSValueConst *argv
+) {
+    fa_worker_handle_t *h = JS_GetOpaque2(ctx, this_val, fa_worker_class_id);
+    if (!h)
+        return JS_EXCEPTION;
+    fa_worker_handle_close(h);
+    return JS_UNDEFINED;
+}
+
+static const JSCFunctionListEntry fa_worker_proto_funcs[] = {
+    JS_CFUNC_DEF("postMessage", 1, fa_worker_post_message),
+    JS_CFUNC_DEF("terminate", 0, fa_worker_terminate),
+    JS_PROP_STRING_DEF("[Symbol.toStringTag]", "Worker", JS_PROP_CONFIGURABLE),
+};
+
+/* Worker side port */
+
+static JSValue fa_parent_post_message (
+    JSContext *ctx,
+    JSValueConst this_val,
+    int argc,
+    JSValueConst *argv
+) {
+    fa_worker_t *w = fa_get_runtime(ctx)->worker;
+    if (fa_worker_post(ctx, w, 0, argv[0], argc > 1 ? argv[1] : JS_UNDEFINED) < 0)
+        return JS_EXCEPTION;
+    return JS_UNDEFINED;
+}
+
+static JSValue fa_parent_close (
+    JSContext *ctx,
+    JSValueConst this_val,
+    int argc,
+    JSValueConst *argv
+) {
+    fa_stop(fa_get_runtime(ctx));
+    return JS_UNDEFINED;
+}
+
+static const JSCFunctionListEntry fa_parent_funcs[] = {
+    JS_CFUNC_DEF("postMessage", 1, fa_parent_post_message),
+    JS_CFUNC_DEF("close", 0, fa_parent_close),
+};
+
+static void fa_parent_port_cleanup (fa_runtime_t *qrt, void *opaque) {
+    fa_worker_t *w = opaque;
+    JS_FreeValue(qrt->ctx, w->port);
+    w->port = JS_UNDEFINED;
+}
+
+static JSValue fa_worker_get_port (JSContext *ctx) {
+    fa_runtime_t *qrt = fa_get_runtime(ctx);
+    fa_worker_t *w = qrt->worker;
+
+    if (!w)
+        return JS_NULL;
+
+    if (JS_IsUndefined(w->port)) {
+        w->port = JS_NewObject(ctx);
+        JS_SetPropertyFunctionList(ctx, w->port, fa_parent_funcs, countof(fa_parent_funcs));
+        fa_add_cleanup(qrt, fa_parent_port_cleanup, w);
+    }
+
+    return JS_DupValue(ctx, w->port);
+}
+
+/* Module */
+
+static int js_worker_init (JSContext *ctx, JSModuleDef *m) {
+    JSRuntime *rt = JS_GetRuntime(ctx);
+    JSValue proto, ctor;
+
+    /* class ids are global, classes are registered per runtime */
+    if (!JS_IsRegisteredClass(rt, fa_worker_class_id))
+        JS_NewClass(rt, fa_worker_class_id, &fa_worker_class);
+
+    proto = JS_NewObject(ctx);
+    JS_SetPropertyFunctionList(ctx, proto, fa_worker_proto_funcs, countof(fa_worker_proto_funcs));
+
+    ctor = JS_NewCFunction2(ctx, fa_worker_ctor, "Worker", 1, JS_CFUNC_constructor, 0);
+    JS_SetConstructor(ctx, ctor, proto);
+    JS_SetClassProto(ctx, fa_worker_class_id, proto);
+
+    JS_SetModuleExport(ctx, m, "Worker", ctor);
+    JS_SetModuleExport(ctx, m, "parent", fa_worker_get_port(ctx));
+
+    return 0;
+}
+
+JSModuleDef *js_init_module_worker (JSContext *ctx, const char *module_name) {
+    JSModuleDef *m;
+    m = JS_NewCModule(ctx, module_name, js_worker_init);
+    if (!m) return NULL;
+    JS_AddModuleExport(ctx, m, "Worker");
+    JS_AddModuleExport(ctx, m, "parent");
+    return m;
+}
@@ -0,0 +1,67 @@
+#ifndef FA_WORKER_H
+#define FA_WORKER_H
+
+#include "fireant.h"
+#include <uv.h>
+#include <stdalign.h>
+
+/**
+ * A structured clone of a value, owned by whichever queue it sits in.
+ * SharedArrayBuffers are not copied, the message holds a reference to each
+ * one in sab_tab. A transferred ArrayBuffer sent on its own is stored raw
+ * and adopted by the receiving runtime without another copy.
+ */
+typedef struct fa_message_s {
+    struct fa_message_s *next;
+    uint8_t **sab_tab;
+    size_t sab_tab_len;
+    int is_buffer;
+    size_t len;
+    /* typed array views of an adopted buffer need the alignment */
+    alignas(16) uint8_t data[];
+} fa_message_t;
+
+typedef struct fa_message_queue_s {
+    fa_message_t *head;
+    fa_message_t *tail;
+} fa_message_queue_t;
+
+/**
+ * State shared by a worker thread and the runtime which started it. Both
+ * sides hold a reference, everything below the lock is guarded by it.
+ */
+typedef struct fa_worker_s {
+    uv_mutex_t lock;
+    int refcount;
+    fa_message_queue_t to_worker;
+    fa_message_queue_t to_parent;
+    /* NULL once the parent stopped listening */
+    uv_async_t *parent_async;
+    /* NULL until the worker loop is set up and after it exited */
+    uv_async_t *worker_async;
+    fa_runtime_t *worker_rt;
+    int terminating;
+    int exited;
+
+    /* only touched by the worker thread */
+    uv_async_t worker_async_handle;
+    JSValue port;
+
+    uv_thread_t thread;
+    char *filename;
+} fa_worker_t;
+
+/* terminate() was called, checked by the worker runtime's interrupt handler */
+int fa_worker_is_terminating (fa_worker_t *w);
+
+/* SharedArrayBuffer allocator installed in every runtime, the memory is
+   refcounted so buffers can be shared by runtimes on other threads */
+extern const JSSharedArrayBufferFunctions fa_sab_functions;
+
+/* transfer is undefined or an array of ArrayBuffers to detach once sent */
+fa_message_t *fa_message_new (JSContext *ctx, JSValueConst val, JSValueConst transfer);
+/* consumes the message */
+JSValue fa_message_read (JSContext *ctx, fa_message_t *m);
+void fa_message_free (fa_message_t *m);
+
+#endif